@@ -14,14 +14,41 @@
  * OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#include <limits.h>
 #include <math.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 #include "fluid.h"
 
 #define INLINE __inline
+/* For helpers specialized by constant arguments, which must be inlined */
+#if defined(_MSC_VER)
+#define FORCE_INLINE __forceinline
+#elif defined(__GNUC__)
+#define FORCE_INLINE __inline __attribute__((always_inline))
+#else
+#define FORCE_INLINE __inline
+#endif
+
+/* SIMD instruction sets available at compile time, define FLUID_NO_SIMD to
+ * use portable code only
+ */
+#if !defined(FLUID_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define FLUID_SSE2
+#include <emmintrin.h>
+#endif
+#if defined(FLUID_SSE2) && (defined(__SSSE3__) || defined(__AVX__))
+#define FLUID_SSSE3
+#include <tmmintrin.h>
+#endif
 
 /* General helpers */
 #define LOBYTE(x) ((unsigned char) (x) & 0x0F)
@@ -32,6 +59,8 @@
 #define EXTRACT_UINT8(data, x) \
 	{ x = (uint8_t)*(data)++; }
 #define GET_UINT16_BIG(data) (((data)[0] << 8) | (data)[1])
+#define GET_UINT32_BIG(data) \
+	(((uint32_t) (data)[0] << 24) | ((uint32_t) (data)[1] << 16) | ((uint32_t) (data)[2] << 8) | (data)[3])
 #define EXTRACT_UINT16_BIG(data, x) \
 	{ x = GET_UINT16_BIG(data); (data) += 2; }
 #define EXTRACT_UINT16_LITTLE(data, x) \
@@ -43,62 +72,189 @@
 #define EXTRACT_UINT32_LITTLE(data, x) \
 	{ x = *(uint32_t *)(data); (data) += 4; }
 
-static int extract_bits_big(const unsigned char **data, int *bit, int *size, int bits)
+#if defined(_MSC_VER)
+#define BSWAP64(x) _byteswap_uint64(x)
+#elif defined(__GNUC__)
+#define BSWAP64(x) __builtin_bswap64(x)
+#else
+#define BSWAP64(x) \
+	((((x) & 0xFF) << 56) | (((x) & 0xFF00) << 40) | (((x) & 0xFF0000) << 24) | (((x) & 0xFF000000) << 8) | \
+	(((x) >> 8) & 0xFF000000) | (((x) >> 24) & 0xFF0000) | (((x) >> 40) & 0xFF00) | ((x) >> 56))
+#endif
+
+static INLINE uint32_t load_uint32_little(const unsigned char *data)
 {
-	int x;
-	if (*bit == 8)
-	{
-		*bit = 0;
-		(*data)++, (*size)--;
-	}
-	if (*bit + bits <= 8)
-	{
-		x = ((*data)[0] >> (8 - (*bit + bits))) & BITMASK(bits);
-		*bit += bits;
-	}
-	else if (*bit + bits <= 16)
+	uint32_t x;
+	memcpy(&x, data, 4);
+	return x;
+}
+
+static INLINE uint64_t load_uint64_little(const unsigned char *data)
+{
+	uint64_t x;
+	memcpy(&x, data, 8);
+	return x;
+}
+
+/* Bit reader
+ * Bits are kept in a 64-bit accumulator which is refilled with a single
+ * unaligned load, so the end of data is only checked once per refill.
+ * After a refill at least 56 bits are available, the caller may extract
+ * up to that many bits without checking again.
+ * Data may be split into several segments, when the current one is used
+ * up next_segment is asked for the following one, so segment boundaries
+ * are crossed transparently.
+ * Past the end of data zero bytes are fed and counted in overrun.
+ */
+typedef struct
+{
+	const unsigned char *data, *end;
+	uint64_t buf;
+	int count; /* Number of valid bits in buf */
+	int overrun; /* Number of zero bytes fed past the end */
+	/* Segmented data, return 0 if there are no more segments */
+	int (*next_segment)(void *source, const unsigned char **data, const unsigned char **end);
+	void *source;
+} BIT_reader;
+
+/* Whether bits past the end of data have been consumed */
+#define BITS_OVERRUN(br) ((br)->count < (br)->overrun * 8)
+
+static INLINE void init_bits(BIT_reader *br, const unsigned char *data, int size)
+{
+	br->data = data;
+	br->end = data + size;
+	br->buf = 0;
+	br->count = 0;
+	br->overrun = 0;
+	br->next_segment = NULL;
+	br->source = NULL;
+}
+
+/* Move to next non-empty segment */
+static int next_bits_segment(BIT_reader *br)
+{
+	while (br->next_segment && br->next_segment(br->source, &br->data, &br->end))
+		if (br->data < br->end)
+			return 1;
+	return 0;
+}
+
+/* Little endian: bits are consumed from the least-significant end of buf */
+static void refill_bits_little_slow(BIT_reader *br)
+{
+	while (br->count < 56)
 	{
-		x = ((((*data)[0] << 8) | (*data)[1]) >> (16 - (*bit + bits))) & BITMASK(bits);
-		*bit += bits - 8;
-		(*data)++, (*size)--;
+		if (br->data < br->end || next_bits_segment(br))
+			br->buf |= (uint64_t) *br->data++ << br->count;
+		else
+			br->overrun++;
+		br->count += 8;
 	}
-	else if (*bit + bits <= 24)
+}
+
+static INLINE void refill_bits_little(BIT_reader *br)
+{
+	if (br->end - br->data >= 8)
 	{
-		x = ((((*data)[0] << 16) | (*data)[1] << 8 | (*data)[2]) >> (24 - (*bit + bits))) & BITMASK(bits);
-		*bit += bits - 16;
-		(*data) += 2, (*size) -= 2;
+		br->buf |= load_uint64_little(br->data) << br->count;
+		br->data += (63 - br->count) >> 3;
+		br->count |= 56;
 	}
+	else
+		refill_bits_little_slow(br);
+}
+
+static INLINE unsigned int peek_bits_little(const BIT_reader *br, int bits)
+{
+	return (unsigned int) br->buf & BITMASK(bits);
+}
+
+static INLINE void skip_bits_little(BIT_reader *br, int bits)
+{
+	br->buf >>= bits;
+	br->count -= bits;
+}
+
+/* Caller must make sure enough bits are available */
+static INLINE unsigned int extract_bits_little(BIT_reader *br, int bits)
+{
+	unsigned int x;
+	x = peek_bits_little(br, bits);
+	skip_bits_little(br, bits);
 	return x;
 }
 
-static int extract_bits_little(const unsigned char **data, int *bit, int *size, int bits)
+/* Copy whole bytes after aligning to byte boundary */
+static int copy_bytes_little(BIT_reader *br, unsigned char *dest, int len)
 {
-	int x;
-	if (*bit == 8)
-	{
-		*bit = 0;
-		(*data)++, (*size)--;
-	}
-	if (*bit + bits <= 8)
+	int n;
+	skip_bits_little(br, br->count & 7);
+	for (; len > 0 && br->count > 0; len--)
+		*dest++ = extract_bits_little(br, 8);
+	if (br->count == 0) /* Drop bits loaded ahead */
+		br->buf = 0;
+	if (BITS_OVERRUN(br))
+		return 0;
+	while (len > 0)
 	{
-		x = ((*data)[0] >> *bit) & BITMASK(bits);
-		*bit += bits;
+		if (br->data == br->end && !next_bits_segment(br))
+			return 0;
+		n = (int) (br->end - br->data);
+		if (n > len)
+			n = len;
+		memcpy(dest, br->data, n);
+		br->data += n;
+		dest += n;
+		len -= n;
 	}
-	else if (*bit + bits <= 16)
+	return 1;
+}
+
+/* Big endian: bits are consumed from the most-significant end of buf */
+static void refill_bits_big_slow(BIT_reader *br)
+{
+	while (br->count < 56)
 	{
-		x = ((((*data)[1] << 8) | (*data)[0]) >> *bit) & BITMASK(bits);
-		*bit += bits - 8;
-		(*data)++, (*size)--;
+		if (br->data < br->end || next_bits_segment(br))
+			br->buf |= (uint64_t) *br->data++ << (56 - br->count);
+		else
+			br->overrun++;
+		br->count += 8;
 	}
-	else if (*bit + bits <= 24)
+}
+
+static INLINE void refill_bits_big(BIT_reader *br)
+{
+	if (br->end - br->data >= 8)
 	{
-		x = ((((*data)[2] << 16) | (*data)[1] << 8 | (*data)[0]) >> *bit) & BITMASK(bits);
-		*bit += bits - 16;
-		(*data) += 2, (*size) -= 2;
+		br->buf |= BSWAP64(load_uint64_little(br->data)) >> br->count;
+		br->data += (63 - br->count) >> 3;
+		br->count |= 56;
 	}
+	else
+		refill_bits_big_slow(br);
+}
+
+/* Extract 1 to 32 bits, refilling if necessary */
+static INLINE unsigned int extract_bits_big(BIT_reader *br, int bits)
+{
+	unsigned int x;
+	if (br->count < bits)
+		refill_bits_big(br);
+	x = (unsigned int) (br->buf >> (64 - bits));
+	br->buf <<= bits;
+	br->count -= bits;
 	return x;
 }
 
+/* Skip remaining bits of current byte */
+static INLINE void align_bits_big(BIT_reader *br)
+{
+	br->buf <<= br->count & 7;
+	br->count &= ~7;
+}
+
 /* Rescale sample from depth-bit to 8-bit */
 static INLINE unsigned int sample_rescale(unsigned int depth, unsigned int sample)
 {
@@ -124,24 +280,598 @@ static INLINE int color_clamp(int c)
 	return c;
 }
 
+/* Bytes per pixel of FLUID_LAYOUT_* */
+static const int layout_pixel_size[9] = { 4, 1, 2, 3, 2, 4, 6, 8, 1 };
+
+#define LAYOUT_PALETTE_SIZE	(256 * 4) /* Palette after the indices of FLUID_LAYOUT_INDEX8 */
+
+/* Rectangle [x0, x1) x [y0, y1) of an image */
+typedef struct
+{
+	int x0, y0, x1, y1;
+} IMAGE_region;
+
+/* Copy region of image to a new buffer, with tail bytes left after it
+ * Return: Region, or NULL if failed
+ */
+static unsigned char *crop_image(const unsigned char *image, int width, int pixel_size, const IMAGE_region *region, int tail)
+{
+	unsigned char *dest;
+	size_t len;
+	int i;
+
+	len = (size_t) (region->x1 - region->x0) * pixel_size;
+	dest = malloc(len * (region->y1 - region->y0) + tail);
+	if (!dest)
+		return NULL;
+	for (i = region->y0; i < region->y1; i++)
+		memcpy(dest + (i - region->y0) * len, image + ((size_t) i * width + region->x0) * pixel_size, len);
+	return dest;
+}
+
+/* Checksums */
+/* CRC-32 of PNG chunks, processed 8 bytes at a time: CRC32_TABLE[k][i] is the
+ * CRC of byte i followed by k zero bytes
+ */
+static const uint32_t CRC32_TABLE[8][256] = {
+	{
+		0x00000000, 0x77073096, 0xEE0E612C, 0x990951BA, 0x076DC419, 0x706AF48F, 0xE963A535, 0x9E6495A3,
+		0x0EDB8832, 0x79DCB8A4, 0xE0D5E91E, 0x97D2D988, 0x09B64C2B, 0x7EB17CBD, 0xE7B82D07, 0x90BF1D91,
+		0x1DB71064, 0x6AB020F2, 0xF3B97148, 0x84BE41DE, 0x1ADAD47D, 0x6DDDE4EB, 0xF4D4B551, 0x83D385C7,
+		0x136C9856, 0x646BA8C0, 0xFD62F97A, 0x8A65C9EC, 0x14015C4F, 0x63066CD9, 0xFA0F3D63, 0x8D080DF5,
+		0x3B6E20C8, 0x4C69105E, 0xD56041E4, 0xA2677172, 0x3C03E4D1, 0x4B04D447, 0xD20D85FD, 0xA50AB56B,
+		0x35B5A8FA, 0x42B2986C, 0xDBBBC9D6, 0xACBCF940, 0x32D86CE3, 0x45DF5C75, 0xDCD60DCF, 0xABD13D59,
+		0x26D930AC, 0x51DE003A, 0xC8D75180, 0xBFD06116, 0x21B4F4B5, 0x56B3C423, 0xCFBA9599, 0xB8BDA50F,
+		0x2802B89E, 0x5F058808, 0xC60CD9B2, 0xB10BE924, 0x2F6F7C87, 0x58684C11, 0xC1611DAB, 0xB6662D3D,
+		0x76DC4190, 0x01DB7106, 0x98D220BC, 0xEFD5102A, 0x71B18589, 0x06B6B51F, 0x9FBFE4A5, 0xE8B8D433,
+		0x7807C9A2, 0x0F00F934, 0x9609A88E, 0xE10E9818, 0x7F6A0DBB, 0x086D3D2D, 0x91646C97, 0xE6635C01,
+		0x6B6B51F4, 0x1C6C6162, 0x856530D8, 0xF262004E, 0x6C0695ED, 0x1B01A57B, 0x8208F4C1, 0xF50FC457,
+		0x65B0D9C6, 0x12B7E950, 0x8BBEB8EA, 0xFCB9887C, 0x62DD1DDF, 0x15DA2D49, 0x8CD37CF3, 0xFBD44C65,
+		0x4DB26158, 0x3AB551CE, 0xA3BC0074, 0xD4BB30E2, 0x4ADFA541, 0x3DD895D7, 0xA4D1C46D, 0xD3D6F4FB,
+		0x4369E96A, 0x346ED9FC, 0xAD678846, 0xDA60B8D0, 0x44042D73, 0x33031DE5, 0xAA0A4C5F, 0xDD0D7CC9,
+		0x5005713C, 0x270241AA, 0xBE0B1010, 0xC90C2086, 0x5768B525, 0x206F85B3, 0xB966D409, 0xCE61E49F,
+		0x5EDEF90E, 0x29D9C998, 0xB0D09822, 0xC7D7A8B4, 0x59B33D17, 0x2EB40D81, 0xB7BD5C3B, 0xC0BA6CAD,
+		0xEDB88320, 0x9ABFB3B6, 0x03B6E20C, 0x74B1D29A, 0xEAD54739, 0x9DD277AF, 0x04DB2615, 0x73DC1683,
+		0xE3630B12, 0x94643B84, 0x0D6D6A3E, 0x7A6A5AA8, 0xE40ECF0B, 0x9309FF9D, 0x0A00AE27, 0x7D079EB1,
+		0xF00F9344, 0x8708A3D2, 0x1E01F268, 0x6906C2FE, 0xF762575D, 0x806567CB, 0x196C3671, 0x6E6B06E7,
+		0xFED41B76, 0x89D32BE0, 0x10DA7A5A, 0x67DD4ACC, 0xF9B9DF6F, 0x8EBEEFF9, 0x17B7BE43, 0x60B08ED5,
+		0xD6D6A3E8, 0xA1D1937E, 0x38D8C2C4, 0x4FDFF252, 0xD1BB67F1, 0xA6BC5767, 0x3FB506DD, 0x48B2364B,
+		0xD80D2BDA, 0xAF0A1B4C, 0x36034AF6, 0x41047A60, 0xDF60EFC3, 0xA867DF55, 0x316E8EEF, 0x4669BE79,
+		0xCB61B38C, 0xBC66831A, 0x256FD2A0, 0x5268E236, 0xCC0C7795, 0xBB0B4703, 0x220216B9, 0x5505262F,
+		0xC5BA3BBE, 0xB2BD0B28, 0x2BB45A92, 0x5CB36A04, 0xC2D7FFA7, 0xB5D0CF31, 0x2CD99E8B, 0x5BDEAE1D,
+		0x9B64C2B0, 0xEC63F226, 0x756AA39C, 0x026D930A, 0x9C0906A9, 0xEB0E363F, 0x72076785, 0x05005713,
+		0x95BF4A82, 0xE2B87A14, 0x7BB12BAE, 0x0CB61B38, 0x92D28E9B, 0xE5D5BE0D, 0x7CDCEFB7, 0x0BDBDF21,
+		0x86D3D2D4, 0xF1D4E242, 0x68DDB3F8, 0x1FDA836E, 0x81BE16CD, 0xF6B9265B, 0x6FB077E1, 0x18B74777,
+		0x88085AE6, 0xFF0F6A70, 0x66063BCA, 0x11010B5C, 0x8F659EFF, 0xF862AE69, 0x616BFFD3, 0x166CCF45,
+		0xA00AE278, 0xD70DD2EE, 0x4E048354, 0x3903B3C2, 0xA7672661, 0xD06016F7, 0x4969474D, 0x3E6E77DB,
+		0xAED16A4A, 0xD9D65ADC, 0x40DF0B66, 0x37D83BF0, 0xA9BCAE53, 0xDEBB9EC5, 0x47B2CF7F, 0x30B5FFE9,
+		0xBDBDF21C, 0xCABAC28A, 0x53B39330, 0x24B4A3A6, 0xBAD03605, 0xCDD70693, 0x54DE5729, 0x23D967BF,
+		0xB3667A2E, 0xC4614AB8, 0x5D681B02, 0x2A6F2B94, 0xB40BBE37, 0xC30C8EA1, 0x5A05DF1B, 0x2D02EF8D
+	},
+	{
+		0x00000000, 0x191B3141, 0x32366282, 0x2B2D53C3, 0x646CC504, 0x7D77F445, 0x565AA786, 0x4F4196C7,
+		0xC8D98A08, 0xD1C2BB49, 0xFAEFE88A, 0xE3F4D9CB, 0xACB54F0C, 0xB5AE7E4D, 0x9E832D8E, 0x87981CCF,
+		0x4AC21251, 0x53D92310, 0x78F470D3, 0x61EF4192, 0x2EAED755, 0x37B5E614, 0x1C98B5D7, 0x05838496,
+		0x821B9859, 0x9B00A918, 0xB02DFADB, 0xA936CB9A, 0xE6775D5D, 0xFF6C6C1C, 0xD4413FDF, 0xCD5A0E9E,
+		0x958424A2, 0x8C9F15E3, 0xA7B24620, 0xBEA97761, 0xF1E8E1A6, 0xE8F3D0E7, 0xC3DE8324, 0xDAC5B265,
+		0x5D5DAEAA, 0x44469FEB, 0x6F6BCC28, 0x7670FD69, 0x39316BAE, 0x202A5AEF, 0x0B07092C, 0x121C386D,
+		0xDF4636F3, 0xC65D07B2, 0xED705471, 0xF46B6530, 0xBB2AF3F7, 0xA231C2B6, 0x891C9175, 0x9007A034,
+		0x179FBCFB, 0x0E848DBA, 0x25A9DE79, 0x3CB2EF38, 0x73F379FF, 0x6AE848BE, 0x41C51B7D, 0x58DE2A3C,
+		0xF0794F05, 0xE9627E44, 0xC24F2D87, 0xDB541CC6, 0x94158A01, 0x8D0EBB40, 0xA623E883, 0xBF38D9C2,
+		0x38A0C50D, 0x21BBF44C, 0x0A96A78F, 0x138D96CE, 0x5CCC0009, 0x45D73148, 0x6EFA628B, 0x77E153CA,
+		0xBABB5D54, 0xA3A06C15, 0x888D3FD6, 0x91960E97, 0xDED79850, 0xC7CCA911, 0xECE1FAD2, 0xF5FACB93,
+		0x7262D75C, 0x6B79E61D, 0x4054B5DE, 0x594F849F, 0x160E1258, 0x0F152319, 0x243870DA, 0x3D23419B,
+		0x65FD6BA7, 0x7CE65AE6, 0x57CB0925, 0x4ED03864, 0x0191AEA3, 0x188A9FE2, 0x33A7CC21, 0x2ABCFD60,
+		0xAD24E1AF, 0xB43FD0EE, 0x9F12832D, 0x8609B26C, 0xC94824AB, 0xD05315EA, 0xFB7E4629, 0xE2657768,
+		0x2F3F79F6, 0x362448B7, 0x1D091B74, 0x04122A35, 0x4B53BCF2, 0x52488DB3, 0x7965DE70, 0x607EEF31,
+		0xE7E6F3FE, 0xFEFDC2BF, 0xD5D0917C, 0xCCCBA03D, 0x838A36FA, 0x9A9107BB, 0xB1BC5478, 0xA8A76539,
+		0x3B83984B, 0x2298A90A, 0x09B5FAC9, 0x10AECB88, 0x5FEF5D4F, 0x46F46C0E, 0x6DD93FCD, 0x74C20E8C,
+		0xF35A1243, 0xEA412302, 0xC16C70C1, 0xD8774180, 0x9736D747, 0x8E2DE606, 0xA500B5C5, 0xBC1B8484,
+		0x71418A1A, 0x685ABB5B, 0x4377E898, 0x5A6CD9D9, 0x152D4F1E, 0x0C367E5F, 0x271B2D9C, 0x3E001CDD,
+		0xB9980012, 0xA0833153, 0x8BAE6290, 0x92B553D1, 0xDDF4C516, 0xC4EFF457, 0xEFC2A794, 0xF6D996D5,
+		0xAE07BCE9, 0xB71C8DA8, 0x9C31DE6B, 0x852AEF2A, 0xCA6B79ED, 0xD37048AC, 0xF85D1B6F, 0xE1462A2E,
+		0x66DE36E1, 0x7FC507A0, 0x54E85463, 0x4DF36522, 0x02B2F3E5, 0x1BA9C2A4, 0x30849167, 0x299FA026,
+		0xE4C5AEB8, 0xFDDE9FF9, 0xD6F3CC3A, 0xCFE8FD7B, 0x80A96BBC, 0x99B25AFD, 0xB29F093E, 0xAB84387F,
+		0x2C1C24B0, 0x350715F1, 0x1E2A4632, 0x07317773, 0x4870E1B4, 0x516BD0F5, 0x7A468336, 0x635DB277,
+		0xCBFAD74E, 0xD2E1E60F, 0xF9CCB5CC, 0xE0D7848D, 0xAF96124A, 0xB68D230B, 0x9DA070C8, 0x84BB4189,
+		0x03235D46, 0x1A386C07, 0x31153FC4, 0x280E0E85, 0x674F9842, 0x7E54A903, 0x5579FAC0, 0x4C62CB81,
+		0x8138C51F, 0x9823F45E, 0xB30EA79D, 0xAA1596DC, 0xE554001B, 0xFC4F315A, 0xD7626299, 0xCE7953D8,
+		0x49E14F17, 0x50FA7E56, 0x7BD72D95, 0x62CC1CD4, 0x2D8D8A13, 0x3496BB52, 0x1FBBE891, 0x06A0D9D0,
+		0x5E7EF3EC, 0x4765C2AD, 0x6C48916E, 0x7553A02F, 0x3A1236E8, 0x230907A9, 0x0824546A, 0x113F652B,
+		0x96A779E4, 0x8FBC48A5, 0xA4911B66, 0xBD8A2A27, 0xF2CBBCE0, 0xEBD08DA1, 0xC0FDDE62, 0xD9E6EF23,
+		0x14BCE1BD, 0x0DA7D0FC, 0x268A833F, 0x3F91B27E, 0x70D024B9, 0x69CB15F8, 0x42E6463B, 0x5BFD777A,
+		0xDC656BB5, 0xC57E5AF4, 0xEE530937, 0xF7483876, 0xB809AEB1, 0xA1129FF0, 0x8A3FCC33, 0x9324FD72
+	},
+	{
+		0x00000000, 0x01C26A37, 0x0384D46E, 0x0246BE59, 0x0709A8DC, 0x06CBC2EB, 0x048D7CB2, 0x054F1685,
+		0x0E1351B8, 0x0FD13B8F, 0x0D9785D6, 0x0C55EFE1, 0x091AF964, 0x08D89353, 0x0A9E2D0A, 0x0B5C473D,
+		0x1C26A370, 0x1DE4C947, 0x1FA2771E, 0x1E601D29, 0x1B2F0BAC, 0x1AED619B, 0x18ABDFC2, 0x1969B5F5,
+		0x1235F2C8, 0x13F798FF, 0x11B126A6, 0x10734C91, 0x153C5A14, 0x14FE3023, 0x16B88E7A, 0x177AE44D,
+		0x384D46E0, 0x398F2CD7, 0x3BC9928E, 0x3A0BF8B9, 0x3F44EE3C, 0x3E86840B, 0x3CC03A52, 0x3D025065,
+		0x365E1758, 0x379C7D6F, 0x35DAC336, 0x3418A901, 0x3157BF84, 0x3095D5B3, 0x32D36BEA, 0x331101DD,
+		0x246BE590, 0x25A98FA7, 0x27EF31FE, 0x262D5BC9, 0x23624D4C, 0x22A0277B, 0x20E69922, 0x2124F315,
+		0x2A78B428, 0x2BBADE1F, 0x29FC6046, 0x283E0A71, 0x2D711CF4, 0x2CB376C3, 0x2EF5C89A, 0x2F37A2AD,
+		0x709A8DC0, 0x7158E7F7, 0x731E59AE, 0x72DC3399, 0x7793251C, 0x76514F2B, 0x7417F172, 0x75D59B45,
+		0x7E89DC78, 0x7F4BB64F, 0x7D0D0816, 0x7CCF6221, 0x798074A4, 0x78421E93, 0x7A04A0CA, 0x7BC6CAFD,
+		0x6CBC2EB0, 0x6D7E4487, 0x6F38FADE, 0x6EFA90E9, 0x6BB5866C, 0x6A77EC5B, 0x68315202, 0x69F33835,
+		0x62AF7F08, 0x636D153F, 0x612BAB66, 0x60E9C151, 0x65A6D7D4, 0x6464BDE3, 0x662203BA, 0x67E0698D,
+		0x48D7CB20, 0x4915A117, 0x4B531F4E, 0x4A917579, 0x4FDE63FC, 0x4E1C09CB, 0x4C5AB792, 0x4D98DDA5,
+		0x46C49A98, 0x4706F0AF, 0x45404EF6, 0x448224C1, 0x41CD3244, 0x400F5873, 0x4249E62A, 0x438B8C1D,
+		0x54F16850, 0x55330267, 0x5775BC3E, 0x56B7D609, 0x53F8C08C, 0x523AAABB, 0x507C14E2, 0x51BE7ED5,
+		0x5AE239E8, 0x5B2053DF, 0x5966ED86, 0x58A487B1, 0x5DEB9134, 0x5C29FB03, 0x5E6F455A, 0x5FAD2F6D,
+		0xE1351B80, 0xE0F771B7, 0xE2B1CFEE, 0xE373A5D9, 0xE63CB35C, 0xE7FED96B, 0xE5B86732, 0xE47A0D05,
+		0xEF264A38, 0xEEE4200F, 0xECA29E56, 0xED60F461, 0xE82FE2E4, 0xE9ED88D3, 0xEBAB368A, 0xEA695CBD,
+		0xFD13B8F0, 0xFCD1D2C7, 0xFE976C9E, 0xFF5506A9, 0xFA1A102C, 0xFBD87A1B, 0xF99EC442, 0xF85CAE75,
+		0xF300E948, 0xF2C2837F, 0xF0843D26, 0xF1465711, 0xF4094194, 0xF5CB2BA3, 0xF78D95FA, 0xF64FFFCD,
+		0xD9785D60, 0xD8BA3757, 0xDAFC890E, 0xDB3EE339, 0xDE71F5BC, 0xDFB39F8B, 0xDDF521D2, 0xDC374BE5,
+		0xD76B0CD8, 0xD6A966EF, 0xD4EFD8B6, 0xD52DB281, 0xD062A404, 0xD1A0CE33, 0xD3E6706A, 0xD2241A5D,
+		0xC55EFE10, 0xC49C9427, 0xC6DA2A7E, 0xC7184049, 0xC25756CC, 0xC3953CFB, 0xC1D382A2, 0xC011E895,
+		0xCB4DAFA8, 0xCA8FC59F, 0xC8C97BC6, 0xC90B11F1, 0xCC440774, 0xCD866D43, 0xCFC0D31A, 0xCE02B92D,
+		0x91AF9640, 0x906DFC77, 0x922B422E, 0x93E92819, 0x96A63E9C, 0x976454AB, 0x9522EAF2, 0x94E080C5,
+		0x9FBCC7F8, 0x9E7EADCF, 0x9C381396, 0x9DFA79A1, 0x98B56F24, 0x99770513, 0x9B31BB4A, 0x9AF3D17D,
+		0x8D893530, 0x8C4B5F07, 0x8E0DE15E, 0x8FCF8B69, 0x8A809DEC, 0x8B42F7DB, 0x89044982, 0x88C623B5,
+		0x839A6488, 0x82580EBF, 0x801EB0E6, 0x81DCDAD1, 0x8493CC54, 0x8551A663, 0x8717183A, 0x86D5720D,
+		0xA9E2D0A0, 0xA820BA97, 0xAA6604CE, 0xABA46EF9, 0xAEEB787C, 0xAF29124B, 0xAD6FAC12, 0xACADC625,
+		0xA7F18118, 0xA633EB2F, 0xA4755576, 0xA5B73F41, 0xA0F829C4, 0xA13A43F3, 0xA37CFDAA, 0xA2BE979D,
+		0xB5C473D0, 0xB40619E7, 0xB640A7BE, 0xB782CD89, 0xB2CDDB0C, 0xB30FB13B, 0xB1490F62, 0xB08B6555,
+		0xBBD72268, 0xBA15485F, 0xB853F606, 0xB9919C31, 0xBCDE8AB4, 0xBD1CE083, 0xBF5A5EDA, 0xBE9834ED
+	},
+	{
+		0x00000000, 0xB8BC6765, 0xAA09C88B, 0x12B5AFEE, 0x8F629757, 0x37DEF032, 0x256B5FDC, 0x9DD738B9,
+		0xC5B428EF, 0x7D084F8A, 0x6FBDE064, 0xD7018701, 0x4AD6BFB8, 0xF26AD8DD, 0xE0DF7733, 0x58631056,
+		0x5019579F, 0xE8A530FA, 0xFA109F14, 0x42ACF871, 0xDF7BC0C8, 0x67C7A7AD, 0x75720843, 0xCDCE6F26,
+		0x95AD7F70, 0x2D111815, 0x3FA4B7FB, 0x8718D09E, 0x1ACFE827, 0xA2738F42, 0xB0C620AC, 0x087A47C9,
+		0xA032AF3E, 0x188EC85B, 0x0A3B67B5, 0xB28700D0, 0x2F503869, 0x97EC5F0C, 0x8559F0E2, 0x3DE59787,
+		0x658687D1, 0xDD3AE0B4, 0xCF8F4F5A, 0x7733283F, 0xEAE41086, 0x525877E3, 0x40EDD80D, 0xF851BF68,
+		0xF02BF8A1, 0x48979FC4, 0x5A22302A, 0xE29E574F, 0x7F496FF6, 0xC7F50893, 0xD540A77D, 0x6DFCC018,
+		0x359FD04E, 0x8D23B72B, 0x9F9618C5, 0x272A7FA0, 0xBAFD4719, 0x0241207C, 0x10F48F92, 0xA848E8F7,
+		0x9B14583D, 0x23A83F58, 0x311D90B6, 0x89A1F7D3, 0x1476CF6A, 0xACCAA80F, 0xBE7F07E1, 0x06C36084,
+		0x5EA070D2, 0xE61C17B7, 0xF4A9B859, 0x4C15DF3C, 0xD1C2E785, 0x697E80E0, 0x7BCB2F0E, 0xC377486B,
+		0xCB0D0FA2, 0x73B168C7, 0x6104C729, 0xD9B8A04C, 0x446F98F5, 0xFCD3FF90, 0xEE66507E, 0x56DA371B,
+		0x0EB9274D, 0xB6054028, 0xA4B0EFC6, 0x1C0C88A3, 0x81DBB01A, 0x3967D77F, 0x2BD27891, 0x936E1FF4,
+		0x3B26F703, 0x839A9066, 0x912F3F88, 0x299358ED, 0xB4446054, 0x0CF80731, 0x1E4DA8DF, 0xA6F1CFBA,
+		0xFE92DFEC, 0x462EB889, 0x549B1767, 0xEC277002, 0x71F048BB, 0xC94C2FDE, 0xDBF98030, 0x6345E755,
+		0x6B3FA09C, 0xD383C7F9, 0xC1366817, 0x798A0F72, 0xE45D37CB, 0x5CE150AE, 0x4E54FF40, 0xF6E89825,
+		0xAE8B8873, 0x1637EF16, 0x048240F8, 0xBC3E279D, 0x21E91F24, 0x99557841, 0x8BE0D7AF, 0x335CB0CA,
+		0xED59B63B, 0x55E5D15E, 0x47507EB0, 0xFFEC19D5, 0x623B216C, 0xDA874609, 0xC832E9E7, 0x708E8E82,
+		0x28ED9ED4, 0x9051F9B1, 0x82E4565F, 0x3A58313A, 0xA78F0983, 0x1F336EE6, 0x0D86C108, 0xB53AA66D,
+		0xBD40E1A4, 0x05FC86C1, 0x1749292F, 0xAFF54E4A, 0x322276F3, 0x8A9E1196, 0x982BBE78, 0x2097D91D,
+		0x78F4C94B, 0xC048AE2E, 0xD2FD01C0, 0x6A4166A5, 0xF7965E1C, 0x4F2A3979, 0x5D9F9697, 0xE523F1F2,
+		0x4D6B1905, 0xF5D77E60, 0xE762D18E, 0x5FDEB6EB, 0xC2098E52, 0x7AB5E937, 0x680046D9, 0xD0BC21BC,
+		0x88DF31EA, 0x3063568F, 0x22D6F961, 0x9A6A9E04, 0x07BDA6BD, 0xBF01C1D8, 0xADB46E36, 0x15080953,
+		0x1D724E9A, 0xA5CE29FF, 0xB77B8611, 0x0FC7E174, 0x9210D9CD, 0x2AACBEA8, 0x38191146, 0x80A57623,
+		0xD8C66675, 0x607A0110, 0x72CFAEFE, 0xCA73C99B, 0x57A4F122, 0xEF189647, 0xFDAD39A9, 0x45115ECC,
+		0x764DEE06, 0xCEF18963, 0xDC44268D, 0x64F841E8, 0xF92F7951, 0x41931E34, 0x5326B1DA, 0xEB9AD6BF,
+		0xB3F9C6E9, 0x0B45A18C, 0x19F00E62, 0xA14C6907, 0x3C9B51BE, 0x842736DB, 0x96929935, 0x2E2EFE50,
+		0x2654B999, 0x9EE8DEFC, 0x8C5D7112, 0x34E11677, 0xA9362ECE, 0x118A49AB, 0x033FE645, 0xBB838120,
+		0xE3E09176, 0x5B5CF613, 0x49E959FD, 0xF1553E98, 0x6C820621, 0xD43E6144, 0xC68BCEAA, 0x7E37A9CF,
+		0xD67F4138, 0x6EC3265D, 0x7C7689B3, 0xC4CAEED6, 0x591DD66F, 0xE1A1B10A, 0xF3141EE4, 0x4BA87981,
+		0x13CB69D7, 0xAB770EB2, 0xB9C2A15C, 0x017EC639, 0x9CA9FE80, 0x241599E5, 0x36A0360B, 0x8E1C516E,
+		0x866616A7, 0x3EDA71C2, 0x2C6FDE2C, 0x94D3B949, 0x090481F0, 0xB1B8E695, 0xA30D497B, 0x1BB12E1E,
+		0x43D23E48, 0xFB6E592D, 0xE9DBF6C3, 0x516791A6, 0xCCB0A91F, 0x740CCE7A, 0x66B96194, 0xDE0506F1
+	},
+	{
+		0x00000000, 0x3D6029B0, 0x7AC05360, 0x47A07AD0, 0xF580A6C0, 0xC8E08F70, 0x8F40F5A0, 0xB220DC10,
+		0x30704BC1, 0x0D106271, 0x4AB018A1, 0x77D03111, 0xC5F0ED01, 0xF890C4B1, 0xBF30BE61, 0x825097D1,
+		0x60E09782, 0x5D80BE32, 0x1A20C4E2, 0x2740ED52, 0x95603142, 0xA80018F2, 0xEFA06222, 0xD2C04B92,
+		0x5090DC43, 0x6DF0F5F3, 0x2A508F23, 0x1730A693, 0xA5107A83, 0x98705333, 0xDFD029E3, 0xE2B00053,
+		0xC1C12F04, 0xFCA106B4, 0xBB017C64, 0x866155D4, 0x344189C4, 0x0921A074, 0x4E81DAA4, 0x73E1F314,
+		0xF1B164C5, 0xCCD14D75, 0x8B7137A5, 0xB6111E15, 0x0431C205, 0x3951EBB5, 0x7EF19165, 0x4391B8D5,
+		0xA121B886, 0x9C419136, 0xDBE1EBE6, 0xE681C256, 0x54A11E46, 0x69C137F6, 0x2E614D26, 0x13016496,
+		0x9151F347, 0xAC31DAF7, 0xEB91A027, 0xD6F18997, 0x64D15587, 0x59B17C37, 0x1E1106E7, 0x23712F57,
+		0x58F35849, 0x659371F9, 0x22330B29, 0x1F532299, 0xAD73FE89, 0x9013D739, 0xD7B3ADE9, 0xEAD38459,
+		0x68831388, 0x55E33A38, 0x124340E8, 0x2F236958, 0x9D03B548, 0xA0639CF8, 0xE7C3E628, 0xDAA3CF98,
+		0x3813CFCB, 0x0573E67B, 0x42D39CAB, 0x7FB3B51B, 0xCD93690B, 0xF0F340BB, 0xB7533A6B, 0x8A3313DB,
+		0x0863840A, 0x3503ADBA, 0x72A3D76A, 0x4FC3FEDA, 0xFDE322CA, 0xC0830B7A, 0x872371AA, 0xBA43581A,
+		0x9932774D, 0xA4525EFD, 0xE3F2242D, 0xDE920D9D, 0x6CB2D18D, 0x51D2F83D, 0x167282ED, 0x2B12AB5D,
+		0xA9423C8C, 0x9422153C, 0xD3826FEC, 0xEEE2465C, 0x5CC29A4C, 0x61A2B3FC, 0x2602C92C, 0x1B62E09C,
+		0xF9D2E0CF, 0xC4B2C97F, 0x8312B3AF, 0xBE729A1F, 0x0C52460F, 0x31326FBF, 0x7692156F, 0x4BF23CDF,
+		0xC9A2AB0E, 0xF4C282BE, 0xB362F86E, 0x8E02D1DE, 0x3C220DCE, 0x0142247E, 0x46E25EAE, 0x7B82771E,
+		0xB1E6B092, 0x8C869922, 0xCB26E3F2, 0xF646CA42, 0x44661652, 0x79063FE2, 0x3EA64532, 0x03C66C82,
+		0x8196FB53, 0xBCF6D2E3, 0xFB56A833, 0xC6368183, 0x74165D93, 0x49767423, 0x0ED60EF3, 0x33B62743,
+		0xD1062710, 0xEC660EA0, 0xABC67470, 0x96A65DC0, 0x248681D0, 0x19E6A860, 0x5E46D2B0, 0x6326FB00,
+		0xE1766CD1, 0xDC164561, 0x9BB63FB1, 0xA6D61601, 0x14F6CA11, 0x2996E3A1, 0x6E369971, 0x5356B0C1,
+		0x70279F96, 0x4D47B626, 0x0AE7CCF6, 0x3787E546, 0x85A73956, 0xB8C710E6, 0xFF676A36, 0xC2074386,
+		0x4057D457, 0x7D37FDE7, 0x3A978737, 0x07F7AE87, 0xB5D77297, 0x88B75B27, 0xCF1721F7, 0xF2770847,
+		0x10C70814, 0x2DA721A4, 0x6A075B74, 0x576772C4, 0xE547AED4, 0xD8278764, 0x9F87FDB4, 0xA2E7D404,
+		0x20B743D5, 0x1DD76A65, 0x5A7710B5, 0x67173905, 0xD537E515, 0xE857CCA5, 0xAFF7B675, 0x92979FC5,
+		0xE915E8DB, 0xD475C16B, 0x93D5BBBB, 0xAEB5920B, 0x1C954E1B, 0x21F567AB, 0x66551D7B, 0x5B3534CB,
+		0xD965A31A, 0xE4058AAA, 0xA3A5F07A, 0x9EC5D9CA, 0x2CE505DA, 0x11852C6A, 0x562556BA, 0x6B457F0A,
+		0x89F57F59, 0xB49556E9, 0xF3352C39, 0xCE550589, 0x7C75D999, 0x4115F029, 0x06B58AF9, 0x3BD5A349,
+		0xB9853498, 0x84E51D28, 0xC34567F8, 0xFE254E48, 0x4C059258, 0x7165BBE8, 0x36C5C138, 0x0BA5E888,
+		0x28D4C7DF, 0x15B4EE6F, 0x521494BF, 0x6F74BD0F, 0xDD54611F, 0xE03448AF, 0xA794327F, 0x9AF41BCF,
+		0x18A48C1E, 0x25C4A5AE, 0x6264DF7E, 0x5F04F6CE, 0xED242ADE, 0xD044036E, 0x97E479BE, 0xAA84500E,
+		0x4834505D, 0x755479ED, 0x32F4033D, 0x0F942A8D, 0xBDB4F69D, 0x80D4DF2D, 0xC774A5FD, 0xFA148C4D,
+		0x78441B9C, 0x4524322C, 0x028448FC, 0x3FE4614C, 0x8DC4BD5C, 0xB0A494EC, 0xF704EE3C, 0xCA64C78C
+	},
+	{
+		0x00000000, 0xCB5CD3A5, 0x4DC8A10B, 0x869472AE, 0x9B914216, 0x50CD91B3, 0xD659E31D, 0x1D0530B8,
+		0xEC53826D, 0x270F51C8, 0xA19B2366, 0x6AC7F0C3, 0x77C2C07B, 0xBC9E13DE, 0x3A0A6170, 0xF156B2D5,
+		0x03D6029B, 0xC88AD13E, 0x4E1EA390, 0x85427035, 0x9847408D, 0x531B9328, 0xD58FE186, 0x1ED33223,
+		0xEF8580F6, 0x24D95353, 0xA24D21FD, 0x6911F258, 0x7414C2E0, 0xBF481145, 0x39DC63EB, 0xF280B04E,
+		0x07AC0536, 0xCCF0D693, 0x4A64A43D, 0x81387798, 0x9C3D4720, 0x57619485, 0xD1F5E62B, 0x1AA9358E,
+		0xEBFF875B, 0x20A354FE, 0xA6372650, 0x6D6BF5F5, 0x706EC54D, 0xBB3216E8, 0x3DA66446, 0xF6FAB7E3,
+		0x047A07AD, 0xCF26D408, 0x49B2A6A6, 0x82EE7503, 0x9FEB45BB, 0x54B7961E, 0xD223E4B0, 0x197F3715,
+		0xE82985C0, 0x23755665, 0xA5E124CB, 0x6EBDF76E, 0x73B8C7D6, 0xB8E41473, 0x3E7066DD, 0xF52CB578,
+		0x0F580A6C, 0xC404D9C9, 0x4290AB67, 0x89CC78C2, 0x94C9487A, 0x5F959BDF, 0xD901E971, 0x125D3AD4,
+		0xE30B8801, 0x28575BA4, 0xAEC3290A, 0x659FFAAF, 0x789ACA17, 0xB3C619B2, 0x35526B1C, 0xFE0EB8B9,
+		0x0C8E08F7, 0xC7D2DB52, 0x4146A9FC, 0x8A1A7A59, 0x971F4AE1, 0x5C439944, 0xDAD7EBEA, 0x118B384F,
+		0xE0DD8A9A, 0x2B81593F, 0xAD152B91, 0x6649F834, 0x7B4CC88C, 0xB0101B29, 0x36846987, 0xFDD8BA22,
+		0x08F40F5A, 0xC3A8DCFF, 0x453CAE51, 0x8E607DF4, 0x93654D4C, 0x58399EE9, 0xDEADEC47, 0x15F13FE2,
+		0xE4A78D37, 0x2FFB5E92, 0xA96F2C3C, 0x6233FF99, 0x7F36CF21, 0xB46A1C84, 0x32FE6E2A, 0xF9A2BD8F,
+		0x0B220DC1, 0xC07EDE64, 0x46EAACCA, 0x8DB67F6F, 0x90B34FD7, 0x5BEF9C72, 0xDD7BEEDC, 0x16273D79,
+		0xE7718FAC, 0x2C2D5C09, 0xAAB92EA7, 0x61E5FD02, 0x7CE0CDBA, 0xB7BC1E1F, 0x31286CB1, 0xFA74BF14,
+		0x1EB014D8, 0xD5ECC77D, 0x5378B5D3, 0x98246676, 0x852156CE, 0x4E7D856B, 0xC8E9F7C5, 0x03B52460,
+		0xF2E396B5, 0x39BF4510, 0xBF2B37BE, 0x7477E41B, 0x6972D4A3, 0xA22E0706, 0x24BA75A8, 0xEFE6A60D,
+		0x1D661643, 0xD63AC5E6, 0x50AEB748, 0x9BF264ED, 0x86F75455, 0x4DAB87F0, 0xCB3FF55E, 0x006326FB,
+		0xF135942E, 0x3A69478B, 0xBCFD3525, 0x77A1E680, 0x6AA4D638, 0xA1F8059D, 0x276C7733, 0xEC30A496,
+		0x191C11EE, 0xD240C24B, 0x54D4B0E5, 0x9F886340, 0x828D53F8, 0x49D1805D, 0xCF45F2F3, 0x04192156,
+		0xF54F9383, 0x3E134026, 0xB8873288, 0x73DBE12D, 0x6EDED195, 0xA5820230, 0x2316709E, 0xE84AA33B,
+		0x1ACA1375, 0xD196C0D0, 0x5702B27E, 0x9C5E61DB, 0x815B5163, 0x4A0782C6, 0xCC93F068, 0x07CF23CD,
+		0xF6999118, 0x3DC542BD, 0xBB513013, 0x700DE3B6, 0x6D08D30E, 0xA65400AB, 0x20C07205, 0xEB9CA1A0,
+		0x11E81EB4, 0xDAB4CD11, 0x5C20BFBF, 0x977C6C1A, 0x8A795CA2, 0x41258F07, 0xC7B1FDA9, 0x0CED2E0C,
+		0xFDBB9CD9, 0x36E74F7C, 0xB0733DD2, 0x7B2FEE77, 0x662ADECF, 0xAD760D6A, 0x2BE27FC4, 0xE0BEAC61,
+		0x123E1C2F, 0xD962CF8A, 0x5FF6BD24, 0x94AA6E81, 0x89AF5E39, 0x42F38D9C, 0xC467FF32, 0x0F3B2C97,
+		0xFE6D9E42, 0x35314DE7, 0xB3A53F49, 0x78F9ECEC, 0x65FCDC54, 0xAEA00FF1, 0x28347D5F, 0xE368AEFA,
+		0x16441B82, 0xDD18C827, 0x5B8CBA89, 0x90D0692C, 0x8DD55994, 0x46898A31, 0xC01DF89F, 0x0B412B3A,
+		0xFA1799EF, 0x314B4A4A, 0xB7DF38E4, 0x7C83EB41, 0x6186DBF9, 0xAADA085C, 0x2C4E7AF2, 0xE712A957,
+		0x15921919, 0xDECECABC, 0x585AB812, 0x93066BB7, 0x8E035B0F, 0x455F88AA, 0xC3CBFA04, 0x089729A1,
+		0xF9C19B74, 0x329D48D1, 0xB4093A7F, 0x7F55E9DA, 0x6250D962, 0xA90C0AC7, 0x2F987869, 0xE4C4ABCC
+	},
+	{
+		0x00000000, 0xA6770BB4, 0x979F1129, 0x31E81A9D, 0xF44F2413, 0x52382FA7, 0x63D0353A, 0xC5A73E8E,
+		0x33EF4E67, 0x959845D3, 0xA4705F4E, 0x020754FA, 0xC7A06A74, 0x61D761C0, 0x503F7B5D, 0xF64870E9,
+		0x67DE9CCE, 0xC1A9977A, 0xF0418DE7, 0x56368653, 0x9391B8DD, 0x35E6B369, 0x040EA9F4, 0xA279A240,
+		0x5431D2A9, 0xF246D91D, 0xC3AEC380, 0x65D9C834, 0xA07EF6BA, 0x0609FD0E, 0x37E1E793, 0x9196EC27,
+		0xCFBD399C, 0x69CA3228, 0x582228B5, 0xFE552301, 0x3BF21D8F, 0x9D85163B, 0xAC6D0CA6, 0x0A1A0712,
+		0xFC5277FB, 0x5A257C4F, 0x6BCD66D2, 0xCDBA6D66, 0x081D53E8, 0xAE6A585C, 0x9F8242C1, 0x39F54975,
+		0xA863A552, 0x0E14AEE6, 0x3FFCB47B, 0x998BBFCF, 0x5C2C8141, 0xFA5B8AF5, 0xCBB39068, 0x6DC49BDC,
+		0x9B8CEB35, 0x3DFBE081, 0x0C13FA1C, 0xAA64F1A8, 0x6FC3CF26, 0xC9B4C492, 0xF85CDE0F, 0x5E2BD5BB,
+		0x440B7579, 0xE27C7ECD, 0xD3946450, 0x75E36FE4, 0xB044516A, 0x16335ADE, 0x27DB4043, 0x81AC4BF7,
+		0x77E43B1E, 0xD19330AA, 0xE07B2A37, 0x460C2183, 0x83AB1F0D, 0x25DC14B9, 0x14340E24, 0xB2430590,
+		0x23D5E9B7, 0x85A2E203, 0xB44AF89E, 0x123DF32A, 0xD79ACDA4, 0x71EDC610, 0x4005DC8D, 0xE672D739,
+		0x103AA7D0, 0xB64DAC64, 0x87A5B6F9, 0x21D2BD4D, 0xE47583C3, 0x42028877, 0x73EA92EA, 0xD59D995E,
+		0x8BB64CE5, 0x2DC14751, 0x1C295DCC, 0xBA5E5678, 0x7FF968F6, 0xD98E6342, 0xE86679DF, 0x4E11726B,
+		0xB8590282, 0x1E2E0936, 0x2FC613AB, 0x89B1181F, 0x4C162691, 0xEA612D25, 0xDB8937B8, 0x7DFE3C0C,
+		0xEC68D02B, 0x4A1FDB9F, 0x7BF7C102, 0xDD80CAB6, 0x1827F438, 0xBE50FF8C, 0x8FB8E511, 0x29CFEEA5,
+		0xDF879E4C, 0x79F095F8, 0x48188F65, 0xEE6F84D1, 0x2BC8BA5F, 0x8DBFB1EB, 0xBC57AB76, 0x1A20A0C2,
+		0x8816EAF2, 0x2E61E146, 0x1F89FBDB, 0xB9FEF06F, 0x7C59CEE1, 0xDA2EC555, 0xEBC6DFC8, 0x4DB1D47C,
+		0xBBF9A495, 0x1D8EAF21, 0x2C66B5BC, 0x8A11BE08, 0x4FB68086, 0xE9C18B32, 0xD82991AF, 0x7E5E9A1B,
+		0xEFC8763C, 0x49BF7D88, 0x78576715, 0xDE206CA1, 0x1B87522F, 0xBDF0599B, 0x8C184306, 0x2A6F48B2,
+		0xDC27385B, 0x7A5033EF, 0x4BB82972, 0xEDCF22C6, 0x28681C48, 0x8E1F17FC, 0xBFF70D61, 0x198006D5,
+		0x47ABD36E, 0xE1DCD8DA, 0xD034C247, 0x7643C9F3, 0xB3E4F77D, 0x1593FCC9, 0x247BE654, 0x820CEDE0,
+		0x74449D09, 0xD23396BD, 0xE3DB8C20, 0x45AC8794, 0x800BB91A, 0x267CB2AE, 0x1794A833, 0xB1E3A387,
+		0x20754FA0, 0x86024414, 0xB7EA5E89, 0x119D553D, 0xD43A6BB3, 0x724D6007, 0x43A57A9A, 0xE5D2712E,
+		0x139A01C7, 0xB5ED0A73, 0x840510EE, 0x22721B5A, 0xE7D525D4, 0x41A22E60, 0x704A34FD, 0xD63D3F49,
+		0xCC1D9F8B, 0x6A6A943F, 0x5B828EA2, 0xFDF58516, 0x3852BB98, 0x9E25B02C, 0xAFCDAAB1, 0x09BAA105,
+		0xFFF2D1EC, 0x5985DA58, 0x686DC0C5, 0xCE1ACB71, 0x0BBDF5FF, 0xADCAFE4B, 0x9C22E4D6, 0x3A55EF62,
+		0xABC30345, 0x0DB408F1, 0x3C5C126C, 0x9A2B19D8, 0x5F8C2756, 0xF9FB2CE2, 0xC813367F, 0x6E643DCB,
+		0x982C4D22, 0x3E5B4696, 0x0FB35C0B, 0xA9C457BF, 0x6C636931, 0xCA146285, 0xFBFC7818, 0x5D8B73AC,
+		0x03A0A617, 0xA5D7ADA3, 0x943FB73E, 0x3248BC8A, 0xF7EF8204, 0x519889B0, 0x6070932D, 0xC6079899,
+		0x304FE870, 0x9638E3C4, 0xA7D0F959, 0x01A7F2ED, 0xC400CC63, 0x6277C7D7, 0x539FDD4A, 0xF5E8D6FE,
+		0x647E3AD9, 0xC209316D, 0xF3E12BF0, 0x55962044, 0x90311ECA, 0x3646157E, 0x07AE0FE3, 0xA1D90457,
+		0x579174BE, 0xF1E67F0A, 0xC00E6597, 0x66796E23, 0xA3DE50AD, 0x05A95B19, 0x34414184, 0x92364A30
+	},
+	{
+		0x00000000, 0xCCAA009E, 0x4225077D, 0x8E8F07E3, 0x844A0EFA, 0x48E00E64, 0xC66F0987, 0x0AC50919,
+		0xD3E51BB5, 0x1F4F1B2B, 0x91C01CC8, 0x5D6A1C56, 0x57AF154F, 0x9B0515D1, 0x158A1232, 0xD92012AC,
+		0x7CBB312B, 0xB01131B5, 0x3E9E3656, 0xF23436C8, 0xF8F13FD1, 0x345B3F4F, 0xBAD438AC, 0x767E3832,
+		0xAF5E2A9E, 0x63F42A00, 0xED7B2DE3, 0x21D12D7D, 0x2B142464, 0xE7BE24FA, 0x69312319, 0xA59B2387,
+		0xF9766256, 0x35DC62C8, 0xBB53652B, 0x77F965B5, 0x7D3C6CAC, 0xB1966C32, 0x3F196BD1, 0xF3B36B4F,
+		0x2A9379E3, 0xE639797D, 0x68B67E9E, 0xA41C7E00, 0xAED97719, 0x62737787, 0xECFC7064, 0x205670FA,
+		0x85CD537D, 0x496753E3, 0xC7E85400, 0x0B42549E, 0x01875D87, 0xCD2D5D19, 0x43A25AFA, 0x8F085A64,
+		0x562848C8, 0x9A824856, 0x140D4FB5, 0xD8A74F2B, 0xD2624632, 0x1EC846AC, 0x9047414F, 0x5CED41D1,
+		0x299DC2ED, 0xE537C273, 0x6BB8C590, 0xA712C50E, 0xADD7CC17, 0x617DCC89, 0xEFF2CB6A, 0x2358CBF4,
+		0xFA78D958, 0x36D2D9C6, 0xB85DDE25, 0x74F7DEBB, 0x7E32D7A2, 0xB298D73C, 0x3C17D0DF, 0xF0BDD041,
+		0x5526F3C6, 0x998CF358, 0x1703F4BB, 0xDBA9F425, 0xD16CFD3C, 0x1DC6FDA2, 0x9349FA41, 0x5FE3FADF,
+		0x86C3E873, 0x4A69E8ED, 0xC4E6EF0E, 0x084CEF90, 0x0289E689, 0xCE23E617, 0x40ACE1F4, 0x8C06E16A,
+		0xD0EBA0BB, 0x1C41A025, 0x92CEA7C6, 0x5E64A758, 0x54A1AE41, 0x980BAEDF, 0x1684A93C, 0xDA2EA9A2,
+		0x030EBB0E, 0xCFA4BB90, 0x412BBC73, 0x8D81BCED, 0x8744B5F4, 0x4BEEB56A, 0xC561B289, 0x09CBB217,
+		0xAC509190, 0x60FA910E, 0xEE7596ED, 0x22DF9673, 0x281A9F6A, 0xE4B09FF4, 0x6A3F9817, 0xA6959889,
+		0x7FB58A25, 0xB31F8ABB, 0x3D908D58, 0xF13A8DC6, 0xFBFF84DF, 0x37558441, 0xB9DA83A2, 0x7570833C,
+		0x533B85DA, 0x9F918544, 0x111E82A7, 0xDDB48239, 0xD7718B20, 0x1BDB8BBE, 0x95548C5D, 0x59FE8CC3,
+		0x80DE9E6F, 0x4C749EF1, 0xC2FB9912, 0x0E51998C, 0x04949095, 0xC83E900B, 0x46B197E8, 0x8A1B9776,
+		0x2F80B4F1, 0xE32AB46F, 0x6DA5B38C, 0xA10FB312, 0xABCABA0B, 0x6760BA95, 0xE9EFBD76, 0x2545BDE8,
+		0xFC65AF44, 0x30CFAFDA, 0xBE40A839, 0x72EAA8A7, 0x782FA1BE, 0xB485A120, 0x3A0AA6C3, 0xF6A0A65D,
+		0xAA4DE78C, 0x66E7E712, 0xE868E0F1, 0x24C2E06F, 0x2E07E976, 0xE2ADE9E8, 0x6C22EE0B, 0xA088EE95,
+		0x79A8FC39, 0xB502FCA7, 0x3B8DFB44, 0xF727FBDA, 0xFDE2F2C3, 0x3148F25D, 0xBFC7F5BE, 0x736DF520,
+		0xD6F6D6A7, 0x1A5CD639, 0x94D3D1DA, 0x5879D144, 0x52BCD85D, 0x9E16D8C3, 0x1099DF20, 0xDC33DFBE,
+		0x0513CD12, 0xC9B9CD8C, 0x4736CA6F, 0x8B9CCAF1, 0x8159C3E8, 0x4DF3C376, 0xC37CC495, 0x0FD6C40B,
+		0x7AA64737, 0xB60C47A9, 0x3883404A, 0xF42940D4, 0xFEEC49CD, 0x32464953, 0xBCC94EB0, 0x70634E2E,
+		0xA9435C82, 0x65E95C1C, 0xEB665BFF, 0x27CC5B61, 0x2D095278, 0xE1A352E6, 0x6F2C5505, 0xA386559B,
+		0x061D761C, 0xCAB77682, 0x44387161, 0x889271FF, 0x825778E6, 0x4EFD7878, 0xC0727F9B, 0x0CD87F05,
+		0xD5F86DA9, 0x19526D37, 0x97DD6AD4, 0x5B776A4A, 0x51B26353, 0x9D1863CD, 0x1397642E, 0xDF3D64B0,
+		0x83D02561, 0x4F7A25FF, 0xC1F5221C, 0x0D5F2282, 0x079A2B9B, 0xCB302B05, 0x45BF2CE6, 0x89152C78,
+		0x50353ED4, 0x9C9F3E4A, 0x121039A9, 0xDEBA3937, 0xD47F302E, 0x18D530B0, 0x965A3753, 0x5AF037CD,
+		0xFF6B144A, 0x33C114D4, 0xBD4E1337, 0x71E413A9, 0x7B211AB0, 0xB78B1A2E, 0x39041DCD, 0xF5AE1D53,
+		0x2C8E0FFF, 0xE0240F61, 0x6EAB0882, 0xA201081C, 0xA8C40105, 0x646E019B, 0xEAE10678, 0x264B06E6
+	}
+};
+
+static uint32_t crc32_update(uint32_t crc, const unsigned char *data, int len)
+{
+	uint32_t a, b;
+
+	crc = ~crc;
+	for (; len >= 8; len -= 8, data += 8)
+	{
+		a = crc ^ ((uint32_t) data[0] | ((uint32_t) data[1] << 8) | ((uint32_t) data[2] << 16) | ((uint32_t) data[3] << 24));
+		b = (uint32_t) data[4] | ((uint32_t) data[5] << 8) | ((uint32_t) data[6] << 16) | ((uint32_t) data[7] << 24);
+		crc = CRC32_TABLE[7][a & 0xFF] ^ CRC32_TABLE[6][(a >> 8) & 0xFF] ^
+			CRC32_TABLE[5][(a >> 16) & 0xFF] ^ CRC32_TABLE[4][a >> 24] ^
+			CRC32_TABLE[3][b & 0xFF] ^ CRC32_TABLE[2][(b >> 8) & 0xFF] ^
+			CRC32_TABLE[1][(b >> 16) & 0xFF] ^ CRC32_TABLE[0][b >> 24];
+	}
+	for (; len > 0; len--, data++)
+		crc = CRC32_TABLE[0][(crc ^ *data) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+}
+
+/* Adler-32 of zlib data */
+#define ADLER32_BASE	65521
+#define ADLER32_NMAX	5552 /* Bytes before sums may overflow 32 bits */
+
+static uint32_t adler32_update(uint32_t adler, const unsigned char *data, int len)
+{
+	uint32_t s1, s2;
+	int i, n;
+#ifdef FLUID_SSE2
+	__m128i zero, weight_lo, weight_hi, v, v_s1, v_s2, v_prefix;
+	uint32_t sum[4];
+#endif
+
+	s1 = adler & 0xFFFF;
+	s2 = adler >> 16;
+#ifdef FLUID_SSE2
+	/* For 16 bytes b[0..15], s1 gains the sum of b[i] and s2 gains 16 * s1
+	 * plus the sum of (16 - i) * b[i]. Sums of s1 before each 16 bytes are
+	 * accumulated in v_prefix.
+	 */
+	zero = _mm_setzero_si128();
+	weight_lo = _mm_setr_epi16(16, 15, 14, 13, 12, 11, 10, 9);
+	weight_hi = _mm_setr_epi16(8, 7, 6, 5, 4, 3, 2, 1);
+	while (len >= 16)
+	{
+		n = (len < ADLER32_NMAX ? len : ADLER32_NMAX) & ~15;
+		v_s1 = v_s2 = v_prefix = zero;
+		for (i = 0; i < n; i += 16)
+		{
+			v = _mm_loadu_si128((const __m128i *) (data + i));
+			v_prefix = _mm_add_epi32(v_prefix, v_s1);
+			v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(v, zero));
+			v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_unpacklo_epi8(v, zero), weight_lo));
+			v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_unpackhi_epi8(v, zero), weight_hi));
+		}
+		_mm_storeu_si128((__m128i *) sum, v_prefix);
+		s2 += s1 * n + ((sum[0] + sum[2]) % ADLER32_BASE) * 16;
+		_mm_storeu_si128((__m128i *) sum, v_s2);
+		s2 += sum[0] + sum[1] + sum[2] + sum[3];
+		_mm_storeu_si128((__m128i *) sum, v_s1);
+		s1 += sum[0] + sum[2];
+		s1 %= ADLER32_BASE;
+		s2 %= ADLER32_BASE;
+		data += n;
+		len -= n;
+	}
+#endif
+	while (len > 0)
+	{
+		n = len < ADLER32_NMAX ? len : ADLER32_NMAX;
+		for (i = 0; i < n; i++)
+		{
+			s1 += data[i];
+			s2 += s1;
+		}
+		s1 %= ADLER32_BASE;
+		s2 %= ADLER32_BASE;
+		data += n;
+		len -= n;
+	}
+	return (s2 << 16) | s1;
+}
+
+/* Adler-32 of two pieces of data from their checksums, len2 is length of
+ * the second piece
+ */
+static uint32_t adler32_concat(uint32_t adler1, uint32_t adler2, int len2)
+{
+	uint32_t s1, s2, rem;
+
+	rem = (uint32_t) len2 % ADLER32_BASE;
+	s1 = adler1 & 0xFFFF;
+	s2 = (rem * s1) % ADLER32_BASE;
+	s1 += (adler2 & 0xFFFF) + ADLER32_BASE - 1;
+	s2 += (adler1 >> 16) + (adler2 >> 16) + ADLER32_BASE - rem;
+	if (s1 >= ADLER32_BASE)
+		s1 -= ADLER32_BASE;
+	if (s1 >= ADLER32_BASE)
+		s1 -= ADLER32_BASE;
+	if (s2 >= ADLER32_BASE * 2)
+		s2 -= ADLER32_BASE * 2;
+	if (s2 >= ADLER32_BASE)
+		s2 -= ADLER32_BASE;
+	return (s2 << 16) | s1;
+}
+
+/* Threads */
+#ifdef _WIN32
+typedef HANDLE THREAD_handle;
+typedef CRITICAL_SECTION THREAD_mutex;
+#define MUTEX_INIT(m) InitializeCriticalSection(m)
+#define MUTEX_DESTROY(m) DeleteCriticalSection(m)
+#define MUTEX_LOCK(m) EnterCriticalSection(m)
+#define MUTEX_UNLOCK(m) LeaveCriticalSection(m)
+#define THREAD_YIELD() SwitchToThread()
+/* Atomic operations on int, with acquire loads and release stores */
+#define ATOMIC_LOAD(p) InterlockedCompareExchange((volatile LONG *) (p), 0, 0)
+#define ATOMIC_STORE(p, x) InterlockedExchange((volatile LONG *) (p), (x))
+#define ATOMIC_FETCH_INC(p) (InterlockedIncrement((volatile LONG *) (p)) - 1)
+#define ATOMIC_CAS(p, old, x) (InterlockedCompareExchange((volatile LONG *) (p), (x), (old)) == (old))
+#else
+typedef pthread_t THREAD_handle;
+typedef pthread_mutex_t THREAD_mutex;
+#define MUTEX_INIT(m) pthread_mutex_init(m, NULL)
+#define MUTEX_DESTROY(m) pthread_mutex_destroy(m)
+#define MUTEX_LOCK(m) pthread_mutex_lock(m)
+#define MUTEX_UNLOCK(m) pthread_mutex_unlock(m)
+#define THREAD_YIELD() sched_yield()
+#define ATOMIC_LOAD(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define ATOMIC_STORE(p, x) __atomic_store_n((p), (x), __ATOMIC_RELEASE)
+#define ATOMIC_FETCH_INC(p) __atomic_fetch_add((p), 1, __ATOMIC_ACQ_REL)
+#define ATOMIC_CAS(p, old, x) atomic_cas((p), (old), (x))
+
+static INLINE int atomic_cas(int *p, int old, int x)
+{
+	return __atomic_compare_exchange_n(p, &old, x, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+#endif
+#define THREAD_MAX_COUNT	64
+
+typedef struct
+{
+	void (*func)(void *context, int index);
+	void *context;
+	int count, next;
+	THREAD_mutex mutex;
+} THREAD_tasks;
+
+static void thread_run_tasks(THREAD_tasks *tasks)
+{
+	int index;
+	for (;;)
+	{
+		MUTEX_LOCK(&tasks->mutex);
+		index = tasks->next++;
+		MUTEX_UNLOCK(&tasks->mutex);
+		if (index >= tasks->count)
+			break;
+		tasks->func(tasks->context, index);
+	}
+}
+
+#ifdef _WIN32
+static DWORD WINAPI thread_main(LPVOID arg)
+{
+	thread_run_tasks(arg);
+	return 0;
+}
+
+static int thread_create(THREAD_handle *thread, THREAD_tasks *tasks)
+{
+	*thread = CreateThread(NULL, 0, thread_main, tasks, 0, NULL);
+	return *thread != NULL;
+}
+
+static void thread_join(THREAD_handle thread)
+{
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+}
+#else
+static void *thread_main(void *arg)
+{
+	thread_run_tasks(arg);
+	return NULL;
+}
+
+static int thread_create(THREAD_handle *thread, THREAD_tasks *tasks)
+{
+	return pthread_create(thread, NULL, thread_main, tasks) == 0;
+}
+
+static void thread_join(THREAD_handle thread)
+{
+	pthread_join(thread, NULL);
+}
+#endif
+
+/* Call func(context, index) for each index in [0, count) on up to threads
+ * threads, the calling thread included. Returns when all calls are done.
+ * If threads cannot be created, the remaining calls run in this thread.
+ */
+static void run_tasks(void (*func)(void *context, int index), void *context, int count, int threads)
+{
+	THREAD_tasks tasks;
+	THREAD_handle thread[THREAD_MAX_COUNT];
+	int i, n;
+
+	tasks.func = func;
+	tasks.context = context;
+	tasks.count = count;
+	tasks.next = 0;
+	MUTEX_INIT(&tasks.mutex);
+	if (threads > count)
+		threads = count;
+	if (threads > THREAD_MAX_COUNT)
+		threads = THREAD_MAX_COUNT;
+	for (n = 0; n < threads - 1; n++)
+		if (!thread_create(&thread[n], &tasks))
+			break;
+	thread_run_tasks(&tasks);
+	for (i = 0; i < n; i++)
+		thread_join(thread[i]);
+	MUTEX_DESTROY(&tasks.mutex);
+}
+
 /* Zlib deflate decoder */
 #define DEFLATE_ALPHABET_SIZE			288
+#define DEFLATE_DIST_ALPHABET_SIZE		32
+#define DEFLATE_CODELEN_ALPHABET_SIZE	19
 #define DEFLATE_HUFFMAN_MAX_CODELEN		15
-#define DEFLATE_HUFFMAN_TREE_SIZE		(1 << DEFLATE_HUFFMAN_MAX_CODELEN)
+/* Huffman codes are decoded with two-level tables: the root table is indexed by
+ * the next *_TABLE_BITS bits of input (or less if all codes are shorter),
+ * longer codes continue in a subtable */
+#define DEFLATE_LITLEN_TABLE_BITS		10
+#define DEFLATE_DIST_TABLE_BITS			8
+#define DEFLATE_CODELEN_TABLE_BITS		7
+#define DEFLATE_LITLEN_TABLE_SIZE		((1 << DEFLATE_LITLEN_TABLE_BITS) + 2048)
+#define DEFLATE_DIST_TABLE_SIZE			((1 << DEFLATE_DIST_TABLE_BITS) + 1024)
+#define DEFLATE_CODELEN_TABLE_SIZE		(1 << DEFLATE_CODELEN_TABLE_BITS)
+/* Writable bytes required past the end of output, see zlib_copy_match */
+#define DEFLATE_OUTPUT_SLACK			32
+/* Matches reach at most this far back */
+#define DEFLATE_WINDOW_SIZE				32768
+/* Output inflated between Adler-32 updates when verifying */
+#define DEFLATE_VERIFY_STEP				65536
+/* Output value of zlib_inflate_wide for a byte in the unknown window */
+#define DEFLATE_MARKER(offset)			(256 + (offset))
+/* Alphabet kinds */
+#define DEFLATE_CODELEN		0
+#define DEFLATE_LITLEN		1
+#define DEFLATE_DIST		2
+/* Inflate states, kept between calls to zlib_inflate */
+#define DEFLATE_HEADER		0 /* Before a block header */
+#define DEFLATE_STORED		1 /* Inside a stored block */
+#define DEFLATE_HUFFMAN		2 /* Inside a compressed block */
+#define DEFLATE_DONE		3 /* After the final block */
 typedef struct
 {
-	int codelen[DEFLATE_ALPHABET_SIZE], codelen_count[DEFLATE_HUFFMAN_MAX_CODELEN + 1], next_code[DEFLATE_HUFFMAN_MAX_CODELEN + 1];
-	int hm_lit[DEFLATE_HUFFMAN_TREE_SIZE], hm_dist[DEFLATE_HUFFMAN_TREE_SIZE];
-	/* Packed huffman data: 
-	 * High 16 bits: Huffman code length
-	 * Low 16 bits: Original alphabet
+	int codelen[DEFLATE_ALPHABET_SIZE + DEFLATE_DIST_ALPHABET_SIZE];
+	uint32_t lit_table[DEFLATE_LITLEN_TABLE_SIZE], dist_table[DEFLATE_DIST_TABLE_SIZE], codelen_table[DEFLATE_CODELEN_TABLE_SIZE];
+	/* Packed huffman table entry:
+	 * Bits 16-31: Literal, length/distance base, or offset of subtable
+	 * Bits 8-15: Entry type, low 4 bits are the number of extra bits for
+	 *   a base entry, or the number of index bits for a subtable
+	 * Bits 0-7: Number of code bits consumed by this entry
 	 */
+	int state, bfinal;
+	const uint32_t *lit, *dist; /* Tables of current block */
+	int lit_bits, dist_bits;
+	int stored_len; /* Bytes left in stored block */
+	int match_len, match_dist; /* Part of a match which did not fit into output */
+	int block_stop; /* Return after each block */
 } DEFLATE_status;
 
-#define HC_VAL(len, alphabet) (((len) << 16) | (alphabet))
-#define HC_ISVALID(x) ((x) != -1)
-#define HC_LEN(x) HIINT(x)
-#define HC_ALPHABET(x) LOINT(x)
+#define HC_LITERAL		0x00
+#define HC_BASE			0x10
+#define HC_SUBTABLE		0x20
+#define HC_END			0x40
+#define HC_INVALID		0x80
+#define HC_VAL(type, len, value) (((uint32_t) (value) << 16) | ((type) << 8) | (len))
+#define HC_TYPE(x) (((x) >> 8) & 0xF0)
+#define HC_EXTRA(x) (((x) >> 8) & 0x0F)
+#define HC_LEN(x) ((x) & 0xFF)
+#define HC_VALUE(x) HIINT(x)
 
 static const int HCLEN_ORDER[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
 static const int LEN_BASE[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
@@ -149,28 +879,262 @@ static const int LEN_BITS[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2
 static const int DIST_BASE[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
 static const int DIST_BITS[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
 
-static int zlib_huffman_code(DEFLATE_status *status, int n, int *dest)
+static INLINE unsigned int reverse_bits(unsigned int code, int len)
+{
+	unsigned int r;
+	for (r = 0; len > 0; len--, code >>= 1)
+		r = (r << 1) | (code & 1);
+	return r;
+}
+
+static uint32_t zlib_huffman_entry(int kind, int alphabet, int len)
 {
-	int i, code;
-	memset(status->codelen_count, 0, sizeof(status->codelen_count));
-	for (i = 0; i < (1 << DEFLATE_HUFFMAN_MAX_CODELEN); i++)
-		dest[i] = -1;
+	if (kind == DEFLATE_CODELEN)
+		return HC_VAL(HC_LITERAL, len, alphabet);
+	else if (kind == DEFLATE_LITLEN)
+	{
+		if (alphabet < 256)
+			return HC_VAL(HC_LITERAL, len, alphabet);
+		else if (alphabet == 256)
+			return HC_VAL(HC_END, len, 0);
+		else if (alphabet <= 285)
+			return HC_VAL(HC_BASE | LEN_BITS[alphabet - 257], len, LEN_BASE[alphabet - 257]);
+	}
+	else if (alphabet < 30)
+		return HC_VAL(HC_BASE | DIST_BITS[alphabet], len, DIST_BASE[alphabet]);
+	return HC_VAL(HC_INVALID, len, 0); /* Invalid code point */
+}
+
+/* Build decoding table from code lengths
+ * The root table is indexed by the longest code length in use if all codes
+ * fit in max_bits, else by max_bits, which table_size is sized for
+ * Return: Number of root table index bits, or 0 if failed
+ */
+static int zlib_huffman_code(const int *codelen, int n, int kind, uint32_t *table, int max_bits, int table_size)
+{
+	int count[DEFLATE_HUFFMAN_MAX_CODELEN + 1], offset[DEFLATE_HUFFMAN_MAX_CODELEN + 1];
+	int sorted[DEFLATE_ALPHABET_SIZE];
+	int i, j, len, left, total, used, table_bits;
+	int code, prefix, sub_prefix, sub_bits, c, l;
+	uint32_t entry, *sub;
 
+	memset(count, 0, sizeof(count));
 	for (i = 0; i < n; i++)
-		if (status->codelen[i] > 0)
-			status->codelen_count[status->codelen[i]]++;
-	status->next_code[0] = 0;
-	for (i = 1; i <= DEFLATE_HUFFMAN_MAX_CODELEN; i++)
-		status->next_code[i] = (status->next_code[i - 1] + status->codelen_count[i - 1]) << 1;
+		count[codelen[i]]++;
+	left = 1;
+	for (len = 1; len <= DEFLATE_HUFFMAN_MAX_CODELEN; len++)
+	{
+		left = (left << 1) - count[len];
+		if (left < 0) /* Too much codepoints for a given length */
+			return 0;
+	}
+	/* Incomplete codes are rejected like zlib does, except for a single
+	 * literal/length or distance code of length 1 */
+	total = n - count[0];
+	if (left > 0 && total > 0 && (kind == DEFLATE_CODELEN || total > 1 || count[1] != 1))
+		return 0;
+	/* Sort alphabets by code length, then by value, which is the canonical code order */
+	total = 0;
+	table_bits = 1;
+	for (len = 1; len <= DEFLATE_HUFFMAN_MAX_CODELEN; len++)
+	{
+		offset[len] = total;
+		total += count[len];
+		if (count[len] > 0)
+			table_bits = len;
+	}
+	if (table_bits > max_bits)
+		table_bits = max_bits;
 	for (i = 0; i < n; i++)
-		if (status->codelen[i] > 0)
+		if (codelen[i] > 0)
+			sorted[offset[codelen[i]]++] = i;
+
+	/* Unused entries stay invalid, so the code of a single code point is caught while decoding */
+	for (i = 0; i < (1 << table_bits); i++)
+		table[i] = HC_VAL(HC_INVALID, 0, 0);
+	used = 1 << table_bits;
+	sub = NULL;
+	sub_prefix = -1;
+	sub_bits = 0;
+	code = 0;
+	for (i = 0; i < total; i++)
+	{
+		len = codelen[sorted[i]];
+		if (i > 0)
+			code = (code + 1) << (len - codelen[sorted[i - 1]]);
+		if (len <= table_bits)
 		{
-			code = status->next_code[status->codelen[i]]++;
-			if (code >= (1 << status->codelen[i])) /* Too much codepoints for a given length */
-				return 0;
-			dest[code] = HC_VAL(status->codelen[i], i);
+			entry = zlib_huffman_entry(kind, sorted[i], len);
+			for (j = reverse_bits(code, len); j < (1 << table_bits); j += 1 << len)
+				table[j] = entry;
 		}
-	return 1;
+		else
+		{
+			prefix = code >> (len - table_bits);
+			if (prefix != sub_prefix)
+			{
+				/* New subtable, sized for the longest code sharing the same prefix */
+				sub_prefix = prefix;
+				sub_bits = len - table_bits;
+				for (j = i + 1, c = code, l = len; j < total; j++)
+				{
+					c = (c + 1) << (codelen[sorted[j]] - l);
+					l = codelen[sorted[j]];
+					if ((c >> (l - table_bits)) != prefix)
+						break;
+					sub_bits = l - table_bits;
+				}
+				if (used + (1 << sub_bits) > table_size)
+					return 0;
+				sub = table + used;
+				for (j = 0; j < (1 << sub_bits); j++)
+					sub[j] = HC_VAL(HC_INVALID, 0, 0);
+				table[reverse_bits(prefix, table_bits)] = HC_VAL(HC_SUBTABLE | sub_bits, table_bits, used);
+				used += 1 << sub_bits;
+			}
+			entry = zlib_huffman_entry(kind, sorted[i], len - table_bits);
+			for (j = reverse_bits(code & BITMASK(len - table_bits), len - table_bits); j < (1 << sub_bits); j += 1 << (len - table_bits))
+				sub[j] = entry;
+		}
+	}
+	return table_bits;
+}
+
+/* Decoding tables of fixed huffman codes, as built by zlib_huffman_code
+ * Literal/length: 0 - 143: 8 bits, 144 - 255: 9 bits, 256 - 279: 7 bits, 280 - 287: 8 bits
+ * Distance: 0 - 31: 5 bits
+ */
+#define FIXED_LITLEN_TABLE_BITS	9
+#define FIXED_DIST_TABLE_BITS	5
+static const uint32_t FIXED_LITLEN_TABLE[512] = {
+	0x00004007, 0x00500008, 0x00100008, 0x00731408, 0x001F1207, 0x00700008, 0x00300008, 0x00C00009,
+	0x000A1007, 0x00600008, 0x00200008, 0x00A00009, 0x00000008, 0x00800008, 0x00400008, 0x00E00009,
+	0x00061007, 0x00580008, 0x00180008, 0x00900009, 0x003B1307, 0x00780008, 0x00380008, 0x00D00009,
+	0x00111107, 0x00680008, 0x00280008, 0x00B00009, 0x00080008, 0x00880008, 0x00480008, 0x00F00009,
+	0x00041007, 0x00540008, 0x00140008, 0x00E31508, 0x002B1307, 0x00740008, 0x00340008, 0x00C80009,
+	0x000D1107, 0x00640008, 0x00240008, 0x00A80009, 0x00040008, 0x00840008, 0x00440008, 0x00E80009,
+	0x00081007, 0x005C0008, 0x001C0008, 0x00980009, 0x00531407, 0x007C0008, 0x003C0008, 0x00D80009,
+	0x00171207, 0x006C0008, 0x002C0008, 0x00B80009, 0x000C0008, 0x008C0008, 0x004C0008, 0x00F80009,
+	0x00031007, 0x00520008, 0x00120008, 0x00A31508, 0x00231307, 0x00720008, 0x00320008, 0x00C40009,
+	0x000B1107, 0x00620008, 0x00220008, 0x00A40009, 0x00020008, 0x00820008, 0x00420008, 0x00E40009,
+	0x00071007, 0x005A0008, 0x001A0008, 0x00940009, 0x00431407, 0x007A0008, 0x003A0008, 0x00D40009,
+	0x00131207, 0x006A0008, 0x002A0008, 0x00B40009, 0x000A0008, 0x008A0008, 0x004A0008, 0x00F40009,
+	0x00051007, 0x00560008, 0x00160008, 0x00008008, 0x00331307, 0x00760008, 0x00360008, 0x00CC0009,
+	0x000F1107, 0x00660008, 0x00260008, 0x00AC0009, 0x00060008, 0x00860008, 0x00460008, 0x00EC0009,
+	0x00091007, 0x005E0008, 0x001E0008, 0x009C0009, 0x00631407, 0x007E0008, 0x003E0008, 0x00DC0009,
+	0x001B1207, 0x006E0008, 0x002E0008, 0x00BC0009, 0x000E0008, 0x008E0008, 0x004E0008, 0x00FC0009,
+	0x00004007, 0x00510008, 0x00110008, 0x00831508, 0x001F1207, 0x00710008, 0x00310008, 0x00C20009,
+	0x000A1007, 0x00610008, 0x00210008, 0x00A20009, 0x00010008, 0x00810008, 0x00410008, 0x00E20009,
+	0x00061007, 0x00590008, 0x00190008, 0x00920009, 0x003B1307, 0x00790008, 0x00390008, 0x00D20009,
+	0x00111107, 0x00690008, 0x00290008, 0x00B20009, 0x00090008, 0x00890008, 0x00490008, 0x00F20009,
+	0x00041007, 0x00550008, 0x00150008, 0x01021008, 0x002B1307, 0x00750008, 0x00350008, 0x00CA0009,
+	0x000D1107, 0x00650008, 0x00250008, 0x00AA0009, 0x00050008, 0x00850008, 0x00450008, 0x00EA0009,
+	0x00081007, 0x005D0008, 0x001D0008, 0x009A0009, 0x00531407, 0x007D0008, 0x003D0008, 0x00DA0009,
+	0x00171207, 0x006D0008, 0x002D0008, 0x00BA0009, 0x000D0008, 0x008D0008, 0x004D0008, 0x00FA0009,
+	0x00031007, 0x00530008, 0x00130008, 0x00C31508, 0x00231307, 0x00730008, 0x00330008, 0x00C60009,
+	0x000B1107, 0x00630008, 0x00230008, 0x00A60009, 0x00030008, 0x00830008, 0x00430008, 0x00E60009,
+	0x00071007, 0x005B0008, 0x001B0008, 0x00960009, 0x00431407, 0x007B0008, 0x003B0008, 0x00D60009,
+	0x00131207, 0x006B0008, 0x002B0008, 0x00B60009, 0x000B0008, 0x008B0008, 0x004B0008, 0x00F60009,
+	0x00051007, 0x00570008, 0x00170008, 0x00008008, 0x00331307, 0x00770008, 0x00370008, 0x00CE0009,
+	0x000F1107, 0x00670008, 0x00270008, 0x00AE0009, 0x00070008, 0x00870008, 0x00470008, 0x00EE0009,
+	0x00091007, 0x005F0008, 0x001F0008, 0x009E0009, 0x00631407, 0x007F0008, 0x003F0008, 0x00DE0009,
+	0x001B1207, 0x006F0008, 0x002F0008, 0x00BE0009, 0x000F0008, 0x008F0008, 0x004F0008, 0x00FE0009,
+	0x00004007, 0x00500008, 0x00100008, 0x00731408, 0x001F1207, 0x00700008, 0x00300008, 0x00C10009,
+	0x000A1007, 0x00600008, 0x00200008, 0x00A10009, 0x00000008, 0x00800008, 0x00400008, 0x00E10009,
+	0x00061007, 0x00580008, 0x00180008, 0x00910009, 0x003B1307, 0x00780008, 0x00380008, 0x00D10009,
+	0x00111107, 0x00680008, 0x00280008, 0x00B10009, 0x00080008, 0x00880008, 0x00480008, 0x00F10009,
+	0x00041007, 0x00540008, 0x00140008, 0x00E31508, 0x002B1307, 0x00740008, 0x00340008, 0x00C90009,
+	0x000D1107, 0x00640008, 0x00240008, 0x00A90009, 0x00040008, 0x00840008, 0x00440008, 0x00E90009,
+	0x00081007, 0x005C0008, 0x001C0008, 0x00990009, 0x00531407, 0x007C0008, 0x003C0008, 0x00D90009,
+	0x00171207, 0x006C0008, 0x002C0008, 0x00B90009, 0x000C0008, 0x008C0008, 0x004C0008, 0x00F90009,
+	0x00031007, 0x00520008, 0x00120008, 0x00A31508, 0x00231307, 0x00720008, 0x00320008, 0x00C50009,
+	0x000B1107, 0x00620008, 0x00220008, 0x00A50009, 0x00020008, 0x00820008, 0x00420008, 0x00E50009,
+	0x00071007, 0x005A0008, 0x001A0008, 0x00950009, 0x00431407, 0x007A0008, 0x003A0008, 0x00D50009,
+	0x00131207, 0x006A0008, 0x002A0008, 0x00B50009, 0x000A0008, 0x008A0008, 0x004A0008, 0x00F50009,
+	0x00051007, 0x00560008, 0x00160008, 0x00008008, 0x00331307, 0x00760008, 0x00360008, 0x00CD0009,
+	0x000F1107, 0x00660008, 0x00260008, 0x00AD0009, 0x00060008, 0x00860008, 0x00460008, 0x00ED0009,
+	0x00091007, 0x005E0008, 0x001E0008, 0x009D0009, 0x00631407, 0x007E0008, 0x003E0008, 0x00DD0009,
+	0x001B1207, 0x006E0008, 0x002E0008, 0x00BD0009, 0x000E0008, 0x008E0008, 0x004E0008, 0x00FD0009,
+	0x00004007, 0x00510008, 0x00110008, 0x00831508, 0x001F1207, 0x00710008, 0x00310008, 0x00C30009,
+	0x000A1007, 0x00610008, 0x00210008, 0x00A30009, 0x00010008, 0x00810008, 0x00410008, 0x00E30009,
+	0x00061007, 0x00590008, 0x00190008, 0x00930009, 0x003B1307, 0x00790008, 0x00390008, 0x00D30009,
+	0x00111107, 0x00690008, 0x00290008, 0x00B30009, 0x00090008, 0x00890008, 0x00490008, 0x00F30009,
+	0x00041007, 0x00550008, 0x00150008, 0x01021008, 0x002B1307, 0x00750008, 0x00350008, 0x00CB0009,
+	0x000D1107, 0x00650008, 0x00250008, 0x00AB0009, 0x00050008, 0x00850008, 0x00450008, 0x00EB0009,
+	0x00081007, 0x005D0008, 0x001D0008, 0x009B0009, 0x00531407, 0x007D0008, 0x003D0008, 0x00DB0009,
+	0x00171207, 0x006D0008, 0x002D0008, 0x00BB0009, 0x000D0008, 0x008D0008, 0x004D0008, 0x00FB0009,
+	0x00031007, 0x00530008, 0x00130008, 0x00C31508, 0x00231307, 0x00730008, 0x00330008, 0x00C70009,
+	0x000B1107, 0x00630008, 0x00230008, 0x00A70009, 0x00030008, 0x00830008, 0x00430008, 0x00E70009,
+	0x00071007, 0x005B0008, 0x001B0008, 0x00970009, 0x00431407, 0x007B0008, 0x003B0008, 0x00D70009,
+	0x00131207, 0x006B0008, 0x002B0008, 0x00B70009, 0x000B0008, 0x008B0008, 0x004B0008, 0x00F70009,
+	0x00051007, 0x00570008, 0x00170008, 0x00008008, 0x00331307, 0x00770008, 0x00370008, 0x00CF0009,
+	0x000F1107, 0x00670008, 0x00270008, 0x00AF0009, 0x00070008, 0x00870008, 0x00470008, 0x00EF0009,
+	0x00091007, 0x005F0008, 0x001F0008, 0x009F0009, 0x00631407, 0x007F0008, 0x003F0008, 0x00DF0009,
+	0x001B1207, 0x006F0008, 0x002F0008, 0x00BF0009, 0x000F0008, 0x008F0008, 0x004F0008, 0x00FF0009
+};
+
+static const uint32_t FIXED_DIST_TABLE[32] = {
+	0x00011005, 0x01011705, 0x00111305, 0x10011B05, 0x00051105, 0x04011905, 0x00411505, 0x40011D05,
+	0x00031005, 0x02011805, 0x00211405, 0x20011C05, 0x00091205, 0x08011A05, 0x00811605, 0x00008005,
+	0x00021005, 0x01811705, 0x00191305, 0x18011B05, 0x00071105, 0x06011905, 0x00611505, 0x60011D05,
+	0x00041005, 0x03011805, 0x00311405, 0x30011C05, 0x000D1205, 0x0C011A05, 0x00C11605, 0x00008005
+};
+
+/* Copy a match of len bytes from dist bytes back
+ * Copying is done in whole steps of 8, 16 or 32 bytes, which may write up
+ * to DEFLATE_OUTPUT_SLACK - 1 bytes past the match. Each step only reads
+ * bytes written before it, so overlapping matches are correct. Distances
+ * shorter than 8 (runs of a byte or of a small pixel) are expanded into a
+ * 16-byte pattern which is splatted with a step of the largest multiple of
+ * the distance.
+ */
+static const int SPLAT_STEP[8] = { 0, 16, 16, 15, 16, 15, 12, 14 };
+static INLINE void zlib_copy_match(unsigned char *dest, int dist, int len)
+{
+	const unsigned char *src;
+	unsigned char *end;
+	unsigned char pattern[16];
+	int i, step;
+
+	src = dest - dist;
+	end = dest + len;
+	if (dist >= 32)
+	{
+		do
+		{
+			memcpy(dest, src, 32);
+			dest += 32, src += 32;
+		} while (dest < end);
+	}
+	else if (dist >= 16)
+	{
+		do
+		{
+			memcpy(dest, src, 16);
+			dest += 16, src += 16;
+		} while (dest < end);
+	}
+	else if (dist >= 8)
+	{
+		do
+		{
+			memcpy(dest, src, 8);
+			dest += 8, src += 8;
+		} while (dest < end);
+	}
+	else
+	{
+		for (i = 0; i < dist; i++)
+			pattern[i] = src[i];
+		for (; i < 16; i++)
+			pattern[i] = pattern[i - dist];
+		step = SPLAT_STEP[dist];
+		do
+		{
+			memcpy(dest, pattern, 16);
+			dest += step;
+		} while (dest < end);
+	}
 }
 
 /* Byte order:
@@ -182,40 +1146,41 @@ static int zlib_huffman_code(DEFLATE_status *status, int n, int *dest)
  *   element.
  * Huffman codes are packed starting with the most-
  *   significant bit of the code.
+ * So the next bits of input, taken least-significant bit first, are
+ * the bit-reversed code and directly index the decoding table.
+ * At most 15 bits are consumed, caller must make sure they are available.
  */
-static int zlib_extract_huffman_code(const unsigned char **data, int *bit, int *size, int *huffman, int *code)
+static INLINE uint32_t zlib_extract_huffman_code(BIT_reader *br, const uint32_t *table, int table_bits)
 {
-	int i, b, c;
-	for (c = 0, i = 0;;)
+	uint32_t entry;
+	entry = table[peek_bits_little(br, table_bits)];
+	if (HC_TYPE(entry) == HC_SUBTABLE)
 	{
-		b = extract_bits_little(data, bit, size, 1);
-		c = (c << 1) | b;
-		if (++i > DEFLATE_HUFFMAN_MAX_CODELEN)
-			return 0;
-		if (HC_ISVALID(huffman[c]) && HC_LEN(huffman[c]) == i)
-		{
-			*code = HC_ALPHABET(huffman[c]);
-			return 1;
-		}
+		skip_bits_little(br, table_bits);
+		entry = table[HC_VALUE(entry) + peek_bits_little(br, HC_EXTRA(entry))];
 	}
+	skip_bits_little(br, HC_LEN(entry));
+	return entry;
 }
 
-static int zlib_read_huffman_codelen(const unsigned char **data, int *bit, int *size, int count, int *hm, int *codelen)
+static int zlib_read_huffman_codelen(BIT_reader *br, int count, const uint32_t *table, int table_bits, int *codelen)
 {
 	int i, j, lit;
+	uint32_t entry;
 	for (i = 0; i < count;)
 	{
-		if (*size <= 4)
-			return 0;
-		if (!zlib_extract_huffman_code(data, bit, size, hm, &lit) || lit > 18)
+		refill_bits_little(br);
+		entry = zlib_extract_huffman_code(br, table, table_bits);
+		if (HC_TYPE(entry) == HC_INVALID)
 			return 0;
+		lit = HC_VALUE(entry);
 		if (lit < 16) /* Literal */
 			codelen[i++] = lit;
 		else if (lit == 16) /* Repeat last */
 		{
 			if (i == 0)
 				return 0;
-			j = j = 3 + extract_bits_little(data, bit, size, 2);
+			j = 3 + extract_bits_little(br, 2);
 			if (i + j > count)
 				return 0;
 			for (; j > 0; i++, j--)
@@ -223,7 +1188,7 @@ static int zlib_read_huffman_codelen(const unsigned char **data, int *bit, int *
 		}
 		else if (lit == 17) /* Repeat zero */
 		{
-			j = 3 + extract_bits_little(data, bit, size, 3);
+			j = 3 + extract_bits_little(br, 3);
 			if (i + j > count)
 				return 0;
 			for (; j > 0; j--)
@@ -231,155 +1196,753 @@ static int zlib_read_huffman_codelen(const unsigned char **data, int *bit, int *
 		}
 		else /* Repeat zero */
 		{
-			j = 11 + extract_bits_little(data, bit, size, 7);
+			j = 11 + extract_bits_little(br, 7);
 			if (i + j > count)
 				return 0;
 			for (; j > 0; j--)
 				codelen[i++] = 0;
 		}
 	}
-	return 1;
+	return !BITS_OVERRUN(br);
+}
+
+static void zlib_init_inflate(DEFLATE_status *status)
+{
+	status->state = DEFLATE_HEADER;
+	status->bfinal = 0;
+	status->match_len = 0;
+	status->block_stop = 0;
 }
 
-static int zlib_deflate_decode(const unsigned char *data, int size, unsigned char *raw, int rawsize)
+/* Read zlib header before deflate data */
+static int zlib_read_header(BIT_reader *br)
 {
 	int cmf, flg;
-	unsigned char *current; /* Output pointer */
-	unsigned char *cp; /* Copy pointer */
-	unsigned int bit; /* Current bit of *data (0 - 8) */
 
-	int bfinal, btype;
-	int hlit, hdist, hclen;
+	refill_bits_little(br);
+	cmf = extract_bits_little(br, 8);
+	flg = extract_bits_little(br, 8);
+	if (BITS_OVERRUN(br))
+		return 0;
+	if (LOBYTE(cmf) != 8 || HIBYTE(cmf) > 7) /* Deflate with window up to 32K */
+		return 0;
+	if ((cmf * 256 + flg) % 31) /* FCHECK */
+		return 0;
+	if (flg & 0x20) /* Preset dictionary */
+		return 0;
+	return 1;
+}
+
+/* Read Adler-32 checksum after the final block and compare */
+static int zlib_read_trailer(BIT_reader *br, uint32_t adler)
+{
+	uint32_t value;
 	int i;
-	int lit, dist, len, nlen;
 
-	DEFLATE_status status;
+	skip_bits_little(br, br->count & 7);
+	refill_bits_little(br);
+	value = 0;
+	for (i = 0; i < 4; i++)
+		value = (value << 8) | extract_bits_little(br, 8);
+	return !BITS_OVERRUN(br) && value == adler;
+}
 
-	if (size < 6)
-		return 0;
-	/* Zlib header */
-	size -= 2;
-	EXTRACT_UINT8(data, cmf);
-	EXTRACT_UINT8(data, flg);
-	if (LOBYTE(cmf) != 8) /* Deflate */
-		return 0;
-	/* TODO: Check FLG */
-	current = raw;
-	bit = 0;
-	bfinal = 0;
-	while (current < raw + rawsize)
+/* Read block header and prepare for decoding block data */
+static int zlib_read_block_header(DEFLATE_status *status, BIT_reader *br)
+{
+	int btype;
+	int hlit, hdist, hclen;
+	int i, len, nlen;
+
+	refill_bits_little(br);
+	status->bfinal = extract_bits_little(br, 1);
+	btype = extract_bits_little(br, 2);
+	if (btype == 0) /* Non-compressed */
+	{
+		skip_bits_little(br, br->count & 7);
+		len = extract_bits_little(br, 16);
+		nlen = extract_bits_little(br, 16);
+		if ((len ^ nlen) != 0xFFFF)
+			return 0;
+		status->stored_len = len;
+		status->state = DEFLATE_STORED;
+	}
+	else if (btype == 1) /* Fixed huffman code */
+	{
+		status->lit = FIXED_LITLEN_TABLE;
+		status->lit_bits = FIXED_LITLEN_TABLE_BITS;
+		status->dist = FIXED_DIST_TABLE;
+		status->dist_bits = FIXED_DIST_TABLE_BITS;
+		status->state = DEFLATE_HUFFMAN;
+	}
+	else if (btype == 2) /* Dynamic huffman code */
 	{
-		if (bfinal == 1) /* From last block */
+		hlit = 257 + extract_bits_little(br, 5);
+		hdist = 1 + extract_bits_little(br, 5);
+		hclen = 4 + extract_bits_little(br, 4);
+		if (hlit > 286 || hdist > 30)
+			return 0;
+		/* Generate length descriptor huffman code */
+		for (i = 0; i < 19; i++)
+			status->codelen[i] = 0;
+		for (i = 0; i < hclen; i++)
+		{
+			refill_bits_little(br);
+			status->codelen[HCLEN_ORDER[i]] = extract_bits_little(br, 3);
+		}
+		i = zlib_huffman_code(status->codelen, DEFLATE_CODELEN_ALPHABET_SIZE, DEFLATE_CODELEN, status->codelen_table, DEFLATE_CODELEN_TABLE_BITS, DEFLATE_CODELEN_TABLE_SIZE);
+		if (!i)
 			return 0;
-		if (size <= 4)
+		/* Literal/length and distance code lengths form a single sequence */
+		if (!zlib_read_huffman_codelen(br, hlit + hdist, status->codelen_table, i, status->codelen))
 			return 0;
-		bfinal = extract_bits_little(&data, &bit, &size, 1);
-		btype = extract_bits_little(&data, &bit, &size, 2);
-		if (btype == 3)
+		if (status->codelen[256] == 0) /* No end of block */
 			return 0;
+		/* Generate literal/length huffman code */
+		status->lit = status->lit_table;
+		status->lit_bits = zlib_huffman_code(status->codelen, hlit, DEFLATE_LITLEN, status->lit_table, DEFLATE_LITLEN_TABLE_BITS, DEFLATE_LITLEN_TABLE_SIZE);
+		if (!status->lit_bits)
+			return 0;
+		/* Generate distance huffman code */
+		status->dist = status->dist_table;
+		status->dist_bits = zlib_huffman_code(status->codelen + hlit, hdist, DEFLATE_DIST, status->dist_table, DEFLATE_DIST_TABLE_BITS, DEFLATE_DIST_TABLE_SIZE);
+		if (!status->dist_bits)
+			return 0;
+		status->state = DEFLATE_HUFFMAN;
+	}
+	else
+		return 0;
+	return !BITS_OVERRUN(br);
+}
+
+/* Inflate into *current until end of output, the end of the final block, or
+ * the end of any block if block_stop is set. base is the start of data
+ * matches may refer to, and end must be followed by DEFLATE_OUTPUT_SLACK
+ * writable bytes. Decoding continues where the last call stopped.
+ * Return: 0 if failed
+ */
+static int zlib_inflate(DEFLATE_status *status, BIT_reader *br, unsigned char *base, unsigned char **pcurrent, unsigned char *end)
+{
+	unsigned char *current; /* Output pointer */
+	const uint32_t *lit_table, *dist_table;
+	int lit_bits, dist_bits;
+	int dist, len;
+	uint32_t entry;
 
-		if (btype == 0) /* Non-compressed */
+	current = *pcurrent;
+	while (status->state != DEFLATE_DONE)
+	{
+		if (status->state == DEFLATE_HEADER)
 		{
-			if (bit > 0)
-				data++, bit = 0;
-			if (size <= 4)
-				return 0;
-			EXTRACT_UINT16_LITTLE(data, len);
-			EXTRACT_UINT16_LITTLE(data, nlen);
-			size -= 4;
-			if (size < 4 + len)
+			if (current >= end)
+				break;
+			if (!zlib_read_block_header(status, br))
 				return 0;
-			size -= len;
-			if ((len | nlen) != 0xFFFF)
+		}
+
+		if (status->state == DEFLATE_STORED)
+		{
+			len = status->stored_len;
+			if (len > end - current)
+				len = (int) (end - current);
+			if (!copy_bytes_little(br, current, len))
 				return 0;
-			for (i = 0; i < len; i++)
-				*current++ = *data++;
+			current += len;
+			status->stored_len -= len;
+			if (status->stored_len) /* Output full */
+				break;
 		}
-		else /* Compressed */
+		else
 		{
-			/* Construct huffman code */
-			if (btype == 1) /* Fixed huffman code */
+			/* Finish match cut off by end of output in last call */
+			if (status->match_len)
 			{
-				for (i = 0; i < 144; i++)
-					status.codelen[i] = 8;
-				for (i = 144; i < 256; i++)
-					status.codelen[i] = 9;
-				for (i = 256; i < 280; i++)
-					status.codelen[i] = 7;
-				for (i = 280; i < 288; i++)
-					status.codelen[i] = 8;
-				zlib_huffman_code(&status, 288, status.hm_lit);
-				for (i = 0; i < 32; i++)
-					status.codelen[i] = 5;
-				zlib_huffman_code(&status, 32, status.hm_dist);
+				len = status->match_len;
+				if (len > end - current)
+					len = (int) (end - current);
+				zlib_copy_match(current, status->match_dist, len);
+				current += len;
+				status->match_len -= len;
+				if (status->match_len)
+					break;
 			}
-			else /* Dynamic huffman code */
+			lit_table = status->lit;
+			lit_bits = status->lit_bits;
+			dist_table = status->dist;
+			dist_bits = status->dist_bits;
+			/* Actual decompressing
+			 * A length/distance pair takes at most 15 + 5 + 15 + 13 = 48 bits,
+			 * so one refill is enough for each symbol
+			 */
+			for (;;)
 			{
-				hlit = 257 + extract_bits_little(&data, &bit, &size, 5);
-				hdist = 1 + extract_bits_little(&data, &bit, &size, 5);
-				hclen = 4 + extract_bits_little(&data, &bit, &size, 4);
-				/* Generate length descriptor huffman code */
-				for (i = 0; i < 19; i++)
-					status.codelen[i] = 0;
-				for (i = 0; i < hclen; i++)
+				if (current >= end)
+					goto OUTPUT_FULL;
+				refill_bits_little(br);
+				/* Extract literal/length */
+				entry = zlib_extract_huffman_code(br, lit_table, lit_bits);
+				if (HC_TYPE(entry) == HC_LITERAL) /* Literal data */
+					*current++ = HC_VALUE(entry);
+				else if (HC_TYPE(entry) == HC_BASE) /* Distance/length pair */
 				{
-					if (size <= 4)
+					len = HC_VALUE(entry) + extract_bits_little(br, HC_EXTRA(entry));
+					/* Extract distance */
+					entry = zlib_extract_huffman_code(br, dist_table, dist_bits);
+					if (HC_TYPE(entry) != HC_BASE) /* Invalid code point */
+						return 0;
+					dist = HC_VALUE(entry) + extract_bits_little(br, HC_EXTRA(entry));
+					/* Copy data */
+					if (current - base < dist)
 						return 0;
-					status.codelen[HCLEN_ORDER[i]] = extract_bits_little(&data, &bit, &size, 3);
+					if (end - current < len)
+					{
+						status->match_len = len - (int) (end - current);
+						status->match_dist = dist;
+						len = (int) (end - current);
+					}
+					zlib_copy_match(current, dist, len);
+					current += len;
 				}
-				if (!zlib_huffman_code(&status, 19, status.hm_dist))
-					return 0;
-				/* Generate literal/length huffman code */
-				if (!zlib_read_huffman_codelen(&data, &bit, &size, hlit, status.hm_dist, status.codelen))
-					return 0;
-				if (!zlib_huffman_code(&status, hlit, status.hm_lit))
-					return 0;
-				/* Generate distance huffman code */
-				if (!zlib_read_huffman_codelen(&data, &bit, &size, hdist, status.hm_dist, status.codelen))
-					return 0;
-				if (!zlib_huffman_code(&status, hdist, status.hm_dist))
+				else if (HC_TYPE(entry) == HC_END) /* End of block */
+					break;
+				else
 					return 0;
 			}
-			/* Actual decompressing */
-			for (;;)
+		}
+		if (BITS_OVERRUN(br))
+			return 0;
+		status->state = status->bfinal ? DEFLATE_DONE : DEFLATE_HEADER;
+		if (status->block_stop)
+			break;
+	}
+OUTPUT_FULL:
+	*pcurrent = current;
+	return !BITS_OVERRUN(br);
+}
+
+/* Copy a match into output of zlib_inflate_wide, see there */
+static INLINE int zlib_copy_match_wide(uint16_t *base, uint16_t *dest, int dist, int len, int *last_marker)
+{
+	int i, j, pos;
+	pos = (int) (dest - base) - dist;
+	if (pos < -DEFLATE_WINDOW_SIZE)
+		return 0;
+	/* From window */
+	for (i = 0; i < len && pos + i < 0; i++)
+		dest[i] = DEFLATE_MARKER(DEFLATE_WINDOW_SIZE + pos + i);
+	if (i > 0)
+		*last_marker = (int) (dest - base) + i - 1;
+	if (i == len)
+		return 1;
+	/* From output, which only holds markers up to *last_marker */
+	if (dist >= len)
+		memcpy(dest + i, dest + i - dist, (len - i) * sizeof(uint16_t));
+	else
+		for (j = i; j < len; j++)
+			dest[j] = dest[j - dist];
+	if (pos + i <= *last_marker)
+		for (j = len - 1; j >= i; j--)
+			if (dest[j] > 255)
 			{
-				/* Extract literal/length */
-				if (size <= 4)
-					return 0;
-				if (!zlib_extract_huffman_code(&data, &bit, &size, status.hm_lit, &lit) || lit > 285)
-					return 0;
-				if (lit == 256) /* End of block */
+				*last_marker = (int) (dest - base) + j;
+				break;
+			}
+	return 1;
+}
+
+/* Like zlib_inflate, but for data preceded by an unknown window, so decoding
+ * can start at any block boundary. Bytes copied from the window are written
+ * as DEFLATE_MARKER(offset in window), and *last_marker is updated to the
+ * output index of the last such value. No slack is needed after end.
+ * Return: 0 if failed
+ */
+static int zlib_inflate_wide(DEFLATE_status *status, BIT_reader *br, uint16_t *base, uint16_t **pcurrent, uint16_t *end, int *last_marker)
+{
+	uint16_t *current;
+	int dist, len;
+	uint32_t entry;
+
+	current = *pcurrent;
+	while (status->state != DEFLATE_DONE)
+	{
+		if (status->state == DEFLATE_HEADER)
+		{
+			if (current >= end)
+				break;
+			if (!zlib_read_block_header(status, br))
+				return 0;
+		}
+
+		if (status->state == DEFLATE_STORED)
+		{
+			for (; status->stored_len && current < end; status->stored_len--)
+			{
+				refill_bits_little(br);
+				*current++ = extract_bits_little(br, 8);
+			}
+			if (status->stored_len)
+				break;
+		}
+		else
+		{
+			if (status->match_len)
+			{
+				len = status->match_len;
+				if (len > end - current)
+					len = (int) (end - current);
+				zlib_copy_match_wide(base, current, status->match_dist, len, last_marker);
+				current += len;
+				status->match_len -= len;
+				if (status->match_len)
 					break;
-				if (lit < 256) /* Literal data */
-				{
-					if (current + 1 > raw + rawsize)
-						return 0;
-					*current++ = lit;
-				}
-				else /* Distance/length pair */
+			}
+			for (;;)
+			{
+				if (current >= end)
+					goto OUTPUT_FULL;
+				refill_bits_little(br);
+				entry = zlib_extract_huffman_code(br, status->lit, status->lit_bits);
+				if (HC_TYPE(entry) == HC_LITERAL)
+					*current++ = HC_VALUE(entry);
+				else if (HC_TYPE(entry) == HC_BASE)
 				{
-					len = LEN_BASE[lit - 257] + extract_bits_little(&data, &bit, &size, LEN_BITS[lit - 257]);
-					/* Extract distance */
-					if (size <= 4)
-						return 0;
-					if (!zlib_extract_huffman_code(&data, &bit, &size, status.hm_dist, &lit))
-						return 0;
-					if (lit > 29) /* Invalid code point */
+					len = HC_VALUE(entry) + extract_bits_little(br, HC_EXTRA(entry));
+					entry = zlib_extract_huffman_code(br, status->dist, status->dist_bits);
+					if (HC_TYPE(entry) != HC_BASE)
 						return 0;
-					dist = DIST_BASE[lit] + extract_bits_little(&data, &bit, &size, DIST_BITS[lit]);
-					/* Copy data */
-					cp = current - dist;
-					if (cp < raw || current + len > raw + rawsize)
+					dist = HC_VALUE(entry) + extract_bits_little(br, HC_EXTRA(entry));
+					if (end - current < len)
+					{
+						status->match_len = len - (int) (end - current);
+						status->match_dist = dist;
+						len = (int) (end - current);
+					}
+					if (!zlib_copy_match_wide(base, current, dist, len, last_marker))
 						return 0;
-					for (i = 0; i < len; i++)
-						*current++ = *cp++;
+					current += len;
 				}
+				else if (HC_TYPE(entry) == HC_END)
+					break;
+				else
+					return 0;
+			}
+		}
+		if (BITS_OVERRUN(br))
+			return 0;
+		status->state = status->bfinal ? DEFLATE_DONE : DEFLATE_HEADER;
+		if (status->block_stop)
+			break;
+	}
+OUTPUT_FULL:
+	*pcurrent = current;
+	return !BITS_OVERRUN(br);
+}
+
+/* Check that the final block ends at current, the end of output, and is
+ * followed by the Adler-32 checksum. At most one more byte is inflated, so
+ * DEFLATE_OUTPUT_SLACK writable bytes after current are enough.
+ */
+static int zlib_check_end(DEFLATE_status *status, BIT_reader *br, unsigned char *base, unsigned char *current, uint32_t adler)
+{
+	unsigned char *end;
+
+	end = current;
+	if (!zlib_inflate(status, br, base, &current, end + 1) || status->state != DEFLATE_DONE || current != end)
+		return 0;
+	return zlib_read_trailer(br, adler);
+}
+
+/* Decompress zlib stream into raw, which must be followed by DEFLATE_OUTPUT_SLACK writable bytes
+ * If verify is set, the stream must also end with the output and match its
+ * Adler-32 checksum, which is computed in steps while the output is in cache
+ */
+static int zlib_deflate_decode(BIT_reader *br, unsigned char *raw, int rawsize, int verify)
+{
+	DEFLATE_status status;
+	unsigned char *current, *start, *step;
+	uint32_t adler;
+
+	if (!zlib_read_header(br))
+		return 0;
+	zlib_init_inflate(&status);
+	current = raw;
+	if (!verify)
+	{
+		if (!zlib_inflate(&status, br, raw, &current, raw + rawsize))
+			return 0;
+		return current == raw + rawsize;
+	}
+	adler = 1;
+	while (current < raw + rawsize && status.state != DEFLATE_DONE)
+	{
+		start = current;
+		step = raw + rawsize - current > DEFLATE_VERIFY_STEP ? current + DEFLATE_VERIFY_STEP : raw + rawsize;
+		if (!zlib_inflate(&status, br, raw, &current, step))
+			return 0;
+		adler = adler32_update(adler, start, (int) (current - start));
+	}
+	if (current != raw + rawsize)
+		return 0;
+	return zlib_check_end(&status, br, raw, current, adler);
+}
+
+/* Streaming inflate
+ * Input is buffered and inflated into a window, from which output is copied
+ * to the caller. Each call of zlib_inflate is limited to output which can
+ * not run out of buffered input, so it is rarely retried. If it still runs
+ * out, the inflate state is rolled back to before the call.
+ */
+#define DEFLATE_STREAM_INPUT	65536 /* Input buffered */
+#define DEFLATE_STREAM_BUFFER	65536 /* Output buffered after the window */
+/* Input taken beyond 16 bits per byte of output: a dynamic block header takes
+ * at most 286 bytes, a cut off match 6 and the end of block 2
+ */
+#define DEFLATE_STREAM_MARGIN	320
+/* Output of a call which may run out of input, as it decodes padding until then */
+#define DEFLATE_STREAM_TAIL		1024
+/* Stream states */
+#define STREAM_HEADER			0 /* Fixed part of zlib or gzip header */
+#define STREAM_GZIP_EXTRA_LEN	1
+#define STREAM_GZIP_EXTRA		2
+#define STREAM_GZIP_NAME		3
+#define STREAM_GZIP_COMMENT		4
+#define STREAM_GZIP_HCRC		5
+#define STREAM_DATA				6
+#define STREAM_TRAILER			7
+#define STREAM_END				8
+#define STREAM_ERROR			9
+/* gzip header flags */
+#define GZIP_FHCRC		0x02
+#define GZIP_FEXTRA		0x04
+#define GZIP_FNAME		0x08
+#define GZIP_FCOMMENT	0x10
+
+struct FLUID_inflate
+{
+	int format;
+	int state;
+	int flags, skip; /* gzip header flags, and extra field bytes left */
+	uint32_t header_crc; /* CRC-32 of gzip header */
+	uint32_t check, size; /* Checksum and length of output */
+	DEFLATE_status inflate;
+	/* Input, of which bitpos bits are consumed */
+	int input_len, bitpos;
+	unsigned char input[DEFLATE_STREAM_INPUT];
+	/* Output, of which window_read bytes are copied to the caller */
+	int window_len, window_read;
+	unsigned char window[DEFLATE_WINDOW_SIZE + DEFLATE_STREAM_BUFFER + DEFLATE_OUTPUT_SLACK];
+};
+
+/* Consume n header bytes */
+static const unsigned char *zlib_stream_take(FLUID_inflate *stream, int n)
+{
+	const unsigned char *p;
+
+	p = stream->input + stream->bitpos / 8;
+	if (stream->format == FLUID_INFLATE_GZIP)
+		stream->header_crc = crc32_update(stream->header_crc, p, n);
+	stream->bitpos += n * 8;
+	return p;
+}
+
+/* Read zlib or gzip header
+ * Return: 1 if progressed, 0 if more input is needed, -1 if failed
+ */
+static int zlib_stream_header(FLUID_inflate *stream)
+{
+	const unsigned char *p;
+	int avail, n;
+
+	avail = stream->input_len - stream->bitpos / 8;
+	if (stream->state == STREAM_HEADER)
+	{
+		if (stream->format == FLUID_INFLATE_ZLIB)
+		{
+			if (avail < 2)
+				return 0;
+			p = zlib_stream_take(stream, 2);
+			if (LOBYTE(p[0]) != 8 || HIBYTE(p[0]) > 7 || (p[0] * 256 + p[1]) % 31 || (p[1] & 0x20))
+				return -1;
+			stream->state = STREAM_DATA;
+			return 1;
+		}
+		/* ID1, ID2, CM, FLG, MTIME, XFL, OS */
+		if (avail < 10)
+			return 0;
+		p = zlib_stream_take(stream, 10);
+		if (p[0] != 31 || p[1] != 139 || p[2] != 8 || (p[3] & 0xE0))
+			return -1;
+		stream->flags = p[3];
+		stream->state = STREAM_GZIP_EXTRA_LEN;
+		return 1;
+	}
+	if (stream->state == STREAM_GZIP_EXTRA_LEN)
+	{
+		if (stream->flags & GZIP_FEXTRA)
+		{
+			if (avail < 2)
+				return 0;
+			p = zlib_stream_take(stream, 2);
+			stream->skip = p[0] | (p[1] << 8);
+		}
+		stream->state = STREAM_GZIP_EXTRA;
+		return 1;
+	}
+	if (stream->state == STREAM_GZIP_EXTRA)
+	{
+		n = avail < stream->skip ? avail : stream->skip;
+		zlib_stream_take(stream, n);
+		stream->skip -= n;
+		if (stream->skip)
+			return n > 0;
+		stream->state = STREAM_GZIP_NAME;
+		return 1;
+	}
+	if (stream->state == STREAM_GZIP_NAME || stream->state == STREAM_GZIP_COMMENT)
+	{
+		/* Zero-terminated strings */
+		if (stream->flags & (stream->state == STREAM_GZIP_NAME ? GZIP_FNAME : GZIP_FCOMMENT))
+		{
+			p = memchr(stream->input + stream->bitpos / 8, 0, avail);
+			if (!p)
+			{
+				zlib_stream_take(stream, avail);
+				return avail > 0;
 			}
+			zlib_stream_take(stream, (int) (p - (stream->input + stream->bitpos / 8)) + 1);
 		}
+		stream->state++;
+		return 1;
+	}
+	/* STREAM_GZIP_HCRC */
+	if (stream->flags & GZIP_FHCRC)
+	{
+		if (avail < 2)
+			return 0;
+		n = stream->header_crc & 0xFFFF;
+		p = zlib_stream_take(stream, 2);
+		if ((p[0] | (p[1] << 8)) != n)
+			return -1;
+	}
+	stream->state = STREAM_DATA;
+	return 1;
+}
+
+/* Inflate buffered input into window
+ * Return: 1 if progressed, 0 if more input or output space is needed, -1 if failed
+ */
+static int zlib_stream_inflate(FLUID_inflate *stream)
+{
+	DEFLATE_status *status = &stream->inflate;
+	BIT_reader br;
+	const unsigned char *data;
+	unsigned char *start, *current;
+	const uint32_t *lit, *dist;
+	int state, bfinal, lit_bits, dist_bits, stored_len, match_len, match_dist;
+	int avail, limit, pos;
+
+	/* Slide window when output buffer is full and copied */
+	if (stream->window_len == DEFLATE_WINDOW_SIZE + DEFLATE_STREAM_BUFFER)
+	{
+		if (stream->window_read < stream->window_len)
+			return 0;
+		memmove(stream->window, stream->window + DEFLATE_STREAM_BUFFER, DEFLATE_WINDOW_SIZE);
+		stream->window_len = stream->window_read = DEFLATE_WINDOW_SIZE;
+	}
+	data = stream->input + stream->bitpos / 8;
+	avail = stream->input_len - stream->bitpos / 8;
+	if (status->state == DEFLATE_STORED)
+		limit = avail;
+	else
+		limit = (avail - DEFLATE_STREAM_MARGIN) / 2;
+	if (limit < 1) /* Input may run out */
+		limit = DEFLATE_STREAM_TAIL;
+	if (limit > DEFLATE_WINDOW_SIZE + DEFLATE_STREAM_BUFFER - stream->window_len)
+		limit = DEFLATE_WINDOW_SIZE + DEFLATE_STREAM_BUFFER - stream->window_len;
+
+	/* Tables are only rebuilt at the start of a call, as blocks stop
+	 * decoding, so the rest of the state is enough to roll back
+	 */
+	state = status->state;
+	bfinal = status->bfinal;
+	lit = status->lit;
+	dist = status->dist;
+	lit_bits = status->lit_bits;
+	dist_bits = status->dist_bits;
+	stored_len = status->stored_len;
+	match_len = status->match_len;
+	match_dist = status->match_dist;
+
+	init_bits(&br, data, avail);
+	refill_bits_little(&br);
+	skip_bits_little(&br, stream->bitpos & 7);
+	start = current = stream->window + stream->window_len;
+	if (!zlib_inflate(status, &br, stream->window, &current, current + limit) || BITS_OVERRUN(&br))
+	{
+		/* Out of input unless the buffer is full */
+		if (br.data < br.end || stream->input_len == DEFLATE_STREAM_INPUT)
+			return -1;
+		status->state = state;
+		status->bfinal = bfinal;
+		status->lit = lit;
+		status->dist = dist;
+		status->lit_bits = lit_bits;
+		status->dist_bits = dist_bits;
+		status->stored_len = stored_len;
+		status->match_len = match_len;
+		status->match_dist = match_dist;
+		return 0;
+	}
+	pos = (int) (br.data - stream->input) * 8 - (br.count - br.overrun * 8);
+	if (pos == stream->bitpos && current == start && status->state != DEFLATE_DONE)
+		return 0;
+	stream->bitpos = pos;
+	if (stream->format == FLUID_INFLATE_ZLIB)
+		stream->check = adler32_update(stream->check, start, (int) (current - start));
+	else if (stream->format == FLUID_INFLATE_GZIP)
+		stream->check = crc32_update(stream->check, start, (int) (current - start));
+	stream->size += (uint32_t) (current - start);
+	stream->window_len += (int) (current - start);
+	if (status->state == DEFLATE_DONE)
+	{
+		stream->bitpos = (stream->bitpos + 7) & ~7;
+		stream->state = stream->format == FLUID_INFLATE_RAW ? STREAM_END : STREAM_TRAILER;
+	}
+	return 1;
+}
+
+/* Check Adler-32 of zlib, or CRC-32 and size of gzip
+ * Return: 1 if matched, 0 if more input is needed, -1 if failed
+ */
+static int zlib_stream_trailer(FLUID_inflate *stream)
+{
+	const unsigned char *p;
+
+	p = stream->input + stream->bitpos / 8;
+	if (stream->format == FLUID_INFLATE_ZLIB)
+	{
+		if (stream->input_len - stream->bitpos / 8 < 4)
+			return 0;
+		if (GET_UINT32_BIG(p) != stream->check)
+			return -1;
+		stream->bitpos += 32;
+	}
+	else
+	{
+		if (stream->input_len - stream->bitpos / 8 < 8)
+			return 0;
+		if (load_uint32_little(p) != stream->check || load_uint32_little(p + 4) != stream->size)
+			return -1;
+		stream->bitpos += 64;
 	}
+	stream->state = STREAM_END;
 	return 1;
 }
 
+FLUID_inflate *fluid_inflate_init(int format)
+{
+	FLUID_inflate *stream;
+
+	if (format != FLUID_INFLATE_RAW && format != FLUID_INFLATE_ZLIB && format != FLUID_INFLATE_GZIP)
+		return NULL;
+	stream = malloc(sizeof(FLUID_inflate));
+	if (!stream)
+		return NULL;
+	stream->format = format;
+	stream->state = format == FLUID_INFLATE_RAW ? STREAM_DATA : STREAM_HEADER;
+	stream->flags = 0;
+	stream->skip = 0;
+	stream->header_crc = 0;
+	stream->check = format == FLUID_INFLATE_ZLIB ? 1 : 0;
+	stream->size = 0;
+	zlib_init_inflate(&stream->inflate);
+	stream->inflate.block_stop = 1;
+	stream->input_len = 0;
+	stream->bitpos = 0;
+	stream->window_len = 0;
+	stream->window_read = 0;
+	return stream;
+}
+
+int fluid_inflate_feed(FLUID_inflate *stream, const char *in, int in_size, int *in_used, char *out, int out_size, int *out_used)
+{
+	int n, progress, result;
+
+	*in_used = 0;
+	*out_used = 0;
+	for (;;)
+	{
+		if (stream->state == STREAM_ERROR)
+			return FLUID_INFLATE_ERROR;
+		progress = 0;
+		/* Copy output */
+		n = stream->window_len - stream->window_read;
+		if (n > out_size - *out_used)
+			n = out_size - *out_used;
+		if (n > 0)
+		{
+			memcpy(out + *out_used, stream->window + stream->window_read, n);
+			stream->window_read += n;
+			*out_used += n;
+			progress = 1;
+		}
+		if (stream->state == STREAM_END || stream->window_read < stream->window_len)
+		{
+			/* Output is full or the stream ended. Give back buffered input not
+			 * consumed as far as taken by this call, as it may follow the end
+			 * of stream. Calls which keep input stopped short of it, so input
+			 * taken before is within the stream.
+			 */
+			n = stream->input_len - stream->bitpos / 8;
+			if (n > *in_used)
+				n = *in_used;
+			stream->input_len -= n;
+			*in_used -= n;
+			return stream->window_read == stream->window_len ? FLUID_INFLATE_END : FLUID_INFLATE_MORE;
+		}
+		/* Drop consumed input when short of space, and take more */
+		n = stream->bitpos / 8;
+		if (n > 0 && (n >= DEFLATE_STREAM_INPUT / 2 || in_size - *in_used > DEFLATE_STREAM_INPUT - stream->input_len))
+		{
+			memmove(stream->input, stream->input + n, stream->input_len - n);
+			stream->input_len -= n;
+			stream->bitpos -= n * 8;
+		}
+		n = in_size - *in_used;
+		if (n > DEFLATE_STREAM_INPUT - stream->input_len)
+			n = DEFLATE_STREAM_INPUT - stream->input_len;
+		if (n > 0)
+		{
+			memcpy(stream->input + stream->input_len, in + *in_used, n);
+			stream->input_len += n;
+			*in_used += n;
+			progress = 1;
+		}
+		if (stream->state == STREAM_DATA)
+			result = zlib_stream_inflate(stream);
+		else if (stream->state == STREAM_TRAILER)
+			result = zlib_stream_trailer(stream);
+		else
+			result = zlib_stream_header(stream);
+		if (result < 0)
+		{
+			stream->state = STREAM_ERROR;
+			return FLUID_INFLATE_ERROR;
+		}
+		if (!result && !progress)
+			return FLUID_INFLATE_MORE;
+	}
+}
+
+int fluid_inflate_finish(FLUID_inflate *stream)
+{
+	int ok;
+
+	ok = stream->state == STREAM_END && stream->window_read == stream->window_len;
+	free(stream);
+	return ok;
+}
+
 /* PNG decoder */
 typedef struct
 {
@@ -387,46 +1950,130 @@ typedef struct
 	int depth, color_type;
 	int compression_method, filter_method, interlace_method;
 	int sample_per_pixel;
-	int zlen, rawlen, imagelen;
-	unsigned char *zraw, *raw, *defiltered, *interlaced, *image;
+	int rawlen, imagelen;
+	unsigned char *raw, *interlaced, *image;
+	/* Chunks after IHDR */
+	const unsigned char *chunks;
+	int chunks_size;
+	/* IDAT chunks: first chunk data, and remaining data after current chunk */
+	const unsigned char *idat_data;
+	int idat_len;
+	const unsigned char *idat_next;
+	int idat_size;
+	int fdat; /* The run is of fdAT chunks, whose data follow sequence numbers */
+	/* iDOT chunk */
+	const unsigned char *idot;
+	int idot_len;
+	/* Checksums are verified, and whether one did not match */
+	int verify, checksum_error;
 	/* Palette */
 	int palette_count;
 	const unsigned char *palette;
 	/* Interlacing */
 	int adam7_pass_width[8], adam7_pass_height[8];
+	/* Region of non-interlaced image decoded by png_decode_scanlines */
+	IMAGE_region region;
+	/* Animation: number of frames and plays of acTL chunk, 0 frames if none,
+	 * and whether the image is the first frame
+	 */
+	int frame_count, play_count;
+	int default_frame;
 	/* Transparency */
 	int transparency_count;
 	const unsigned char *transparency;
+	/* Output pixel layout FLUID_LAYOUT_*, and its bytes per pixel */
+	int layout, pixel_size;
+	/* Pixel extraction kernel chosen by png_init_extract, and its tables */
+	int extract;
+	int lut_count; /* Samples below are valid indices of lut */
+	uint32_t lut[256]; /* RGBA of palette entries or gray samples */
+	uint32_t expand[256 * 8]; /* RGBA of the 8 / depth pixels packed in a byte */
+	unsigned char expand_bad[256]; /* Whether a byte packs an invalid index */
 } PNG_status;
 
+/* Data is left unchanged if failed */
 static int png_extract_chunk(const unsigned char **data, int *size, const unsigned char **chunk_type, const unsigned char **chunk_data, int *chunk_len)
 {
+	const unsigned char *p;
 	if (*size < 12)
 		return 0;
-	EXTRACT_UINT32_BIG(*data, *chunk_len);
-	if (*size < 12 + *chunk_len)
+	p = *data;
+	EXTRACT_UINT32_BIG(p, *chunk_len);
+	if (*chunk_len < 0 || *size - 12 < *chunk_len)
 		return 0;
 	*size -= 12 + *chunk_len;
-	*chunk_type = *data;
-	*data += 4;
-	*chunk_data = *data;
-	*data += *chunk_len;
-	*data += 4; /* CRC */
+	*chunk_type = p;
+	p += 4;
+	*chunk_data = p;
+	p += *chunk_len;
+	p += 4; /* CRC */
+	*data = p;
 	return 1;
 }
 
-static int png_extract_data_size(PNG_status *status, const unsigned char *data, int size, const unsigned char *ctype, const unsigned char *cdata, int clen)
+/* Whether CRC following chunk data matches chunk type and data */
+static int png_check_crc(const unsigned char *chunk_type, int chunk_len)
 {
-	status->zlen = 0;
-	do
+	return crc32_update(0, chunk_type, chunk_len + 4) == GET_UINT32_BIG(chunk_type + 4 + chunk_len);
+}
+
+/* Get data of next IDAT chunk in a contiguous run, as segments of a bit reader
+ * When verifying, the CRC is checked just before the chunk is inflated. CRCs
+ * of fdAT chunks are checked with the other chunks by png_read_chunks.
+ */
+static int png_next_idat(void *source, const unsigned char **data, const unsigned char **end)
+{
+	PNG_status *status = source;
+	const unsigned char *ctype, *cdata;
+	int clen;
+
+	if (!png_extract_chunk(&status->idat_next, &status->idat_size, &ctype, &cdata, &clen))
+		return 0;
+	if (status->fdat ? (ctype[0] != 'f' || ctype[1] != 'd' || ctype[2] != 'A' || ctype[3] != 'T' || clen < 4)
+		: (ctype[0] != 'I' || ctype[1] != 'D' || ctype[2] != 'A' || ctype[3] != 'T'))
 	{
-		status->zlen += clen;
-		if (!png_extract_chunk(&data, &size, &ctype, &cdata, &clen))
-			return 0;
-	} while (ctype[0] == 'I' && ctype[1] == 'D' && ctype[2] == 'A' && ctype[3] == 'T');
+		status->idat_size = 0; /* End of run */
+		return 0;
+	}
+	if (status->verify && !status->fdat && !png_check_crc(ctype, clen))
+	{
+		status->checksum_error = 1;
+		status->idat_size = 0;
+		return 0;
+	}
+	if (status->fdat)
+	{
+		cdata += 4;
+		clen -= 4;
+	}
+	*data = cdata;
+	*end = cdata + clen;
+	return 1;
+}
+
+/* Point bit reader to zlib data in IDAT chunks */
+static int png_init_idat_bits(PNG_status *status, BIT_reader *br)
+{
+	if (status->verify && !status->fdat && !png_check_crc(status->idat_data - 4, status->idat_len))
+		return 0;
+	init_bits(br, status->idat_data, status->idat_len);
+	br->next_segment = png_next_idat;
+	br->source = status;
 	return 1;
 }
 
+/* Check IDAT chunks after the end of zlib stream when verifying
+ * Return: 0 if a CRC did not match
+ */
+static int png_check_idat_tail(PNG_status *status)
+{
+	const unsigned char *data, *end;
+
+	while (status->verify && png_next_idat(status, &data, &end))
+		;
+	return !status->checksum_error;
+}
+
 static INLINE int png_get_scanline_len(int width, int depth, int sample_per_pixel)
 {
 	int sample_per_byte;
@@ -443,98 +2090,300 @@ static INLINE int png_get_scanline_len(int width, int depth, int sample_per_pixe
 
 static INLINE int png_paeth_predictor(int a, int b, int c)
 {
-	int p, pa, pb, pc;
-	p = a + b - c;
-	pa = abs(p - a);
-	pb = abs(p - b);
-	pc = abs(p - c);
-	if (pa <= pb && pa <= pc)
-		return a;
-	else if (pb <= pc)
-		return b;
-	else
-		return c;
+	int pa, pb, pc;
+	pa = abs(b - c); /* |p - a| */
+	pb = abs(a - c); /* |p - b| */
+	pc = abs(a + b - c - c); /* |p - c| */
+	if (pb < pa)
+	{
+		pa = pb;
+		a = b;
+	}
+	return pc < pa ? c : a;
 }
 
-static void png_defilter(const unsigned char *data, unsigned char *image, int width, int height, int depth, int sample_per_pixel)
+/* Defilter kernels
+ * in and out point after the filter type byte, prev after the previous
+ * defiltered filter type byte. len is the number of bytes and bpp the distance
+ * of a in bytes. Bytes before the row are treated as zero.
+ */
+static void png_defilter_sub(const unsigned char *in, unsigned char *out, int len, int bpp)
 {
-	unsigned char type;
-	int i, j;
-	int ap, bp; /* Byte offset of a, b */
-	unsigned int a, b, c, k;
-	int scanline_len;
+	int j;
 
-	scanline_len = png_get_scanline_len(width, depth, sample_per_pixel);
+	if (bpp > len)
+		bpp = len;
+	memcpy(out, in, bpp);
+	for (j = bpp; j < len; j++)
+		out[j] = in[j] + out[j - bpp];
+}
 
-	if (depth < 8)
-		ap = -1;
-	else
-		ap = -(depth / 8 * sample_per_pixel);
-	bp = -scanline_len;
+static void png_defilter_up(const unsigned char *in, const unsigned char *prev, unsigned char *out, int len)
+{
+	int j = 0;
 
-	for (i = 0; i < height; i++)
+#ifdef FLUID_SSE2
+	for (; j + 16 <= len; j += 16)
+		_mm_storeu_si128((__m128i *) (out + j), _mm_add_epi8(_mm_loadu_si128((const __m128i *) (in + j)), _mm_loadu_si128((const __m128i *) (prev + j))));
+#endif
+	for (; j < len; j++)
+		out[j] = in[j] + prev[j];
+}
+
+/* prev is NULL for the first row */
+static void png_defilter_average(const unsigned char *in, const unsigned char *prev, unsigned char *out, int len, int bpp)
+{
+	int j;
+
+	if (bpp > len)
+		bpp = len;
+	if (!prev)
 	{
-		EXTRACT_UINT8(data, type);
-		*image++ = type;
-		if (type == 0) /* None */
-		{
-			for (j = 1; j < scanline_len; j++)
-			{
-				EXTRACT_UINT8(data, k);
-				*image++ = k;
-			}
-		}
-		else if (type == 1) /* Sub */
-		{
-			for (j = 1; j < scanline_len; j++)
-			{
-				a = (j + ap > 0) ? image[ap] : 0;
-				EXTRACT_UINT8(data, k);
-				*image++ = k + a;
-			}
-		}
-		else if (type == 2) /* Up */
-		{
-			for (j = 1; j < scanline_len; j++)
-			{
-				b = (i > 0) ? image[bp] : 0;
-				EXTRACT_UINT8(data, k);
-				*image++ = k + b;
-			}
-		}
-		else if (type == 3) /* Average */
-		{
-			for (j = 1; j < scanline_len; j++)
-			{
-				a = (j + ap > 0) ? image[ap] : 0;
-				b = (i > 0) ? image[bp] : 0;
-				EXTRACT_UINT8(data, k);
-				*image++ = k + (a + b) / 2;
-			}
-		}
-		else if (type == 4) /* Paeth */
-		{
-			for (j = 1; j < scanline_len; j++)
-			{
-				a = (j + ap > 0) ? image[ap] : 0;
-				b = (i > 0) ? image[bp] : 0;
-				c = (i > 0 && j + ap > 0) ? image[ap + bp] : 0;
-				EXTRACT_UINT8(data, k);
-				*image++ = k + png_paeth_predictor(a, b, c);
-			}
-		}
+		memcpy(out, in, bpp);
+		for (j = bpp; j < len; j++)
+			out[j] = in[j] + (out[j - bpp] >> 1);
+		return;
 	}
+	for (j = 0; j < bpp; j++)
+		out[j] = in[j] + (prev[j] >> 1);
+	for (; j < len; j++)
+		out[j] = in[j] + ((out[j - bpp] + prev[j]) >> 1);
 }
 
-/*
- * Adam7 passes:
- *
- * 1 6 4 6 2 6 4 6
- * 7 7 7 7 7 7 7 7
- * 5 6 5 6 5 6 5 6
- * 7 7 7 7 7 7 7 7
- * 3 6 4 6 3 6 4 6
- * 7 7 7 7 7 7 7 7
+static void png_defilter_paeth(const unsigned char *in, const unsigned char *prev, unsigned char *out, int len, int bpp)
+{
+	int j;
+
+	if (bpp > len)
+		bpp = len;
+	for (j = 0; j < bpp; j++)
+		out[j] = in[j] + prev[j];
+	for (; j < len; j++)
+		out[j] = in[j] + png_paeth_predictor(out[j - bpp], prev[j], prev[j - bpp]);
+}
+
+#ifdef FLUID_SSE2
+/* Load or store a pixel of bpp (at most 8) bytes in the low bytes of a vector
+ * Unless exact, 4 or 8 bytes are accessed, which must stay within the row
+ */
+static INLINE __m128i png_load_pixel(const unsigned char *data, int bpp, int exact)
+{
+	uint64_t x = 0;
+
+	if (!exact && bpp <= 4)
+		return _mm_cvtsi32_si128((int) load_uint32_little(data));
+	if (!exact || bpp == 8)
+		return _mm_loadl_epi64((const __m128i *) data);
+	memcpy(&x, data, bpp);
+	return _mm_loadl_epi64((const __m128i *) &x);
+}
+
+static INLINE void png_store_pixel(unsigned char *data, __m128i v, int bpp, int exact)
+{
+	uint32_t y;
+	uint64_t x;
+
+	if (!exact && bpp <= 4)
+	{
+		y = (uint32_t) _mm_cvtsi128_si32(v);
+		memcpy(data, &y, 4);
+	}
+	else if (!exact || bpp == 8)
+		_mm_storel_epi64((__m128i *) data, v);
+	else
+	{
+		_mm_storel_epi64((__m128i *) &x, v);
+		memcpy(data, &x, bpp);
+	}
+}
+
+static INLINE __m128i png_abs_epi16(__m128i x)
+{
+#ifdef FLUID_SSSE3
+	return _mm_abs_epi16(x);
+#else
+	return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+#endif
+}
+
+/* One pixel per step, bytes of a pixel are defiltered in parallel.
+ * Inlined with constant bpp so that loads and stores are single moves, the
+ * last pixels are accessed exactly.
+ */
+static INLINE void png_defilter_sub_sse2(const unsigned char *in, unsigned char *out, int len, int bpp)
+{
+	__m128i a = _mm_setzero_si128();
+	int j;
+
+	for (j = 0; j + 8 <= len; j += bpp)
+	{
+		a = _mm_add_epi8(png_load_pixel(in + j, bpp, 0), a);
+		png_store_pixel(out + j, a, bpp, 0);
+	}
+	for (; j < len; j += bpp)
+	{
+		a = _mm_add_epi8(png_load_pixel(in + j, bpp, 1), a);
+		png_store_pixel(out + j, a, bpp, 1);
+	}
+}
+
+static INLINE __m128i png_average_sse2(__m128i a, __m128i b)
+{
+	/* avg_epu8 rounds up, (a + b) >> 1 rounds down */
+	return _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+}
+
+static INLINE void png_defilter_average_sse2(const unsigned char *in, const unsigned char *prev, unsigned char *out, int len, int bpp)
+{
+	__m128i a = _mm_setzero_si128();
+	int j;
+
+	for (j = 0; j + 8 <= len; j += bpp)
+	{
+		a = _mm_add_epi8(png_load_pixel(in + j, bpp, 0), png_average_sse2(a, png_load_pixel(prev + j, bpp, 0)));
+		png_store_pixel(out + j, a, bpp, 0);
+	}
+	for (; j < len; j += bpp)
+	{
+		a = _mm_add_epi8(png_load_pixel(in + j, bpp, 1), png_average_sse2(a, png_load_pixel(prev + j, bpp, 1)));
+		png_store_pixel(out + j, a, bpp, 1);
+	}
+}
+
+/* Branchless Paeth predictor on samples widened to 16 bits, where p - a,
+ * p - b and p - c cannot overflow
+ */
+static INLINE __m128i png_paeth_sse2(__m128i a, __m128i b, __m128i c)
+{
+	__m128i pa, pb, pc, smallest, mask, x;
+
+	pa = _mm_sub_epi16(b, c);
+	pb = _mm_sub_epi16(a, c);
+	pc = png_abs_epi16(_mm_add_epi16(pa, pb));
+	pa = png_abs_epi16(pa);
+	pb = png_abs_epi16(pb);
+	smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+	/* Ties prefer a, then b */
+	mask = _mm_cmpeq_epi16(smallest, pb);
+	x = _mm_or_si128(_mm_and_si128(mask, b), _mm_andnot_si128(mask, c));
+	mask = _mm_cmpeq_epi16(smallest, pa);
+	return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, x));
+}
+
+static INLINE void png_defilter_paeth_sse2(const unsigned char *in, const unsigned char *prev, unsigned char *out, int len, int bpp)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i a = zero, b, c = zero, x;
+	int j;
+
+	for (j = 0; j + 8 <= len; j += bpp)
+	{
+		b = _mm_unpacklo_epi8(png_load_pixel(prev + j, bpp, 0), zero);
+		x = png_paeth_sse2(a, b, c);
+		x = _mm_add_epi8(png_load_pixel(in + j, bpp, 0), _mm_packus_epi16(x, x));
+		png_store_pixel(out + j, x, bpp, 0);
+		a = _mm_unpacklo_epi8(x, zero);
+		c = b;
+	}
+	for (; j < len; j += bpp)
+	{
+		b = _mm_unpacklo_epi8(png_load_pixel(prev + j, bpp, 1), zero);
+		x = png_paeth_sse2(a, b, c);
+		x = _mm_add_epi8(png_load_pixel(in + j, bpp, 1), _mm_packus_epi16(x, x));
+		png_store_pixel(out + j, x, bpp, 1);
+		a = _mm_unpacklo_epi8(x, zero);
+		c = b;
+	}
+}
+#endif
+
+/* Defilter a scanline, including its filter type byte
+ * prev is the previous defiltered scanline, or NULL for the first one
+ * Return: 0 if filter type is invalid
+ */
+static int png_defilter_row(const unsigned char *data, const unsigned char *prev, unsigned char *image, int scanline_len, int depth, int sample_per_pixel)
+{
+	unsigned char type;
+	int len, bpp;
+
+	/* Bytes per complete pixel, at least 1 */
+	if (depth < 8)
+		bpp = 1;
+	else
+		bpp = depth / 8 * sample_per_pixel;
+
+	EXTRACT_UINT8(data, type);
+	*image++ = type;
+	len = scanline_len - 1;
+	if (prev)
+		prev++;
+	else if (type == 2) /* Up from zero */
+		type = 0;
+	else if (type == 4) /* Paeth from zero is always a */
+		type = 1;
+
+	if (type == 0) /* None */
+		memcpy(image, data, len);
+	else if (type == 2) /* Up */
+		png_defilter_up(data, prev, image, len);
+#ifdef FLUID_SSE2
+	else if (bpp >= 3 && (type == 1 || (type == 3 && prev) || type == 4))
+	{
+		if (type == 1) /* Sub */
+		{
+			if (bpp == 3)
+				png_defilter_sub_sse2(data, image, len, 3);
+			else if (bpp == 4)
+				png_defilter_sub_sse2(data, image, len, 4);
+			else if (bpp == 6)
+				png_defilter_sub_sse2(data, image, len, 6);
+			else
+				png_defilter_sub_sse2(data, image, len, 8);
+		}
+		else if (type == 3) /* Average */
+		{
+			if (bpp == 3)
+				png_defilter_average_sse2(data, prev, image, len, 3);
+			else if (bpp == 4)
+				png_defilter_average_sse2(data, prev, image, len, 4);
+			else if (bpp == 6)
+				png_defilter_average_sse2(data, prev, image, len, 6);
+			else
+				png_defilter_average_sse2(data, prev, image, len, 8);
+		}
+		else /* Paeth */
+		{
+			if (bpp == 3)
+				png_defilter_paeth_sse2(data, prev, image, len, 3);
+			else if (bpp == 4)
+				png_defilter_paeth_sse2(data, prev, image, len, 4);
+			else if (bpp == 6)
+				png_defilter_paeth_sse2(data, prev, image, len, 6);
+			else
+				png_defilter_paeth_sse2(data, prev, image, len, 8);
+		}
+	}
+#endif
+	else if (type == 1) /* Sub */
+		png_defilter_sub(data, image, len, bpp);
+	else if (type == 3) /* Average */
+		png_defilter_average(data, prev, image, len, bpp);
+	else if (type == 4) /* Paeth */
+		png_defilter_paeth(data, prev, image, len, bpp);
+	else
+		return 0;
+	return 1;
+}
+
+/*
+ * Adam7 passes:
+ *
+ * 1 6 4 6 2 6 4 6
+ * 7 7 7 7 7 7 7 7
+ * 5 6 5 6 5 6 5 6
+ * 7 7 7 7 7 7 7 7
+ * 3 6 4 6 3 6 4 6
+ * 7 7 7 7 7 7 7 7
  * 5 6 5 6 5 6 5 6
  * 7 7 7 7 7 7 7 7
  */
@@ -542,6 +2391,9 @@ static const int adam7_horizontal_start[8] = { 0, 1, 5, 1, 3, 1, 2, 1 };
 static const int adam7_vertical_start[8]   = { 0, 1, 1, 5, 1, 3, 1, 2 };
 static const int adam7_horizontal_delta[8] = { 0, 8, 8, 4, 4, 2, 2, 1 };
 static const int adam7_vertical_delta[8]   = { 0, 8, 8, 8, 4, 4, 2, 2 };
+/* Block of image covered by a pixel after its pass */
+static const int adam7_block_width[8]      = { 0, 8, 4, 4, 2, 2, 1, 1 };
+static const int adam7_block_height[8]     = { 0, 8, 8, 4, 4, 2, 2, 1 };
 static void png_extract_adam7_extent(PNG_status *status)
 {
 	int i;
@@ -552,44 +2404,32 @@ static void png_extract_adam7_extent(PNG_status *status)
 	}
 }
 
-static void png_deinterlace_adam7(PNG_status *status, const unsigned char *data, unsigned char *image)
-{
-	int pass, i, j;
-	for (pass = 1; pass <= 7; pass++)
-		for (i = adam7_vertical_start[pass] - 1; i < status->height; i += adam7_vertical_delta[pass])
-			for (j = adam7_horizontal_start[pass] - 1; j < status->width; j += adam7_horizontal_delta[pass])
-			{
-				*(uint32_t *) (image + (status->width * i + j) * 4) = *(uint32_t *) data;
-				data += 4;
-			}
-}
-
-static int png_extract_pixels(PNG_status *status, const unsigned char *data, unsigned char *dest, int width, int height, int size)
+/* Extract pixels of any format sample by sample */
+static int png_extract_generic(const PNG_status *status, const unsigned char *data, unsigned char *dest, int width, int height, int size)
 {
 	unsigned char *image;
-	unsigned int bit;
+	BIT_reader br;
 	int i, j, index;
 	unsigned int sampler, sampleg, sampleb;
 	int tr, tg, tb;
 	
 	image = dest;
-	bit = 0;
+	init_bits(&br, data, size);
 	if (status->color_type == 0) /* Grayscale */
 	{
 		if (status->transparency)
 			tg = GET_UINT16_BIG(status->transparency);
 		for (i = 0; i < height; i++)
 		{
-			data++; /* Filter type byte */
+			extract_bits_big(&br, 8); /* Filter type byte */
 			for (j = 0; j < width; j++)
 			{
-				sampleg = extract_bits_big(&data, &bit, &size, status->depth);
+				sampleg = extract_bits_big(&br, status->depth);
 				image[0] = image[1] = image[2] = sample_rescale(status->depth, sampleg);
 				image[3] = (status->transparency && sampleg == tg) ? 0 : 0xFF;
 				image += 4;
 			}
-			if (bit > 0) /* Skip remaining bits */
-				data++, bit = 0;
+			align_bits_big(&br); /* Skip remaining bits */
 		}
 	}
 	else if (status->color_type == 2) /* Truecolor */
@@ -602,30 +2442,29 @@ static int png_extract_pixels(PNG_status *status, const unsigned char *data, uns
 		}
 		for (i = 0; i < height; i++)
 		{
-			data++; /* Filter type byte */
+			extract_bits_big(&br, 8); /* Filter type byte */
 			for (j = 0; j < width; j++)
 			{
-				sampler = extract_bits_big(&data, &bit, &size, status->depth);
-				sampleg = extract_bits_big(&data, &bit, &size, status->depth);
-				sampleb = extract_bits_big(&data, &bit, &size, status->depth);
+				sampler = extract_bits_big(&br, status->depth);
+				sampleg = extract_bits_big(&br, status->depth);
+				sampleb = extract_bits_big(&br, status->depth);
 				image[0] = sample_rescale(status->depth, sampler);
 				image[1] = sample_rescale(status->depth, sampleg);
 				image[2] = sample_rescale(status->depth, sampleb);
 				image[3] = (status->transparency && sampler == tr && sampleg == tg && sampleb == tb) ? 0 : 0xFF;
 				image += 4;
 			}
-			if (bit > 0) /* Skip remaining bits */
-				data++, bit = 0;
+			align_bits_big(&br); /* Skip remaining bits */
 		}
 	}
 	else if (status->color_type == 3) /* Indexed */
 	{
 		for (i = 0; i < height; i++)
 		{
-			data++; /* Filter type byte */
+			extract_bits_big(&br, 8); /* Filter type byte */
 			for (j = 0; j < width; j++)
 			{
-				index = extract_bits_big(&data, &bit, &size, status->depth);
+				index = extract_bits_big(&br, status->depth);
 				if (index >= status->palette_count)
 					return 0;
 				image[0] = status->palette[index * 3 + 0];
@@ -634,460 +2473,2640 @@ static int png_extract_pixels(PNG_status *status, const unsigned char *data, uns
 				image[3] = (status->transparency && index < status->transparency_count) ? status->transparency[index] : 0xFF;
 				image += 4;
 			}
-			if (bit > 0) /* Skip remaining bits */
-				data++, bit = 0;
+			align_bits_big(&br); /* Skip remaining bits */
 		}
 	}
 	else if (status->color_type == 4) /* Gray with alpha */
 	{
 		for (i = 0; i < height; i++)
 		{
-			data++; /* Filter type byte */
+			extract_bits_big(&br, 8); /* Filter type byte */
 			for (j = 0; j < width; j++)
 			{
-				image[0] = image[1] = image[2] = sample_rescale(status->depth, extract_bits_big(&data, &bit, &size, status->depth));
-				image[3] = sample_rescale(status->depth, extract_bits_big(&data, &bit, &size, status->depth));
+				image[0] = image[1] = image[2] = sample_rescale(status->depth, extract_bits_big(&br, status->depth));
+				image[3] = sample_rescale(status->depth, extract_bits_big(&br, status->depth));
 				image += 4;
 			}
-			if (bit > 0) /* Skip remaining bits */
-				data++, bit = 0;
+			align_bits_big(&br); /* Skip remaining bits */
 		}
 	}
 	else if (status->color_type == 6) /* Truecolor with alpha */
 	{
 		for (i = 0; i < height; i++)
 		{
-			data++; /* Filter type byte */
+			extract_bits_big(&br, 8); /* Filter type byte */
 			for (j = 0; j < width; j++)
 			{
-				image[0] = sample_rescale(status->depth, extract_bits_big(&data, &bit, &size, status->depth));
-				image[1] = sample_rescale(status->depth, extract_bits_big(&data, &bit, &size, status->depth));
-				image[2] = sample_rescale(status->depth, extract_bits_big(&data, &bit, &size, status->depth));
-				image[3] = sample_rescale(status->depth, extract_bits_big(&data, &bit, &size, status->depth));
+				image[0] = sample_rescale(status->depth, extract_bits_big(&br, status->depth));
+				image[1] = sample_rescale(status->depth, extract_bits_big(&br, status->depth));
+				image[2] = sample_rescale(status->depth, extract_bits_big(&br, status->depth));
+				image[3] = sample_rescale(status->depth, extract_bits_big(&br, status->depth));
 				image += 4;
 			}
-			if (bit > 0) /* Skip remaining bits */
-				data++, bit = 0;
+			align_bits_big(&br); /* Skip remaining bits */
 		}
 	}
 	return 1;
 }
 
-static char *png_decode(const unsigned char *data, int size, int *width, int *height)
+/* Pixel extraction kernels, 16-bit samples are narrowed to 8-bit first */
+#define PNG_EXTRACT_GENERIC		0 /* png_extract_generic */
+#define PNG_EXTRACT_RGBA		1 /* Truecolor with alpha */
+#define PNG_EXTRACT_RGB			2 /* Truecolor */
+#define PNG_EXTRACT_GRAY_ALPHA	3 /* Gray with alpha */
+#define PNG_EXTRACT_LUT			4 /* 8-bit palette index or gray sample */
+#define PNG_EXTRACT_PACKED		5 /* 1, 2 or 4-bit palette index or gray sample */
+#define PNG_EXTRACT_NATIVE		6 /* Samples in the layout of png_native_layout */
+
+#define PNG_NARROW_PIXELS		256 /* Pixels of 16-bit samples narrowed at a time */
+
+/* Pixel with bytes in RGBA order */
+static INLINE uint32_t png_rgba(unsigned int r, unsigned int g, unsigned int b, unsigned int a)
+{
+	unsigned char pixel[4];
+	uint32_t x;
+
+	pixel[0] = r;
+	pixel[1] = g;
+	pixel[2] = b;
+	pixel[3] = a;
+	memcpy(&x, pixel, 4);
+	return x;
+}
+
+static INLINE void png_store_rgba(unsigned char *image, uint32_t x)
 {
-	PNG_status status;
-	const unsigned char *ctype, *cdata;
-	unsigned char *zraw;
-	int clen, isize, i, j, k;
-
-	status.zraw = NULL;
-	status.raw = NULL;
-	status.defiltered = NULL;
-	status.interlaced = NULL;
-	status.image = NULL;
-	status.palette = NULL;
-	status.transparency = NULL;
-	
-	/* Dealing with IHDR chunk */
-	if (png_extract_chunk(&data, &size, &ctype, &cdata, &clen) &&
-		clen == 13 &&
-		ctype[0] == 'I' && ctype[1] == 'H' && ctype[2] == 'D' && ctype[3] == 'R')
-	{
-		EXTRACT_UINT32_BIG(cdata, status.width);
-		EXTRACT_UINT32_BIG(cdata, status.height);
-		EXTRACT_UINT8(cdata, status.depth);
-		EXTRACT_UINT8(cdata, status.color_type);
-		EXTRACT_UINT8(cdata, status.compression_method);
-		EXTRACT_UINT8(cdata, status.filter_method);
-		EXTRACT_UINT8(cdata, status.interlace_method);
-
-		if (status.width < 0 || status.height < 0)
-			return 0;
-		*width = status.width;
-		*height = status.height;
+	memcpy(image, &x, 4);
+}
 
-		/* Initialization and basic checking */
-		if (status.color_type == 0) /* Grayscale */
-		{
-			status.sample_per_pixel = 1;
-			if (status.depth != 1 && status.depth != 2 && status.depth != 4 && status.depth != 8 && status.depth != 16)
-				goto FINISH;
-		}
-		else if (status.color_type == 2) /* Truecolor */
-		{
-			status.sample_per_pixel = 3;
-			if (status.depth != 8 && status.depth != 16)
-				goto FINISH;
-		}
-		else if (status.color_type == 3) /* Indexed */
-		{
-			status.sample_per_pixel = 1;
-			if (status.depth != 1 && status.depth != 2 && status.depth != 4 && status.depth != 8)
-				goto FINISH;
-		}
-		else if (status.color_type == 4) /* Gray with alpha */
-		{
-			status.sample_per_pixel = 2;
-			if (status.depth != 8 && status.depth != 16)
-				goto FINISH;
-		}
-		else if (status.color_type == 6) /* Truecolor with alpha */
+/* Layout of the samples as stored */
+static int png_native_layout(const PNG_status *status)
+{
+	if (status->color_type == 0)
+		return status->depth == 16 ? FLUID_LAYOUT_G16 : FLUID_LAYOUT_G8;
+	else if (status->color_type == 2)
+		return status->depth == 16 ? FLUID_LAYOUT_RGB16 : FLUID_LAYOUT_RGB8;
+	else if (status->color_type == 3)
+		return FLUID_LAYOUT_INDEX8;
+	else if (status->color_type == 4)
+		return status->depth == 16 ? FLUID_LAYOUT_GA16 : FLUID_LAYOUT_GA8;
+	else
+		return status->depth == 16 ? FLUID_LAYOUT_RGBA16 : FLUID_LAYOUT_RGBA8;
+}
+
+/* Choose the pixel extraction kernel and build its tables */
+static void png_init_extract(PNG_status *status)
+{
+	int i, j, k, n, sample, tg;
+	unsigned char bad;
+
+	status->extract = PNG_EXTRACT_GENERIC;
+	if (status->layout != FLUID_LAYOUT_RGBA8)
+		status->extract = PNG_EXTRACT_NATIVE;
+	else if (status->color_type == 6)
+		status->extract = PNG_EXTRACT_RGBA;
+	else if (status->color_type == 4)
+		status->extract = PNG_EXTRACT_GRAY_ALPHA;
+	else if (status->color_type == 2)
+	{
+		/* Transparent color of 16-bit samples is matched on full samples */
+		if (status->depth == 8 || !status->transparency)
+			status->extract = PNG_EXTRACT_RGB;
+	}
+	else if (status->color_type == 3 || status->depth < 16 || !status->transparency)
+	{
+		memset(status->lut, 0, sizeof(status->lut));
+		if (status->color_type == 3)
 		{
-			status.sample_per_pixel = 4;
-			if (status.depth != 8 && status.depth != 16)
-				goto FINISH;
+			status->lut_count = status->palette_count;
+			for (i = 0; i < status->palette_count; i++)
+				status->lut[i] = png_rgba(status->palette[i * 3], status->palette[i * 3 + 1], status->palette[i * 3 + 2],
+					(status->transparency && i < status->transparency_count) ? status->transparency[i] : 0xFF);
 		}
 		else
-			goto FINISH;
-		if (status.compression_method != 0)
-			goto FINISH;
-		if (status.filter_method != 0)
-			goto FINISH;
-		if (status.interlace_method == 0)
-			status.rawlen = png_get_scanline_len(status.width, status.depth, status.sample_per_pixel) * status.height;
-		else if (status.interlace_method == 1)
 		{
-			png_extract_adam7_extent(&status);
-			status.rawlen = 0;
-			for (i = 1; i <= 7; i++)
-				status.rawlen += png_get_scanline_len(status.adam7_pass_width[i], status.depth, status.sample_per_pixel) * status.adam7_pass_height[i];
+			status->lut_count = status->depth >= 8 ? 256 : 1 << status->depth;
+			tg = status->transparency ? GET_UINT16_BIG(status->transparency) : -1;
+			for (i = 0; i < status->lut_count; i++)
+			{
+				sample = status->depth >= 8 ? i : (int) sample_rescale(status->depth, i);
+				status->lut[i] = png_rgba(sample, sample, sample, i == tg ? 0 : 0xFF);
+			}
 		}
-		else
-			goto FINISH;
+		status->extract = status->depth < 8 ? PNG_EXTRACT_PACKED : PNG_EXTRACT_LUT;
+	}
 
-		/* Dealing with remaining chunks */
-		while (png_extract_chunk(&data, &size, &ctype, &cdata, &clen))
+	if (status->extract == PNG_EXTRACT_PACKED)
+	{
+		n = 8 / status->depth;
+		for (i = 0; i < 256; i++)
 		{
-			if (ctype[0] == 'I' && ctype[1] == 'D' && ctype[2] == 'A' && ctype[3] == 'T')
-			{
-				/* Non-contiguous IDAT chunks */
-				if (status.zraw)
-					goto FINISH;
-
-				/* Extract total data size */
-				if (!png_extract_data_size(&status, data, size, ctype, cdata, clen))
-					goto FINISH;
-
-				/* Create a whole buffer for zlib data */
-				status.zraw = malloc(status.zlen);
-				if (!status.zraw)
-					goto FINISH;
-
-				/* Copy zlib data */
-				zraw = status.zraw;
-				do
-				{
-					memcpy(zraw, cdata, clen);
-					zraw += clen;
-					/* Since data size is correctly extracted, no need to check again */
-					png_extract_chunk(&data, &size, &ctype, &cdata, &clen);
-				} while (zraw < status.zraw + status.zlen);
-			}
-			if (ctype[0] == 'I' && ctype[1] == 'E' && ctype[2] == 'N' && ctype[3] == 'D')
-				break;
-			else if (ctype[0] == 'P' && ctype[1] == 'L' && ctype[2] == 'T' && ctype[3] == 'E')
-			{
-				/* Palette */
-				if (clen % 3 || clen / 3 > (1 << status.depth))
-					goto FINISH;
-				status.palette_count = clen / 3;
-				status.palette = cdata;
-			}
-			else if (ctype[0] == 't' && ctype[1] == 'R' && ctype[2] == 'N' && ctype[3] == 'S')
+			bad = 0;
+			for (j = 0; j < n; j++)
 			{
-				/* Transparency */
-				if (status.color_type == 0 && clen != 2)
-					goto FINISH;
-				else if (status.color_type == 2 && clen != 6)
-					goto FINISH;
-				else if (status.color_type == 3 && (!status.palette || clen > status.palette_count))
-					goto FINISH;
-				status.transparency_count = clen;
-				status.transparency = cdata;
+				k = (i >> (8 - status->depth * (j + 1))) & BITMASK(status->depth);
+				bad |= k >= status->lut_count;
+				status->expand[i * n + j] = status->lut[k];
 			}
+			status->expand_bad[i] = bad;
 		}
+	}
+}
 
-		if (status.color_type == 3 && !status.palette) /* No palette for indexed color type */
-			goto FINISH;
+/* Take high bytes of count 16-bit samples */
+static void png_narrow_samples(const unsigned char *data, unsigned char *out, int count)
+{
+	int k = 0;
+#ifdef FLUID_SSE2
+	__m128i mask = _mm_set1_epi16(0xFF);
 
-		if (status.zraw == NULL)
-			goto FINISH;
+	for (; k + 16 <= count; k += 16)
+		_mm_storeu_si128((__m128i *) (out + k), _mm_packus_epi16(
+			_mm_and_si128(_mm_loadu_si128((const __m128i *) (data + k * 2)), mask),
+			_mm_and_si128(_mm_loadu_si128((const __m128i *) (data + k * 2 + 16)), mask)));
+#endif
+	for (; k < count; k++)
+		out[k] = data[k * 2];
+}
 
-		/* Zlib decompress */
-		status.raw = malloc(status.rawlen);
-		if (!status.raw)
-			goto FINISH;
-		if (!zlib_deflate_decode(status.zraw, status.zlen, status.raw, status.rawlen))
-			goto FINISH;
+/* Convert count big-endian 16-bit samples to native byte order */
+static void png_swap_samples(const unsigned char *data, unsigned char *out, int count)
+{
+	uint16_t sample;
+	int k = 0;
+#ifdef FLUID_SSE2
+	__m128i x;
 
-		status.defiltered = malloc(status.rawlen);
-		if (!status.defiltered)
-			goto FINISH;
+	for (; k + 8 <= count; k += 8)
+	{
+		x = _mm_loadu_si128((const __m128i *) (data + k * 2));
+		_mm_storeu_si128((__m128i *) (out + k * 2), _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8)));
+	}
+#endif
+	for (; k < count; k++)
+	{
+		sample = GET_UINT16_BIG(data + k * 2);
+		memcpy(out + k * 2, &sample, 2);
+	}
+}
 
-		if (status.interlace_method == 0)
-			png_defilter(status.raw, status.defiltered, status.width, status.height, status.depth, status.sample_per_pixel);
-		else
+/* Copy samples of a row to the native layout, with 1, 2 or 4-bit samples
+ * widened to bytes. skip is the number of pixels before the first one in its
+ * byte.
+ * Return: 0 if an index is invalid
+ */
+static int png_extract_native(const PNG_status *status, const unsigned char *data, unsigned char *image, int width, int skip)
+{
+	int j, n, index;
+
+	if (status->depth == 16)
+		png_swap_samples(data, image, width * status->sample_per_pixel);
+	else if (status->depth == 8)
+	{
+		if (status->color_type == 3)
+			for (j = 0; j < width; j++)
+				if (data[j] >= status->palette_count)
+					return 0;
+		memcpy(image, data, (size_t) width * status->pixel_size);
+	}
+	else
+	{
+		n = 8 / status->depth;
+		for (j = skip; j < skip + width; j++)
 		{
-			j = 0;
-			for (i = 1; i <= 7; i++)
+			index = (data[j / n] >> (8 - status->depth * (j % n + 1))) & BITMASK(status->depth);
+			if (status->color_type == 3)
 			{
-				png_defilter(status.raw + j, status.defiltered + j, status.adam7_pass_width[i], status.adam7_pass_height[i], status.depth, status.sample_per_pixel);
-				j += png_get_scanline_len(status.adam7_pass_width[i], status.depth, status.sample_per_pixel) * status.adam7_pass_height[i];
+				if (index >= status->palette_count)
+					return 0;
+				*image++ = index;
 			}
+			else
+				*image++ = sample_rescale(status->depth, index);
 		}
+	}
+	return 1;
+}
 
-		status.imagelen = status.width * status.height * 4;
-		status.interlaced = malloc(status.imagelen);
-		if (!status.interlaced)
-			goto FINISH;
-		if (status.interlace_method == 0)
+static void png_extract_rgb(const PNG_status *status, const unsigned char *data, unsigned char *image, int width)
+{
+	uint32_t alpha = png_rgba(0, 0, 0, 0xFF);
+	int j = 0, tr, tg, tb;
+
+	if (status->transparency)
+	{
+		tr = GET_UINT16_BIG(status->transparency);
+		tg = GET_UINT16_BIG(status->transparency + 2);
+		tb = GET_UINT16_BIG(status->transparency + 4);
+		for (; j < width; j++, data += 3, image += 4)
+			png_store_rgba(image, png_rgba(data[0], data[1], data[2], (data[0] == tr && data[1] == tg && data[2] == tb) ? 0 : 0xFF));
+		return;
+	}
+#ifdef FLUID_SSSE3
+	{
+		__m128i shuffle = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+		__m128i a = _mm_set1_epi32((int) alpha);
+
+		/* 16 bytes are loaded for 4 pixels */
+		for (; j + 6 <= width; j += 4, data += 12, image += 16)
+			_mm_storeu_si128((__m128i *) image, _mm_or_si128(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) data), shuffle), a));
+	}
+#endif
+	/* 4 bytes are loaded for a pixel but the last */
+	for (; j + 1 < width; j++, data += 3, image += 4)
+		png_store_rgba(image, load_uint32_little(data) | alpha);
+	if (j < width)
+		png_store_rgba(image, png_rgba(data[0], data[1], data[2], 0xFF));
+}
+
+static void png_extract_gray_alpha(const unsigned char *data, unsigned char *image, int width)
+{
+	int j = 0;
+#ifdef FLUID_SSE2
+	__m128i v, gray, mask = _mm_set1_epi16(0xFF);
+
+	/* Gray and alpha of a pixel are a 16-bit lane, gray is doubled and interleaved with it */
+	for (; j + 8 <= width; j += 8, data += 16, image += 32)
+	{
+		v = _mm_loadu_si128((const __m128i *) data);
+		gray = _mm_and_si128(v, mask);
+		gray = _mm_or_si128(gray, _mm_slli_epi16(gray, 8));
+		_mm_storeu_si128((__m128i *) image, _mm_unpacklo_epi16(gray, v));
+		_mm_storeu_si128((__m128i *) (image + 16), _mm_unpackhi_epi16(gray, v));
+	}
+#endif
+	for (; j < width; j++, data += 2, image += 4)
+		png_store_rgba(image, png_rgba(data[0], data[0], data[0], data[1]));
+}
+
+/* Return: 0 if an index is invalid */
+static int png_extract_lut(const PNG_status *status, const unsigned char *data, unsigned char *image, int width)
+{
+	int j;
+
+	if (status->lut_count < 256)
+		for (j = 0; j < width; j++)
+			if (data[j] >= status->lut_count)
+				return 0;
+	for (j = 0; j < width; j++)
+		png_store_rgba(image + j * 4, status->lut[data[j]]);
+	return 1;
+}
+
+/* Expand bytes of n pixels each, inlined with constant n */
+static INLINE int png_expand_bytes(const PNG_status *status, const unsigned char *data, unsigned char *image, int count, int n)
+{
+	int j;
+
+	for (j = 0; j < count; j++, image += n * 4)
+	{
+		if (status->expand_bad[data[j]])
+			return 0;
+		memcpy(image, status->expand + data[j] * n, n * 4);
+	}
+	return 1;
+}
+
+/* Extract one of the pixels packed in a byte
+ * Return: 0 if its index is invalid
+ */
+static INLINE int png_extract_packed_pixel(const PNG_status *status, unsigned int byte, int j, unsigned char *image)
+{
+	int index;
+
+	index = (byte >> (8 - status->depth * (j + 1))) & BITMASK(status->depth);
+	if (index >= status->lut_count)
+		return 0;
+	png_store_rgba(image, status->lut[index]);
+	return 1;
+}
+
+/* skip is the number of pixels before the first one in its byte
+ * Return: 0 if an index is invalid
+ */
+static int png_extract_packed(const PNG_status *status, const unsigned char *data, unsigned char *image, int width, int skip)
+{
+	int n, count, j;
+
+	n = 8 / status->depth;
+	if (skip)
+	{
+		/* Pixels in the first partial byte */
+		for (j = skip; j < n && width > 0; j++, width--, image += 4)
+			if (!png_extract_packed_pixel(status, *data, j, image))
+				return 0;
+		data++;
+	}
+	count = width / n;
+	if (n == 8 && !png_expand_bytes(status, data, image, count, 8))
+		return 0;
+	if (n == 4 && !png_expand_bytes(status, data, image, count, 4))
+		return 0;
+	if (n == 2 && !png_expand_bytes(status, data, image, count, 2))
+		return 0;
+
+	/* Pixels in the last partial byte */
+	data += count;
+	image += count * n * 4;
+	for (j = 0; j < width % n; j++, image += 4)
+		if (!png_extract_packed_pixel(status, *data, j, image))
+			return 0;
+	return 1;
+}
+
+/* Extract a row of 8-bit or packed samples
+ * Return: 0 if failed
+ */
+static int png_extract_row(const PNG_status *status, const unsigned char *data, unsigned char *image, int width)
+{
+	if (status->extract == PNG_EXTRACT_RGBA)
+		memcpy(image, data, (size_t) width * 4);
+	else if (status->extract == PNG_EXTRACT_RGB)
+		png_extract_rgb(status, data, image, width);
+	else if (status->extract == PNG_EXTRACT_GRAY_ALPHA)
+		png_extract_gray_alpha(data, image, width);
+	else if (status->extract == PNG_EXTRACT_LUT)
+		return png_extract_lut(status, data, image, width);
+	else
+		return png_extract_packed(status, data, image, width, 0);
+	return 1;
+}
+
+/* Extract pixels of defiltered scanlines with the kernel of png_init_extract
+ * Return: 0 if failed
+ */
+static int png_extract_pixels(const PNG_status *status, const unsigned char *data, unsigned char *dest, int width, int height, int size)
+{
+	unsigned char narrow[PNG_NARROW_PIXELS * 4];
+	int scanline_len, spp, i, j, n;
+
+	if (status->extract == PNG_EXTRACT_GENERIC)
+		return png_extract_generic(status, data, dest, width, height, size);
+	if (!width) /* Empty pass */
+		return 1;
+	scanline_len = png_get_scanline_len(width, status->depth, status->sample_per_pixel);
+	spp = status->sample_per_pixel;
+	for (i = 0; i < height; i++)
+	{
+		if (status->extract == PNG_EXTRACT_NATIVE)
 		{
-			if (!png_extract_pixels(&status, status.defiltered, status.interlaced, status.width, status.height, status.rawlen))
-				goto FINISH;
-			status.image = status.interlaced;
-			status.interlaced = NULL;
+			if (!png_extract_native(status, data + 1, dest, width, 0))
+				return 0;
+		}
+		else if (status->depth < 16)
+		{
+			if (!png_extract_row(status, data + 1, dest, width))
+				return 0;
 		}
+		else if (status->extract == PNG_EXTRACT_RGBA)
+			png_narrow_samples(data + 1, dest, width * 4);
 		else
 		{
-			j = 0;
-			k = 0;
-			for (i = 1; i <= 7; i++)
+			for (j = 0; j < width; j += n)
 			{
-				isize = png_get_scanline_len(status.adam7_pass_width[i], status.depth, status.sample_per_pixel) * status.adam7_pass_height[i];
-				if (!png_extract_pixels(&status, status.defiltered + j, status.interlaced + k, status.adam7_pass_width[i], status.adam7_pass_height[i], isize))
-					goto FINISH;
-				j += isize;
-				k += status.adam7_pass_width[i] * status.adam7_pass_height[i] * 4;
+				n = width - j < PNG_NARROW_PIXELS ? width - j : PNG_NARROW_PIXELS;
+				png_narrow_samples(data + 1 + j * spp * 2, narrow, n * spp);
+				png_extract_row(status, narrow, dest + j * 4, n);
 			}
-			status.image = malloc(status.imagelen);
-			if (!status.image)
-				goto FINISH;
-			png_deinterlace_adam7(&status, status.interlaced, status.image);
 		}
+		data += scanline_len;
+		dest += (size_t) width * status->pixel_size;
 	}
-FINISH:
-	if (status.defiltered)
-		free(status.defiltered);
-	if (status.zraw)
-		free(status.zraw);
-	if (status.raw)
-		free(status.raw);
-	if (status.interlaced)
-		free(status.interlaced);
-	return status.image;
+	return 1;
 }
 
-/* JPEG Decoder */
-#define JPEG_SOF0		0xC0
-#define JPEG_SOF1		0xC1
-#define JPEG_SOF2		0xC2
-#define JPEG_SOF3		0xC3
-#define JPEG_DHT		0xC4
-#define JPEG_SOF5		0xC5
-#define JPEG_SOF6		0xC6
-#define JPEG_SOF7		0xC7
-#define JPEG_JPG		0xC8
-#define JPEG_SOF9		0xC9
-#define JPEG_SOF10		0xCA
-#define JPEG_SOF11		0xCB
-#define JPEG_DAC		0xCC
-#define JPEG_SOF13		0xCD
-#define JPEG_SOF14		0xCE
-#define JPEG_SOF15		0xCF
-#define JPEG_RST0		0xD0
-#define JPEG_RST1		0xD1
-#define JPEG_RST2		0xD2
-#define JPEG_RST3		0xD3
-#define JPEG_RST4		0xD4
-#define JPEG_RST5		0xD5
-#define JPEG_RST6		0xD6
-#define JPEG_RST7		0xD7
-#define JPEG_SOI		0xD8
-#define JPEG_EOI		0xD9
-#define JPEG_SOS		0xDA
-#define JPEG_DQT		0xDB
-#define JPEG_DNL		0xDC
-#define JPEG_DRI		0xDD
-#define JPEG_DHP		0xDE
-#define JPEG_EXP		0xDF
-#define JPEG_COMPONENTS_COUNT		256
-#define JPEG_SCAN_COMPONENTS_COUNT	5
-#define JPEG_HUFFMAN_LENGTH_MAX		255
-#define JPEG_HUFFMAN_LENGTH_COUNT	17
-typedef struct
+/* Extract count pixels of a defiltered scanline from pixel x
+ * Return: 0 if failed
+ */
+static int png_extract_span(const PNG_status *status, const unsigned char *scanline, unsigned char *dest, int x, int count)
 {
-	int H, V, Tq;
-	int hs, vs;
-	int linebytes, lines;
-	int valid;
-	unsigned char *raw;
-} JPEG_component;
+	int n;
 
-typedef struct
+	if (status->depth < 8)
+	{
+		n = 8 / status->depth;
+		if (status->extract == PNG_EXTRACT_NATIVE)
+			return png_extract_native(status, scanline + 1 + x / n, dest, count, x % n);
+		return png_extract_packed(status, scanline + 1 + x / n, dest, count, x % n);
+	}
+	/* The byte before the first sample takes the place of the filter type byte */
+	return png_extract_pixels(status, scanline + x * (status->depth / 8) * status->sample_per_pixel, dest, count, 1,
+		png_get_scanline_len(count, status->depth, status->sample_per_pixel));
+}
+
+#define PNG_SCANLINE_BUFFER	65536 /* Inflated data after the window in png_decode_scanlines */
+
+/* Defilter scanlines of non-interlaced image from data, and extract pixels
+ * of rows from row to end into image, which holds status->region only.
+ * ring holds the last two defiltered scanlines, and first is the row after
+ * which the previous one is there.
+ * Return: 0 if failed
+ */
+static int png_process_rows(PNG_status *status, const unsigned char *data, unsigned char *ring, int first, int row, int end, unsigned char *image)
 {
-	int Pq; /* Precision */
-	int Qk[64];
-	int valid;
-} JPEG_quantization_table;
+	unsigned char *dest;
+	int scanline_len, region_width;
 
-typedef struct
+	scanline_len = png_get_scanline_len(status->width, status->depth, status->sample_per_pixel);
+	region_width = status->region.x1 - status->region.x0;
+	for (; row < end; row++)
+	{
+		dest = ring + (row & 1) * scanline_len;
+		if (!png_defilter_row(data, row > first ? ring + (~row & 1) * scanline_len : NULL, dest, scanline_len, status->depth, status->sample_per_pixel))
+			return 0;
+		if (row >= status->region.y0 && row < status->region.y1 &&
+			!png_extract_span(status, dest, image + (size_t) (row - status->region.y0) * region_width * status->pixel_size, status->region.x0, region_width))
+			return 0;
+		data += scanline_len;
+	}
+	return 1;
+}
+
+/* Store count pixels of size bytes of row every delta pixels of image,
+ * inlined with constant delta and size
+ */
+static INLINE void png_scatter_pixels(unsigned char *image, const unsigned char *row, int count, int delta, int size)
 {
-	int Tc; /* Table class: 0 = DC, 1 = AC */
-	int L[JPEG_HUFFMAN_LENGTH_COUNT];
-	int hmin[JPEG_HUFFMAN_LENGTH_COUNT], hmax[JPEG_HUFFMAN_LENGTH_COUNT];
-	int V[JPEG_HUFFMAN_LENGTH_COUNT][JPEG_HUFFMAN_LENGTH_MAX];
-	int valid;
-} JPEG_huffman_table;
+	int j;
 
-typedef struct
+	for (j = 0; j < count; j++)
+		memcpy(image + (size_t) j * delta * size, row + j * size, size);
+}
+
+/* Fill the Adam7 block of each pixel of a pass row in a preview, clipped to
+ * the image. Later passes refine the blocks.
+ */
+static void png_replicate_pixels(const PNG_status *status, unsigned char *image, const unsigned char *row, int pass, int y, int width)
 {
-	/* Frame header */
-	int P;
-	int Y, X;
-	int Nf;
-	int hmax, vmax;
-	int hcnt, vcnt;
-	/* Scan header */
-	int Ns;
-	int Cs[JPEG_SCAN_COMPONENTS_COUNT], Td[JPEG_SCAN_COMPONENTS_COUNT], Ta[JPEG_SCAN_COMPONENTS_COUNT];
-	int Ss, Se, Ah, Al;
-	int pred[JPEG_SCAN_COMPONENTS_COUNT];
-	/* Restart interval */
-	int Ri;
-	/* Tables */
-	JPEG_component comp[JPEG_COMPONENTS_COUNT];
-	JPEG_quantization_table qtable[4];
-	JPEG_huffman_table hdc[4], hac[4];
-	/* Final image */
-	unsigned char *image;
-} JPEG_status;
+	int j, x, dx, dy, block_width, block_height;
+
+	block_height = adam7_block_height[pass];
+	if (block_height > status->height - y)
+		block_height = status->height - y;
+	x = adam7_horizontal_start[pass] - 1;
+	for (j = 0; j < width; j++, x += adam7_horizontal_delta[pass])
+	{
+		block_width = adam7_block_width[pass];
+		if (block_width > status->width - x)
+			block_width = status->width - x;
+		for (dy = 0; dy < block_height; dy++)
+			for (dx = 0; dx < block_width; dx++)
+				memcpy(image + ((size_t) (y + dy) * status->width + x + dx) * 4, row + j * 4, 4);
+	}
+}
 
-static int jpeg_extract_bits(const unsigned char **data, int *bit, int *size, int bits, int *raw)
+/* Buffer of png_process_adam7_pass: the last two scanlines and an extracted
+ * row of any pass
+ */
+static unsigned char *png_alloc_adam7_buffer(const PNG_status *status)
 {
-	*raw = 0;
-	for (;;)
+	return malloc(png_get_scanline_len(status->width, status->depth, status->sample_per_pixel) * 2 + (size_t) status->width * status->pixel_size);
+}
+
+/* Defilter and extract the rows of an Adam7 pass from data, and scatter
+ * their pixels to their final positions in image. If preview is set, the
+ * blocks of the pixels are filled as well.
+ * Return: 0 if failed
+ */
+static int png_process_adam7_pass(const PNG_status *status, const unsigned char *data, unsigned char *buffer, int pass, int preview, unsigned char *image)
+{
+	unsigned char *row, *dest, *line;
+	int i, y, width, delta, scanline_len;
+
+	width = status->adam7_pass_width[pass];
+	delta = adam7_horizontal_delta[pass];
+	scanline_len = png_get_scanline_len(width, status->depth, status->sample_per_pixel);
+	if (!scanline_len) /* Empty pass */
+		return 1;
+	row = buffer + png_get_scanline_len(status->width, status->depth, status->sample_per_pixel) * 2;
+	preview = preview && pass < 7;
+	for (i = 0; i < status->adam7_pass_height[pass]; i++)
 	{
-		*raw = (*raw << (8 - *bit)) | ((*data)[0] & BITMASK(8 - *bit));
-		if (bits <= 8 - *bit)
+		dest = buffer + (i & 1) * scanline_len;
+		if (!png_defilter_row(data, i > 0 ? buffer + (~i & 1) * scanline_len : NULL, dest, scanline_len, status->depth, status->sample_per_pixel))
+			return 0;
+		y = adam7_vertical_start[pass] - 1 + i * adam7_vertical_delta[pass];
+		line = image + ((size_t) y * status->width + adam7_horizontal_start[pass] - 1) * status->pixel_size;
+		if (delta == 1) /* Last pass fills whole rows */
 		{
-			*raw >>= 8 - *bit - bits;
-			*bit += bits;
-			return 1;
+			if (!png_extract_pixels(status, dest, line, width, 1, scanline_len))
+				return 0;
 		}
 		else
 		{
-			bits -= 8 - *bit;
-			*bit = 0;
-			if ((*data)[0] == 0xFF)
-			{
-				if (*size < 2)
-					return 0;
-				(*size) -= 2;
-				if ((*data)[1] != 0x00)
-					return 0;
-				(*data) += 2;
-			}
+			if (!png_extract_pixels(status, dest, row, width, 1, scanline_len))
+				return 0;
+			if (preview)
+				png_replicate_pixels(status, image, row, pass, y, width);
+			else if (status->pixel_size != 4)
+				png_scatter_pixels(line, row, width, delta, status->pixel_size);
+			else if (delta == 8)
+				png_scatter_pixels(line, row, width, 8, 4);
+			else if (delta == 4)
+				png_scatter_pixels(line, row, width, 4, 4);
 			else
-			{
-				if (*size < 1)
-					return 0;
-				(*size)--;
-				(*data)++;
-			}
+				png_scatter_pixels(line, row, width, 2, 4);
 		}
+		data += scanline_len;
 	}
+	return 1;
 }
 
-static int jpeg_extract_segment(const unsigned char **data, int *size, unsigned char *seg_type, const unsigned char **seg_data, int *seg_len)
+/* Process each Adam7 pass from status->raw with the buffer of
+ * png_alloc_adam7_buffer, only the last two scanlines and an extracted row of
+ * a pass are buffered
+ * Return: 0 if failed
+ */
+static int png_process_adam7(const PNG_status *status, unsigned char *image, unsigned char *buffer)
 {
-	if (*size < 2)
-		return 0;
-	EXTRACT_UINT8(*data, *seg_type);
-	(*size)--;
-	if (*seg_type != 0xFF)
+	const unsigned char *data;
+	int pass;
+
+	data = status->raw;
+	for (pass = 1; pass <= 7; pass++)
+	{
+		if (!png_process_adam7_pass(status, data, buffer, pass, 0, image))
+			return 0;
+		data += png_get_scanline_len(status->adam7_pass_width[pass], status->depth, status->sample_per_pixel) * status->adam7_pass_height[pass];
+	}
+	return 1;
+}
+
+/* Decode interlaced image progressively into image
+ * The passes are inflated one by one into status->raw, and the preview is
+ * passed to the progress callback after each of them. Passes whose data is
+ * complete are shown even if the rest of the image is missing.
+ * Return: 0 if failed
+ */
+static int png_decode_progressive(PNG_status *status, unsigned char *image, const FLUID_options *options)
+{
+	DEFLATE_status inflate;
+	BIT_reader br;
+	unsigned char *buffer, *start, *current;
+	int pass, len, ok = 0;
+	uint32_t adler;
+
+	buffer = png_alloc_adam7_buffer(status);
+	if (!buffer || !png_init_idat_bits(status, &br) || !zlib_read_header(&br))
+		goto FINISH;
+	zlib_init_inflate(&inflate);
+	adler = 1;
+	current = status->raw;
+	for (pass = 1; pass <= 7; pass++)
+	{
+		start = current;
+		len = png_get_scanline_len(status->adam7_pass_width[pass], status->depth, status->sample_per_pixel) * status->adam7_pass_height[pass];
+		if (!zlib_inflate(&inflate, &br, status->raw, &current, start + len) || current != start + len || BITS_OVERRUN(&br))
+			goto FINISH;
+		if (status->verify)
+			adler = adler32_update(adler, start, len);
+		if (!png_process_adam7_pass(status, start, buffer, pass, 1, image))
+			goto FINISH;
+		options->progress(options->progress_data, (const char *) image, status->width, status->height, pass);
+	}
+	if (status->verify && !zlib_check_end(&inflate, &br, status->raw, current, adler))
+		goto FINISH;
+	ok = png_check_idat_tail(status);
+FINISH:
+	if (buffer)
+		free(buffer);
+	return ok;
+}
+
+/* Size of the buffer of png_decode_scanlines for scanlines of up to
+ * scanline_len bytes
+ */
+static size_t png_scanline_buffer_size(int scanline_len)
+{
+	return DEFLATE_WINDOW_SIZE + (scanline_len > PNG_SCANLINE_BUFFER ? scanline_len : PNG_SCANLINE_BUFFER) + DEFLATE_OUTPUT_SLACK + (size_t) scanline_len * 2;
+}
+
+/* Inflate, defilter and extract pixels of non-interlaced image in one pass
+ * Scanlines are inflated in batches which fit in cache after the window of
+ * zlib stream, so no buffer of the whole image is needed but the output and
+ * buffer, see png_scanline_buffer_size. Inflating stops after the last row
+ * of status->region, in which case the Adler-32 checksum is not verified.
+ * Return: 0 if failed
+ */
+static int png_decode_scanlines(PNG_status *status, unsigned char *image, unsigned char *buffer)
+{
+	DEFLATE_status inflate;
+	BIT_reader br;
+	unsigned char *buf, *ring, *start, *current;
+	int scanline_len, cap, row, count;
+	uint32_t adler;
+
+	scanline_len = png_get_scanline_len(status->width, status->depth, status->sample_per_pixel);
+	cap = DEFLATE_WINDOW_SIZE + (scanline_len > PNG_SCANLINE_BUFFER ? scanline_len : PNG_SCANLINE_BUFFER);
+	buf = buffer;
+	ring = buffer + cap + DEFLATE_OUTPUT_SLACK;
+	if (!png_init_idat_bits(status, &br) || !zlib_read_header(&br))
 		return 0;
-	while (*size >= 1)
+	zlib_init_inflate(&inflate);
+	adler = 1;
+	current = buf;
+	for (row = 0; row < status->region.y1; row += count)
 	{
-		EXTRACT_UINT8(*data, *seg_type);
-		(*size)--;
-		if (*seg_type != 0xFF)
-			break;
+		if (buf + cap - current < scanline_len)
+		{
+			/* Keep only the window */
+			memmove(buf, current - DEFLATE_WINDOW_SIZE, DEFLATE_WINDOW_SIZE);
+			current = buf + DEFLATE_WINDOW_SIZE;
+		}
+		count = (int) ((buf + cap - current) / scanline_len);
+		if (count > status->region.y1 - row)
+			count = status->region.y1 - row;
+		start = current;
+		if (!zlib_inflate(&inflate, &br, buf, &current, start + count * scanline_len) || current != start + count * scanline_len)
+			return 0;
+		if (status->verify && status->region.y1 == status->height)
+			adler = adler32_update(adler, start, count * scanline_len);
+		if (!png_process_rows(status, start, ring, 0, row, row + count, image))
+			return 0;
 	}
-	if ((*seg_type >= JPEG_RST0 && *seg_type <= JPEG_RST7) || *seg_type == JPEG_SOI || *seg_type == JPEG_EOI) /* Standard-alone marker */
+	if (status->region.y1 < status->height)
 		return 1;
-	if (*size < 2)
-		return 0;
-	EXTRACT_UINT16_BIG(*data, *seg_len);
-	*size -= 2;
-	*seg_len -= 2;
-	if (*size < *seg_len)
+	if (status->verify && !zlib_check_end(&inflate, &br, buf, current, adler))
 		return 0;
-	*size -= *seg_len;
-	*seg_data = *data;
-	*data += *seg_len;
-	return 1;
+	return png_check_idat_tail(status);
 }
 
-static int jpeg_process_restart_interval(JPEG_status *status, unsigned char stype, const unsigned char *sdata, int slen)
+/* Parallel inflate
+ * Large zlib streams are cut into segments which are inflated by separate
+ * threads. Each segment starts at a block boundary: either an explicit split
+ * point from an iDOT chunk, or one found by trying to parse a block header
+ * at every bit near an even split of the data, which also finds the empty
+ * stored blocks of full flushes.
+ * The window before a segment is unknown until the previous segment is done,
+ * so a segment is first inflated by zlib_inflate_wide. Once the last
+ * DEFLATE_WINDOW_SIZE values hold no reference to the window, zlib_inflate
+ * takes over on plain bytes. The references are resolved when the segments
+ * are put together.
+ * A segment is done when it reaches the start of a later segment, which
+ * proves that start to be a real block boundary. Starts found by mistake are
+ * never reached exactly and are decoded over by the previous segment.
+ */
+#ifndef PNG_PARALLEL_MIN_SIZE
+#define PNG_PARALLEL_MIN_SIZE	(1 << 20) /* Inflated size to start using threads */
+#endif
+#ifndef PNG_SEGMENT_MIN_SIZE
+#define PNG_SEGMENT_MIN_SIZE	(64 << 10) /* Compressed size of a segment */
+#endif
+#define PNG_WIDE_STEP			16384 /* Values inflated before checking whether to switch */
+
+typedef struct
 {
-	if (slen != 2)
+	const unsigned char *data;
+	int len;
+	int offset; /* Offset of data in zlib stream */
+} PNG_idat;
+
+/* Current IDAT chunk of a bit reader */
+typedef struct
+{
+	const PNG_idat *idat;
+	int count, index;
+} PNG_idat_cursor;
+
+typedef struct
+{
+	int64_t start; /* Bit offset of first block in zlib stream, -1 if none */
+	int64_t limit; /* Search for first block ends before this bit offset */
+	int exact; /* Start is an explicit split point */
+	int ok; /* Inflated until next, without error */
+	int next; /* Index of segment where inflating stopped, or count after final block */
+	int offset; /* Offset in raw data, -1 if not used */
+	DEFLATE_status inflate;
+	BIT_reader br;
+	PNG_idat_cursor cursor;
+	/* Output is wide values, then narrow bytes after narrow_start */
+	uint16_t *wide;
+	int wide_len, wide_cap;
+	int last_marker; /* Index of last marker in wide, -1 if none */
+	unsigned char *narrow;
+	int narrow_start, narrow_len, narrow_cap;
+	/* When verifying: CRC of IDAT chunks checked by segment matched, and
+	 * Adler-32 of output written in parallel and in order */
+	int crc_ok;
+	uint32_t adler_head, adler_tail;
+} PNG_segment;
+
+typedef struct
+{
+	PNG_status *status;
+	PNG_idat *idat;
+	int idat_count, zsize;
+	PNG_segment *segment;
+	int count;
+	/* Rows where bands for defiltering start, band count is count */
+	int *band;
+	int *band_ok;
+} PNG_parallel;
+
+static int png_next_idat_cursor(void *source, const unsigned char **data, const unsigned char **end)
+{
+	PNG_idat_cursor *cursor = source;
+
+	if (cursor->index + 1 >= cursor->count)
 		return 0;
-	EXTRACT_UINT16_BIG(sdata, status->Ri);
+	cursor->index++;
+	*data = cursor->idat[cursor->index].data;
+	*end = *data + cursor->idat[cursor->index].len;
 	return 1;
 }
 
-static int jpeg_process_quantization_table(JPEG_status *status, unsigned char stype, const unsigned char *sdata, int slen)
+/* Point bit reader of segment to a bit offset in zlib stream */
+static void png_segment_seek(PNG_segment *seg, const PNG_parallel *par, int64_t pos)
 {
-	int i, j, Pq, Tq;
-	if (slen == 0)
-		return 0;
-	while (slen > 0)
+	int lo, hi, mid, offset;
+	const PNG_idat *idat;
+
+	offset = (int) (pos >> 3);
+	lo = 0;
+	hi = par->idat_count - 1;
+	while (lo < hi)
 	{
-		if (slen < 1)
-			return 0;
-		slen--;
-		EXTRACT_UINT8(sdata, j);
-		Pq = HIBYTE(j);
-		if (Pq == 0)
-			Pq = 8;
-		else if (Pq == 1)
-			Pq = 16;
+		mid = (lo + hi + 1) / 2;
+		if (par->idat[mid].offset <= offset)
+			lo = mid;
 		else
+			hi = mid - 1;
+	}
+	idat = &par->idat[lo];
+	seg->cursor.idat = par->idat;
+	seg->cursor.count = par->idat_count;
+	seg->cursor.index = lo;
+	init_bits(&seg->br, idat->data + (offset - idat->offset), idat->len - (offset - idat->offset));
+	seg->br.next_segment = png_next_idat_cursor;
+	seg->br.source = &seg->cursor;
+	refill_bits_little(&seg->br);
+	skip_bits_little(&seg->br, (int) (pos & 7));
+}
+
+static int64_t png_segment_position(const PNG_segment *seg)
+{
+	const PNG_idat *idat;
+	idat = &seg->cursor.idat[seg->cursor.index];
+	return ((int64_t) idat->offset + (seg->br.data - idat->data)) * 8 - seg->br.count + seg->br.overrun * 8;
+}
+
+static int png_segment_length(const PNG_segment *seg)
+{
+	return seg->wide_len + seg->narrow_len - seg->narrow_start;
+}
+
+/* Inflate until output is full or a block ends, switching to narrow output
+ * when possible
+ */
+static int png_segment_inflate(PNG_segment *seg, int narrow_cap)
+{
+	uint16_t *wcur;
+	unsigned char *ncur, *p;
+	int i, cap;
+
+	if (!seg->narrow && seg->wide_len - seg->last_marker > DEFLATE_WINDOW_SIZE)
+	{
+		seg->narrow = malloc(DEFLATE_WINDOW_SIZE + narrow_cap + DEFLATE_OUTPUT_SLACK);
+		if (!seg->narrow)
 			return 0;
-		Tq = LOBYTE(j);
-		status->qtable[Tq].valid = 1;
-		status->qtable[Tq].Pq = Pq;
-		if (slen < Pq / 8 * 64)
-			return 0;
-		slen -= Pq / 8 * 64;
-		if (Pq == 8)
+		for (i = 0; i < DEFLATE_WINDOW_SIZE; i++)
+			seg->narrow[i] = (unsigned char) seg->wide[seg->wide_len - DEFLATE_WINDOW_SIZE + i];
+		seg->narrow_start = seg->narrow_len = DEFLATE_WINDOW_SIZE;
+		seg->narrow_cap = DEFLATE_WINDOW_SIZE + narrow_cap;
+	}
+	if (seg->narrow)
+	{
+		if (seg->narrow_len == seg->narrow_cap)
 		{
-			for (i = 0; i < 64; i++)
-				EXTRACT_UINT8(sdata, status->qtable[Tq].Qk[i]);
+			cap = seg->narrow_cap * 2;
+			p = realloc(seg->narrow, cap + DEFLATE_OUTPUT_SLACK);
+			if (!p)
+				return 0;
+			seg->narrow = p;
+			seg->narrow_cap = cap;
 		}
-		else
+		ncur = seg->narrow + seg->narrow_len;
+		if (!zlib_inflate(&seg->inflate, &seg->br, seg->narrow, &ncur, seg->narrow + seg->narrow_cap))
+			return 0;
+		seg->narrow_len = (int) (ncur - seg->narrow);
+	}
+	else
+	{
+		if (seg->wide_cap - seg->wide_len < PNG_WIDE_STEP)
 		{
-			for (i = 0; i < 64; i++)
-				EXTRACT_UINT16_BIG(sdata, status->qtable[Tq].Qk[i]);
+			cap = seg->wide_cap ? seg->wide_cap * 2 : DEFLATE_WINDOW_SIZE * 2;
+			wcur = realloc(seg->wide, cap * sizeof(uint16_t));
+			if (!wcur)
+				return 0;
+			seg->wide = wcur;
+			seg->wide_cap = cap;
 		}
+		wcur = seg->wide + seg->wide_len;
+		if (!zlib_inflate_wide(&seg->inflate, &seg->br, seg->wide, &wcur, wcur + PNG_WIDE_STEP, &seg->last_marker))
+			return 0;
+		seg->wide_len = (int) (wcur - seg->wide);
 	}
 	return 1;
 }
 
-static int jpeg_process_huffman_table(JPEG_status *status, unsigned char stype, const unsigned char *sdata, int slen)
+/* Inflate first block of segment */
+static int png_segment_first_block(PNG_segment *seg, const PNG_parallel *par)
 {
-	int i, j, mt, Tc, Th;
-	JPEG_huffman_table *huffman;
-	if (slen == 0)
-		return 0;
-	while (slen > 0)
+	DEFLATE_status next;
+	PNG_idat_cursor cursor;
+	BIT_reader br;
+
+	zlib_init_inflate(&seg->inflate);
+	seg->inflate.block_stop = 1;
+	seg->wide_len = 0;
+	seg->last_marker = -1;
+	if (seg->narrow)
 	{
-		if (slen < 17)
+		free(seg->narrow);
+		seg->narrow = NULL;
+	}
+	seg->narrow_start = seg->narrow_len = 0;
+	do
+	{
+		if (!png_segment_inflate(seg, 0))
 			return 0;
-		slen -= 17;
-		EXTRACT_UINT8(sdata, j);
-		Tc = HIBYTE(j);
-		Th = LOBYTE(j);
+		if (png_segment_length(seg) > par->status->rawlen)
+			return 0;
+	} while (seg->inflate.state != DEFLATE_HEADER && seg->inflate.state != DEFLATE_DONE);
+	/* Another block header must follow */
+	if (seg->inflate.state == DEFLATE_HEADER)
+	{
+		cursor = seg->cursor;
+		br = seg->br;
+		br.source = &cursor;
+		if (!zlib_read_block_header(&next, &br))
+			return 0;
+	}
+	return 1;
+}
+
+/* Quick test whether bits, holding at least 49 bits from a byte boundary,
+ * may start a non-final stored or dynamic block at bit shift
+ */
+static int png_block_candidate(uint64_t bits, int shift)
+{
+	unsigned int len, nlen, kraft;
+	int i, hclen;
+
+	if (((bits >> shift) & 7) == 0) /* Stored, length follows at byte boundary */
+	{
+		bits >>= (shift + 3 + 7) / 8 * 8;
+		len = (unsigned int) bits & 0xFFFF;
+		nlen = (unsigned int) (bits >> 16) & 0xFFFF;
+		return (len ^ nlen) == 0xFFFF;
+	}
+	bits >>= shift;
+	if ((bits & 7) != 4) /* Dynamic */
+		return 0;
+	if (((bits >> 3) & 31) > 29 || ((bits >> 8) & 31) > 29) /* HLIT, HDIST */
+		return 0;
+	/* Code lengths of code length code must not be over-subscribed */
+	hclen = 4 + (int) ((bits >> 13) & 15);
+	kraft = 0;
+	for (i = 0; i < hclen && i < 10; i++)
+	{
+		len = (unsigned int) (bits >> (17 + i * 3)) & 7;
+		if (len)
+			kraft += 128 >> len;
+	}
+	return kraft <= 128 && (hclen > 10 || kraft == 128);
+}
+
+/* Find start of segment */
+static void png_find_segment(void *context, int index)
+{
+	PNG_parallel *par = context;
+	PNG_segment *seg = &par->segment[index];
+	int64_t pos;
+	uint64_t bits;
+	int shift;
+
+	if (index == 0)
+	{
+		/* Start of zlib stream, the window is empty */
+		seg->start = -1;
+		png_segment_seek(seg, par, 0);
+		seg->narrow = malloc(par->status->rawlen / par->count + DEFLATE_OUTPUT_SLACK);
+		if (!seg->narrow || !zlib_read_header(&seg->br))
+			return;
+		zlib_init_inflate(&seg->inflate);
+		seg->inflate.block_stop = 1;
+		seg->narrow_cap = par->status->rawlen / par->count;
+		seg->start = png_segment_position(seg);
+		return;
+	}
+	if (seg->exact)
+	{
+		png_segment_seek(seg, par, seg->start);
+		if (!png_segment_first_block(seg, par))
+			seg->start = -1;
+		return;
+	}
+	for (pos = seg->start; pos < seg->limit; pos += 8)
+	{
+		png_segment_seek(seg, par, pos);
+		bits = seg->br.buf;
+		for (shift = 0; shift < 8; shift++)
+		{
+			if (!png_block_candidate(bits, shift))
+				continue;
+			png_segment_seek(seg, par, pos + shift);
+			if (png_segment_first_block(seg, par))
+			{
+				seg->start = pos + shift;
+				return;
+			}
+		}
+	}
+	seg->start = -1;
+}
+
+/* Inflate segment until start of a later segment */
+static void png_inflate_segment(void *context, int index)
+{
+	PNG_parallel *par = context;
+	PNG_segment *seg = &par->segment[index];
+	int64_t pos;
+
+	if (seg->start < 0)
+		return;
+	seg->next = index + 1;
+	for (;;)
+	{
+		if (seg->inflate.state == DEFLATE_DONE)
+		{
+			seg->next = par->count;
+			break;
+		}
+		if (seg->inflate.state == DEFLATE_HEADER)
+		{
+			pos = png_segment_position(seg);
+			while (seg->next < par->count && par->segment[seg->next].start < pos)
+				seg->next++;
+			if (seg->next < par->count && par->segment[seg->next].start == pos)
+				break;
+		}
+		if (!png_segment_inflate(seg, par->status->rawlen / par->count))
+			return;
+		if (png_segment_length(seg) > par->status->rawlen)
+			return;
+	}
+	seg->ok = 1;
+}
+
+/* Write output of segment from index begin to end into raw data
+ * References resolve to the DEFLATE_WINDOW_SIZE bytes before the segment,
+ * which must have been written already
+ */
+static int png_resolve_segment(PNG_status *status, const PNG_segment *seg, int begin, int end)
+{
+	unsigned char *raw, lut[DEFLATE_MARKER(DEFLATE_WINDOW_SIZE)];
+	int i, n, window;
+
+	raw = status->raw + seg->offset;
+	n = end < seg->wide_len ? end : seg->wide_len;
+	if (begin < n)
+	{
+		/* Map bytes to themselves and markers to the window, which is
+		 * shorter near the start of data */
+		window = seg->offset < DEFLATE_WINDOW_SIZE ? seg->offset : DEFLATE_WINDOW_SIZE;
+		for (i = begin; window < DEFLATE_WINDOW_SIZE && i < n; i++)
+			if (seg->wide[i] > 255 && seg->wide[i] < DEFLATE_MARKER(DEFLATE_WINDOW_SIZE - window))
+				return 0;
+		for (i = 0; i < 256; i++)
+			lut[i] = (unsigned char) i;
+		memcpy(lut + DEFLATE_MARKER(DEFLATE_WINDOW_SIZE - window), raw - window, window);
+		for (i = begin; i < n; i++)
+			raw[i] = lut[seg->wide[i]];
+	}
+	if (n < begin)
+		n = begin;
+	if (n < end)
+		memcpy(raw + n, seg->narrow + seg->narrow_start + (n - seg->wide_len), end - n);
+	return 1;
+}
+
+/* Write all but the last DEFLATE_WINDOW_SIZE bytes of segment */
+static void png_resolve_segment_head(void *context, int index)
+{
+	PNG_parallel *par = context;
+	PNG_segment *seg = &par->segment[index];
+	int len;
+
+	if (seg->offset < 0)
+		return;
+	len = png_segment_length(seg);
+	if (len > par->status->rawlen - seg->offset)
+		len = par->status->rawlen - seg->offset;
+	if (!png_resolve_segment(par->status, seg, 0, len - DEFLATE_WINDOW_SIZE))
+		seg->ok = 0;
+	if (par->status->verify && len > DEFLATE_WINDOW_SIZE)
+		seg->adler_head = adler32_update(1, par->status->raw + seg->offset, len - DEFLATE_WINDOW_SIZE);
+}
+
+/* Check CRC of a share of IDAT chunks */
+static void png_check_idat(void *context, int index)
+{
+	PNG_parallel *par = context;
+	PNG_segment *seg = &par->segment[index];
+	const PNG_idat *idat;
+	int i;
+
+	seg->crc_ok = 1;
+	for (i = index * par->idat_count / par->count; i < (index + 1) * par->idat_count / par->count; i++)
+	{
+		idat = &par->idat[i];
+		if (!png_check_crc(idat->data - 4, idat->len))
+			seg->crc_ok = 0;
+	}
+}
+
+/* Split points of iDOT chunk, written by Apple encoders:
+ * Part count, then for each part its first row, row count, and offset of
+ * its first IDAT chunk from the start of iDOT chunk
+ */
+static int png_idot_split(const PNG_status *status, const PNG_idat *idat, int idat_count, int *split, int max_split)
+{
+	const unsigned char *data;
+	int count, i, j, n, offset;
+
+	if (!status->idot || status->idot_len < 4)
+		return 0;
+	data = status->idot;
+	EXTRACT_UINT32_BIG(data, count);
+	if (count < 0 || count > (status->idot_len - 4) / 12)
+		return 0;
+	n = 0;
+	for (i = 0; i < count && n < max_split; i++)
+	{
+		data += 8; /* First row, row count */
+		EXTRACT_UINT32_BIG(data, offset);
+		for (j = 1; j < idat_count; j++)
+			if (idat[j].data - status->idot == offset)
+				split[n++] = idat[j].offset;
+	}
+	return n;
+}
+
+/* Inflate IDAT data into status->raw with threads
+ * Return: 0 if failed, so decoding can be retried without threads
+ */
+static int png_inflate_parallel(PNG_status *status, int threads)
+{
+	PNG_parallel par;
+	PNG_segment *seg, *last;
+	const unsigned char *data, *ctype, *cdata;
+	int size, clen, i, j, m, n, offset, len, exact, ok;
+	int split[THREAD_MAX_COUNT];
+	int64_t start, estimate;
+	uint32_t adler;
+
+	ok = 0;
+	par.status = status;
+	par.segment = NULL;
+	par.count = 0;
+
+	/* Collect IDAT chunks */
+	par.idat_count = 1;
+	data = status->idat_next;
+	size = status->idat_size;
+	while (png_extract_chunk(&data, &size, &ctype, &cdata, &clen) && ctype[0] == 'I' && ctype[1] == 'D' && ctype[2] == 'A' && ctype[3] == 'T')
+		par.idat_count++;
+	par.idat = malloc(par.idat_count * sizeof(PNG_idat));
+	if (!par.idat)
+		return 0;
+	par.idat[0].data = status->idat_data;
+	par.idat[0].len = status->idat_len;
+	par.idat[0].offset = 0;
+	data = status->idat_next;
+	size = status->idat_size;
+	for (i = 1; i < par.idat_count; i++)
+	{
+		png_extract_chunk(&data, &size, &ctype, &cdata, &clen);
+		par.idat[i].data = cdata;
+		par.idat[i].len = clen;
+		par.idat[i].offset = par.idat[i - 1].offset + par.idat[i - 1].len;
+	}
+	par.zsize = par.idat[par.idat_count - 1].offset + par.idat[par.idat_count - 1].len;
+
+	/* Segment starts: explicit split points, and an even split of the data
+	 * except near explicit split points
+	 */
+	if (threads > THREAD_MAX_COUNT)
+		threads = THREAD_MAX_COUNT;
+	n = png_idot_split(status, par.idat, par.idat_count, split, THREAD_MAX_COUNT);
+	m = par.zsize / PNG_SEGMENT_MIN_SIZE;
+	if (m > threads)
+		m = threads;
+	if (m < 1)
+		m = 1;
+	par.segment = calloc(m + n + 1, sizeof(PNG_segment));
+	if (!par.segment)
+		goto FINISH;
+	par.count = 1;
+	for (i = 1, j = 0; i < m || j < n;)
+	{
+		estimate = (int64_t) par.zsize * i / m;
+		if (j < n && (i >= m || split[j] <= estimate))
+		{
+			start = split[j++];
+			exact = 1;
+		}
+		else
+		{
+			start = estimate;
+			i++;
+			exact = 0;
+			if ((j < n && split[j] - start < PNG_SEGMENT_MIN_SIZE) || (j > 0 && start - split[j - 1] < PNG_SEGMENT_MIN_SIZE))
+				continue;
+		}
+		if (start <= par.segment[par.count - 1].start / 8)
+			continue;
+		par.segment[par.count].start = start * 8;
+		par.segment[par.count].exact = exact;
+		par.count++;
+	}
+	if (par.count < 2)
+		goto FINISH;
+	for (i = 0; i < par.count; i++)
+	{
+		seg = &par.segment[i];
+		if (seg->exact)
+			seg->limit = seg->start + 1;
+		else if (i + 1 < par.count)
+			seg->limit = par.segment[i + 1].start;
+		else
+			seg->limit = (int64_t) par.zsize * 8;
+		seg->offset = -1;
+	}
+
+	if (status->verify)
+	{
+		run_tasks(png_check_idat, &par, par.count, threads);
+		for (i = 0; i < par.count; i++)
+			if (!par.segment[i].crc_ok)
+			{
+				status->checksum_error = 1;
+				goto FINISH;
+			}
+	}
+
+	/* Find block boundaries, then inflate */
+	run_tasks(png_find_segment, &par, par.count, threads);
+	run_tasks(png_inflate_segment, &par, par.count, threads);
+
+	/* Put together segments from the start of stream */
+	offset = 0;
+	last = NULL;
+	for (i = 0; i < par.count; i = seg->next)
+	{
+		seg = &par.segment[i];
+		if (!seg->ok)
+			goto FINISH;
+		seg->offset = offset;
+		offset += png_segment_length(seg);
+		last = seg;
+		if (offset >= status->rawlen)
+			break;
+	}
+	if (offset < status->rawlen)
+		goto FINISH;
+	/* When verifying, the stream must end with the output */
+	if (status->verify && (offset != status->rawlen || last->next != par.count))
+		goto FINISH;
+	/* The last DEFLATE_WINDOW_SIZE bytes of each segment are the window of
+	 * the next one, so they are written in order. The rest follows in
+	 * parallel.
+	 */
+	for (i = 0; i < par.count; i++)
+	{
+		seg = &par.segment[i];
+		if (seg->offset < 0)
+			continue;
+		len = png_segment_length(seg);
+		if (len > status->rawlen - seg->offset)
+			len = status->rawlen - seg->offset;
+		j = len > DEFLATE_WINDOW_SIZE ? len - DEFLATE_WINDOW_SIZE : 0;
+		if (!png_resolve_segment(status, seg, j, len))
+			goto FINISH;
+		if (status->verify)
+			seg->adler_tail = adler32_update(1, status->raw + seg->offset + j, len - j);
+	}
+	run_tasks(png_resolve_segment_head, &par, par.count, threads);
+	for (i = 0; i < par.count; i++)
+		if (par.segment[i].offset >= 0 && !par.segment[i].ok)
+			goto FINISH;
+	if (status->verify)
+	{
+		adler = 1;
+		for (i = 0; i < par.count; i++)
+		{
+			seg = &par.segment[i];
+			if (seg->offset < 0)
+				continue;
+			len = png_segment_length(seg);
+			if (len > DEFLATE_WINDOW_SIZE)
+			{
+				adler = adler32_concat(adler, seg->adler_head, len - DEFLATE_WINDOW_SIZE);
+				len = DEFLATE_WINDOW_SIZE;
+			}
+			adler = adler32_concat(adler, seg->adler_tail, len);
+		}
+		if (!zlib_read_trailer(&last->br, adler))
+		{
+			status->checksum_error = 1;
+			goto FINISH;
+		}
+	}
+	ok = 1;
+FINISH:
+	if (par.segment)
+	{
+		for (i = 0; i < par.count; i++)
+		{
+			if (par.segment[i].wide)
+				free(par.segment[i].wide);
+			if (par.segment[i].narrow)
+				free(par.segment[i].narrow);
+		}
+		free(par.segment);
+	}
+	free(par.idat);
+	return ok;
+}
+
+/* Defilter and extract pixels of a band of rows */
+static void png_process_band(void *context, int index)
+{
+	PNG_parallel *par = context;
+	PNG_status *status = par->status;
+	unsigned char *ring;
+	int scanline_len, row;
+
+	scanline_len = png_get_scanline_len(status->width, status->depth, status->sample_per_pixel);
+	row = par->band[index];
+	ring = malloc(scanline_len * 2);
+	par->band_ok[index] = ring && png_process_rows(status, status->raw + row * scanline_len, ring, row, row, par->band[index + 1], status->interlaced);
+	if (ring)
+		free(ring);
+}
+
+/* Defilter and extract pixels of non-interlaced image with threads
+ * Bands can only start at rows filtered without the previous row
+ * Return: 0 if failed
+ */
+static int png_process_parallel(PNG_status *status, int threads)
+{
+	PNG_parallel par;
+	int scanline_len, i, row, end, ok;
+
+	if (threads > THREAD_MAX_COUNT)
+		threads = THREAD_MAX_COUNT;
+	par.status = status;
+	par.band = malloc((threads + 1) * sizeof(int));
+	par.band_ok = malloc(threads * sizeof(int));
+	ok = 0;
+	if (!par.band || !par.band_ok)
+		goto FINISH;
+	scanline_len = png_get_scanline_len(status->width, status->depth, status->sample_per_pixel);
+	par.band[0] = 0;
+	par.count = 1;
+	for (i = 1; i < threads; i++)
+	{
+		row = (int) ((int64_t) status->height * i / threads);
+		end = (int) ((int64_t) status->height * (i + 1) / threads);
+		if (row <= par.band[par.count - 1])
+			row = par.band[par.count - 1] + 1;
+		while (row < end && status->raw[row * scanline_len] > 1) /* Not None or Sub */
+			row++;
+		if (row < end)
+			par.band[par.count++] = row;
+	}
+	par.band[par.count] = status->height;
+	run_tasks(png_process_band, &par, par.count, threads);
+	ok = 1;
+	for (i = 0; i < par.count; i++)
+		ok &= par.band_ok[i];
+FINISH:
+	if (par.band)
+		free(par.band);
+	if (par.band_ok)
+		free(par.band_ok);
+	return ok;
+}
+
+/* Compute sizes of image data for status->width and status->height, and
+ * decode all of it
+ */
+static void png_init_size(PNG_status *status)
+{
+	int i;
+
+	if (status->interlace_method == 0)
+		status->rawlen = png_get_scanline_len(status->width, status->depth, status->sample_per_pixel) * status->height;
+	else
+	{
+		png_extract_adam7_extent(status);
+		status->rawlen = 0;
+		for (i = 1; i <= 7; i++)
+			status->rawlen += png_get_scanline_len(status->adam7_pass_width[i], status->depth, status->sample_per_pixel) * status->adam7_pass_height[i];
+	}
+	status->imagelen = status->width * status->height * status->pixel_size;
+	status->region.x0 = 0;
+	status->region.y0 = 0;
+	status->region.x1 = status->width;
+	status->region.y1 = status->height;
+}
+
+/* Read and check IHDR chunk, the chunks after it are left in status->chunks
+ * Return: 0 if failed
+ */
+static int png_read_header(PNG_status *status, const unsigned char *data, int size)
+{
+	const unsigned char *ctype, *cdata;
+	int clen;
+
+	if (!png_extract_chunk(&data, &size, &ctype, &cdata, &clen) ||
+		clen != 13 ||
+		ctype[0] != 'I' || ctype[1] != 'H' || ctype[2] != 'D' || ctype[3] != 'R' ||
+		(status->verify && !png_check_crc(ctype, clen)))
+		return 0;
+	EXTRACT_UINT32_BIG(cdata, status->width);
+	EXTRACT_UINT32_BIG(cdata, status->height);
+	EXTRACT_UINT8(cdata, status->depth);
+	EXTRACT_UINT8(cdata, status->color_type);
+	EXTRACT_UINT8(cdata, status->compression_method);
+	EXTRACT_UINT8(cdata, status->filter_method);
+	EXTRACT_UINT8(cdata, status->interlace_method);
+	status->chunks = data;
+	status->chunks_size = size;
+
+	/* Initialization and basic checking */
+	if (status->width <= 0 || status->height <= 0)
+		return 0;
+	if (status->color_type == 0) /* Grayscale */
+	{
+		status->sample_per_pixel = 1;
+		if (status->depth != 1 && status->depth != 2 && status->depth != 4 && status->depth != 8 && status->depth != 16)
+			return 0;
+	}
+	else if (status->color_type == 2) /* Truecolor */
+	{
+		status->sample_per_pixel = 3;
+		if (status->depth != 8 && status->depth != 16)
+			return 0;
+	}
+	else if (status->color_type == 3) /* Indexed */
+	{
+		status->sample_per_pixel = 1;
+		if (status->depth != 1 && status->depth != 2 && status->depth != 4 && status->depth != 8)
+			return 0;
+	}
+	else if (status->color_type == 4) /* Gray with alpha */
+	{
+		status->sample_per_pixel = 2;
+		if (status->depth != 8 && status->depth != 16)
+			return 0;
+	}
+	else if (status->color_type == 6) /* Truecolor with alpha */
+	{
+		status->sample_per_pixel = 4;
+		if (status->depth != 8 && status->depth != 16)
+			return 0;
+	}
+	else
+		return 0;
+	if (status->compression_method != 0)
+		return 0;
+	if (status->filter_method != 0)
+		return 0;
+	if (status->interlace_method != 0 && status->interlace_method != 1)
+		return 0;
+	/* Raw and RGBA data sizes must fit in int, Adam7 passes add at most 4 bytes per row */
+	if ((int64_t) status->width * status->height * 4 > INT_MAX
+		|| ((int64_t) status->width * status->depth * status->sample_per_pixel / 8 + 8) * status->height > INT_MAX)
+		return 0;
+	return 1;
+}
+
+/* Read IHDR chunk and the chunks after it, up to IEND
+ * Return: 0 if failed
+ */
+static int png_read_chunks(PNG_status *status, const unsigned char *data, int size, int verify, int native)
+{
+	const unsigned char *ctype, *cdata;
+	int clen;
+	int idat_run;
+
+	status->idat_data = NULL;
+	status->fdat = 0;
+	status->idot = NULL;
+	status->verify = verify;
+	status->checksum_error = 0;
+	status->raw = NULL;
+	status->interlaced = NULL;
+	status->image = NULL;
+	status->palette = NULL;
+	status->transparency = NULL;
+	status->frame_count = 0;
+	status->default_frame = 0;
+
+	if (!png_read_header(status, data, size))
+		return 0;
+	data = status->chunks;
+	size = status->chunks_size;
+	status->layout = native ? png_native_layout(status) : FLUID_LAYOUT_RGBA8;
+	status->pixel_size = layout_pixel_size[status->layout];
+	if ((int64_t) status->width * status->height * status->pixel_size > INT_MAX)
+		return 0;
+	png_init_size(status);
+
+	/* Dealing with remaining chunks */
+	idat_run = 0;
+	while (png_extract_chunk(&data, &size, &ctype, &cdata, &clen))
+	{
+		if (ctype[0] == 'I' && ctype[1] == 'D' && ctype[2] == 'A' && ctype[3] == 'T')
+		{
+			/* CRC is checked when inflating */
+			/* Non-contiguous IDAT chunks */
+			if (status->idat_data && !idat_run)
+				return 0;
+
+			/* Zlib data is read from the chunks in place when decompressing */
+			if (!status->idat_data)
+			{
+				status->idat_data = cdata;
+				status->idat_len = clen;
+				status->idat_next = data;
+				status->idat_size = size;
+			}
+			idat_run = 1;
+			continue;
+		}
+		idat_run = 0;
+		if (status->verify && !png_check_crc(ctype, clen))
+			return 0;
+		if (ctype[0] == 'I' && ctype[1] == 'E' && ctype[2] == 'N' && ctype[3] == 'D')
+			break;
+		else if (ctype[0] == 'P' && ctype[1] == 'L' && ctype[2] == 'T' && ctype[3] == 'E')
+		{
+			/* Palette */
+			if (clen % 3 || clen / 3 > (1 << status->depth))
+				return 0;
+			status->palette_count = clen / 3;
+			status->palette = cdata;
+		}
+		else if (ctype[0] == 'i' && ctype[1] == 'D' && ctype[2] == 'O' && ctype[3] == 'T')
+		{
+			/* Split points for parallel decoding */
+			status->idot = cdata;
+			status->idot_len = clen;
+		}
+		else if (ctype[0] == 't' && ctype[1] == 'R' && ctype[2] == 'N' && ctype[3] == 'S')
+		{
+			/* Transparency */
+			if (status->color_type == 0 && clen != 2)
+				return 0;
+			else if (status->color_type == 2 && clen != 6)
+				return 0;
+			else if (status->color_type == 3 && (!status->palette || clen > status->palette_count))
+				return 0;
+			status->transparency_count = clen;
+			status->transparency = cdata;
+		}
+		else if (ctype[0] == 'a' && ctype[1] == 'c' && ctype[2] == 'T' && ctype[3] == 'L')
+		{
+			/* Animation control, an invalid one leaves a static image */
+			if (clen == 8 && !status->idat_data && GET_UINT32_BIG(cdata) > 0 && GET_UINT32_BIG(cdata) <= INT_MAX)
+			{
+				status->frame_count = GET_UINT32_BIG(cdata);
+				status->play_count = GET_UINT32_BIG(cdata + 4);
+			}
+		}
+		else if (ctype[0] == 'f' && ctype[1] == 'c' && ctype[2] == 'T' && ctype[3] == 'L')
+		{
+			/* Frame control before IDAT makes the image the first frame */
+			if (!status->idat_data)
+				status->default_frame = 1;
+		}
+	}
+
+	if (status->color_type == 3 && !status->palette) /* No palette for indexed color type */
+		return 0;
+	if (status->idat_data == NULL)
+		return 0;
+	png_init_extract(status);
+	return 1;
+}
+
+/* Store palette of FLUID_LAYOUT_INDEX8 after the indices */
+static void png_store_palette(const PNG_status *status, unsigned char *dest)
+{
+	int i;
+
+	memset(dest, 0, LAYOUT_PALETTE_SIZE);
+	for (i = 0; i < status->palette_count; i++, dest += 4)
+	{
+		memcpy(dest, status->palette + i * 3, 3);
+		dest[3] = (status->transparency && i < status->transparency_count) ? status->transparency[i] : 0xFF;
+	}
+}
+
+static char *png_decode(const unsigned char *data, int size, int *width, int *height, const FLUID_options *options, const IMAGE_region *region)
+{
+	PNG_status status;
+	unsigned char *buffer = NULL;
+	int parallel, progressive, tail;
+	BIT_reader br;
+
+	if (!png_read_chunks(&status, data, size, options->verify, options->native))
+		return NULL;
+	*width = status.width;
+	*height = status.height;
+	if (region)
+	{
+		if (region->x1 > status.width || region->y1 > status.height)
+			return NULL;
+		status.region = *region;
+	}
+
+	/* Previews are RGBA only */
+	progressive = status.interlace_method == 1 && options->progress && status.layout == FLUID_LAYOUT_RGBA8;
+	tail = status.layout == FLUID_LAYOUT_INDEX8 ? LAYOUT_PALETTE_SIZE : 0;
+
+	/* A region of non-interlaced image is decoded up to its last row only */
+	parallel = options->threads > 1 && status.rawlen >= PNG_PARALLEL_MIN_SIZE && !progressive && !(status.interlace_method == 0 && region);
+	if (!parallel && status.interlace_method == 0)
+	{
+		buffer = malloc(png_scanline_buffer_size(png_get_scanline_len(status.width, status.depth, status.sample_per_pixel)));
+		status.interlaced = malloc((size_t) (status.region.x1 - status.region.x0) * (status.region.y1 - status.region.y0) * status.pixel_size + tail);
+		if (!buffer || !status.interlaced || !png_decode_scanlines(&status, status.interlaced, buffer))
+			goto FINISH;
+		status.image = status.interlaced;
+		status.interlaced = NULL;
+		goto FINISH;
+	}
+
+	/* Zlib decompress */
+	status.raw = malloc(status.rawlen + DEFLATE_OUTPUT_SLACK);
+	status.interlaced = malloc((size_t) status.imagelen + tail);
+	if (!status.raw || !status.interlaced)
+		goto FINISH;
+	if (progressive)
+	{
+		if (!png_decode_progressive(&status, status.interlaced, options))
+			goto FINISH;
+	}
+	else
+	{
+		if (!parallel || !png_inflate_parallel(&status, options->threads))
+		{
+			if (status.checksum_error || !png_init_idat_bits(&status, &br))
+				goto FINISH;
+			if (!zlib_deflate_decode(&br, status.raw, status.rawlen, status.verify) || !png_check_idat_tail(&status))
+				goto FINISH;
+		}
+		if (status.interlace_method == 0)
+		{
+			if (!png_process_parallel(&status, options->threads))
+				goto FINISH;
+		}
+		else
+		{
+			buffer = png_alloc_adam7_buffer(&status);
+			if (!buffer || !png_process_adam7(&status, status.interlaced, buffer))
+				goto FINISH;
+		}
+	}
+	if (region)
+		status.image = crop_image(status.interlaced, status.width, status.pixel_size, region, tail);
+	else
+	{
+		status.image = status.interlaced;
+		status.interlaced = NULL;
+	}
+FINISH:
+	if (status.image && tail)
+		png_store_palette(&status, status.image + (size_t) (status.region.x1 - status.region.x0) * (status.region.y1 - status.region.y0));
+	if (buffer)
+		free(buffer);
+	if (status.raw)
+		free(status.raw);
+	if (status.interlaced)
+		free(status.interlaced);
+	return status.image;
+}
+
+/* Read IHDR chunk only */
+static int png_info(const unsigned char *data, int size, FLUID_info *info)
+{
+	PNG_status status;
+
+	status.verify = 0;
+	if (!png_read_header(&status, data, size))
+		return 0;
+	info->format = FLUID_FORMAT_PNG;
+	info->width = status.width;
+	info->height = status.height;
+	info->channels = status.sample_per_pixel;
+	info->depth = status.depth;
+	info->interlaced = status.interlace_method;
+	info->layout = png_native_layout(&status);
+	return 1;
+}
+
+/* APNG animation
+ * Frames are decoded into a scratch image of their own size and composited
+ * onto the canvas. The buffers are allocated for the size of the canvas
+ * when opening, and reused by every frame.
+ */
+#define APNG_DISPOSE_NONE		0
+#define APNG_DISPOSE_BACKGROUND	1 /* Clear frame region to transparent black */
+#define APNG_DISPOSE_PREVIOUS	2 /* Restore frame region to before the frame */
+
+#define APNG_BLEND_SOURCE		0
+#define APNG_BLEND_OVER			1
+
+struct FLUID_animation
+{
+	PNG_status status; /* width and height are of the current frame */
+	int width, height; /* Canvas */
+	int frame_count; /* At least 1 */
+	int frame; /* Frames shown since the start of this play */
+	/* IDAT chunks of the image */
+	const unsigned char *idat_data, *idat_next;
+	int idat_len, idat_size;
+	/* Chunks after the frame control of the last frame */
+	const unsigned char *next;
+	int next_size;
+	/* Last frame, to dispose of before the next one */
+	IMAGE_region region;
+	int dispose;
+	unsigned char *canvas;
+	unsigned char *previous; /* Canvas before the last frame, if disposed so */
+	unsigned char *image; /* Frame */
+	unsigned char *scratch; /* Buffer of png_decode_scanlines, or raw data of interlaced frame */
+	unsigned char *adam7; /* Buffer of png_process_adam7 */
+};
+
+/* Clear region of canvas to transparent black */
+static void apng_clear_region(unsigned char *canvas, int width, const IMAGE_region *region)
+{
+	int i;
+
+	for (i = region->y0; i < region->y1; i++)
+		memset(canvas + ((size_t) i * width + region->x0) * 4, 0, (size_t) (region->x1 - region->x0) * 4);
+}
+
+/* Copy rows of region from src to dest, both of canvas width */
+static void apng_copy_region(unsigned char *dest, const unsigned char *src, int width, const IMAGE_region *region)
+{
+	size_t offset;
+	int i;
+
+	for (i = region->y0; i < region->y1; i++)
+	{
+		offset = ((size_t) i * width + region->x0) * 4;
+		memcpy(dest + offset, src + offset, (size_t) (region->x1 - region->x0) * 4);
+	}
+}
+
+/* Composite frame image onto region of canvas */
+static void apng_blend(unsigned char *canvas, int width, const unsigned char *image, const IMAGE_region *region, int blend)
+{
+	unsigned char *dest;
+	int i, j, k, region_width;
+	unsigned int src_alpha, dest_alpha, alpha;
+
+	region_width = region->x1 - region->x0;
+	for (i = region->y0; i < region->y1; i++, image += region_width * 4)
+	{
+		dest = canvas + ((size_t) i * width + region->x0) * 4;
+		if (blend == APNG_BLEND_SOURCE)
+		{
+			memcpy(dest, image, (size_t) region_width * 4);
+			continue;
+		}
+		for (j = 0; j < region_width * 4; j += 4)
+		{
+			src_alpha = image[j + 3];
+			if (src_alpha == 255)
+				memcpy(dest + j, image + j, 4);
+			else if (src_alpha)
+			{
+				/* Alpha scaled by 255 */
+				dest_alpha = dest[j + 3] * (255 - src_alpha);
+				src_alpha *= 255;
+				alpha = src_alpha + dest_alpha;
+				for (k = 0; k < 3; k++)
+					dest[j + k] = (image[j + k] * src_alpha + dest[j + k] * dest_alpha) / alpha;
+				dest[j + 3] = (alpha + 127) / 255;
+			}
+		}
+	}
+}
+
+/* Find frame control of the next frame and its data
+ * Return: Delay of the frame in milliseconds, or -1 if failed
+ */
+static int apng_read_frame(FLUID_animation *animation, int *blend)
+{
+	PNG_status *status = &animation->status;
+	const unsigned char *ctype, *cdata, *data;
+	int clen, size, delay_num, delay_den;
+
+	if (!status->frame_count)
+	{
+		/* Static image is the only frame */
+		status->width = animation->width;
+		status->height = animation->height;
+		animation->dispose = APNG_DISPOSE_NONE;
+		*blend = APNG_BLEND_SOURCE;
+		delay_num = 0;
+		delay_den = 1;
+	}
+	else
+	{
+		do
+		{
+			if (!png_extract_chunk(&animation->next, &animation->next_size, &ctype, &cdata, &clen) ||
+				(ctype[0] == 'I' && ctype[1] == 'E' && ctype[2] == 'N' && ctype[3] == 'D'))
+				return -1;
+		} while (ctype[0] != 'f' || ctype[1] != 'c' || ctype[2] != 'T' || ctype[3] != 'L');
+		if (clen != 26)
+			return -1;
+		status->width = (int) GET_UINT32_BIG(cdata + 4);
+		status->height = (int) GET_UINT32_BIG(cdata + 8);
+		animation->region.x0 = (int) GET_UINT32_BIG(cdata + 12);
+		animation->region.y0 = (int) GET_UINT32_BIG(cdata + 16);
+		delay_num = GET_UINT16_BIG(cdata + 20);
+		delay_den = GET_UINT16_BIG(cdata + 22);
+		animation->dispose = cdata[24];
+		*blend = cdata[25];
+		if (status->width <= 0 || status->height <= 0 || animation->region.x0 < 0 || animation->region.y0 < 0 ||
+			status->width > animation->width - animation->region.x0 || status->height > animation->height - animation->region.y0 ||
+			animation->dispose > APNG_DISPOSE_PREVIOUS || *blend > APNG_BLEND_OVER)
+			return -1;
+		if (!delay_den)
+			delay_den = 100;
+		/* Nothing to restore before the first frame */
+		if (animation->frame == 0 && animation->dispose == APNG_DISPOSE_PREVIOUS)
+			animation->dispose = APNG_DISPOSE_BACKGROUND;
+	}
+	animation->region.x1 = animation->region.x0 + status->width;
+	animation->region.y1 = animation->region.y0 + status->height;
+
+	if (animation->frame == 0 && (!status->frame_count || status->default_frame))
+	{
+		/* Image is the first frame */
+		if (status->width != animation->width || status->height != animation->height || animation->region.x0 || animation->region.y0)
+			return -1;
+		status->fdat = 0;
+		status->idat_data = animation->idat_data;
+		status->idat_len = animation->idat_len;
+		status->idat_next = animation->idat_next;
+		status->idat_size = animation->idat_size;
+	}
+	else
+	{
+		/* Frame data in the fdAT chunks after frame control */
+		data = animation->next;
+		size = animation->next_size;
+		do
+		{
+			if (!png_extract_chunk(&data, &size, &ctype, &cdata, &clen) ||
+				(ctype[0] == 'f' && ctype[1] == 'c' && ctype[2] == 'T' && ctype[3] == 'L'))
+				return -1;
+		} while (ctype[0] != 'f' || ctype[1] != 'd' || ctype[2] != 'A' || ctype[3] != 'T');
+		if (clen < 4)
+			return -1;
+		status->fdat = 1;
+		status->idat_data = cdata + 4;
+		status->idat_len = clen - 4;
+		status->idat_next = data;
+		status->idat_size = size;
+	}
+	png_init_size(status);
+	return (int) ((delay_num * 1000 + delay_den / 2) / delay_den);
+}
+
+/* Inflate and extract frame into animation->image
+ * Return: 0 if failed
+ */
+static int apng_decode_frame(FLUID_animation *animation)
+{
+	PNG_status *status = &animation->status;
+	BIT_reader br;
+
+	if (status->interlace_method == 0)
+		return png_decode_scanlines(status, animation->image, animation->scratch);
+	status->raw = animation->scratch;
+	if (!png_init_idat_bits(status, &br) || !zlib_deflate_decode(&br, status->raw, status->rawlen, status->verify) || !png_check_idat_tail(status))
+		return 0;
+	return png_process_adam7(status, animation->image, animation->adam7);
+}
+
+FLUID_animation *fluid_animation_open(const char *_data, int size, int *width, int *height, int *frames, int *plays, const FLUID_options *options)
+{
+	const unsigned char *data = (const unsigned char *) _data;
+	FLUID_animation *animation;
+	PNG_status *status;
+	size_t len;
+
+	if (size < 8 || data[0] != 137 || data[1] != 80 || data[2] != 78 || data[3] != 71 ||
+		data[4] != 13 || data[5] != 10 || data[6] != 26 || data[7] != 10)
+		return NULL;
+	animation = calloc(1, sizeof(FLUID_animation));
+	if (!animation)
+		return NULL;
+	status = &animation->status;
+	if (!png_read_chunks(status, data + 8, size - 8, options ? options->verify : 0, 0))
+		goto FAILED;
+	animation->width = status->width;
+	animation->height = status->height;
+	animation->frame_count = status->frame_count ? status->frame_count : 1;
+	animation->idat_data = status->idat_data;
+	animation->idat_len = status->idat_len;
+	animation->idat_next = status->idat_next;
+	animation->idat_size = status->idat_size;
+	animation->next = status->chunks;
+	animation->next_size = status->chunks_size;
+
+	/* Frames are no larger than the canvas */
+	if (status->interlace_method == 0)
+		len = png_scanline_buffer_size(png_get_scanline_len(status->width, status->depth, status->sample_per_pixel));
+	else
+	{
+		len = status->rawlen + DEFLATE_OUTPUT_SLACK;
+		animation->adam7 = png_alloc_adam7_buffer(status);
+		if (!animation->adam7)
+			goto FAILED;
+	}
+	animation->scratch = malloc(len);
+	animation->image = malloc(status->imagelen);
+	animation->canvas = calloc(status->imagelen, 1);
+	if (!animation->scratch || !animation->image || !animation->canvas)
+		goto FAILED;
+
+	*width = animation->width;
+	*height = animation->height;
+	*frames = animation->frame_count;
+	*plays = status->frame_count ? status->play_count : 1;
+	return animation;
+FAILED:
+	fluid_animation_close(animation);
+	return NULL;
+}
+
+const char *fluid_animation_next(FLUID_animation *animation, int *delay)
+{
+	int blend;
+
+	if (animation->frame > 0)
+	{
+		/* Dispose of last frame */
+		if (animation->dispose == APNG_DISPOSE_BACKGROUND)
+			apng_clear_region(animation->canvas, animation->width, &animation->region);
+		else if (animation->dispose == APNG_DISPOSE_PREVIOUS)
+			apng_copy_region(animation->canvas, animation->previous, animation->width, &animation->region);
+	}
+	if (animation->frame == animation->frame_count)
+	{
+		/* Start over */
+		animation->frame = 0;
+		animation->next = animation->status.chunks;
+		animation->next_size = animation->status.chunks_size;
+		memset(animation->canvas, 0, (size_t) animation->width * animation->height * 4);
+	}
+
+	*delay = apng_read_frame(animation, &blend);
+	if (*delay < 0)
+		return NULL;
+	if (animation->dispose == APNG_DISPOSE_PREVIOUS)
+	{
+		if (!animation->previous)
+			animation->previous = malloc((size_t) animation->width * animation->height * 4);
+		if (!animation->previous)
+			return NULL;
+		apng_copy_region(animation->previous, animation->canvas, animation->width, &animation->region);
+	}
+	if (!apng_decode_frame(animation))
+		return NULL;
+	apng_blend(animation->canvas, animation->width, animation->image, &animation->region, blend);
+	animation->frame++;
+	return (const char *) animation->canvas;
+}
+
+void fluid_animation_close(FLUID_animation *animation)
+{
+	if (animation->previous)
+		free(animation->previous);
+	if (animation->image)
+		free(animation->image);
+	if (animation->canvas)
+		free(animation->canvas);
+	if (animation->scratch)
+		free(animation->scratch);
+	if (animation->adam7)
+		free(animation->adam7);
+	free(animation);
+}
+
+/* JPEG Decoder */
+#define JPEG_SOF0		0xC0
+#define JPEG_SOF1		0xC1
+#define JPEG_SOF2		0xC2
+#define JPEG_SOF3		0xC3
+#define JPEG_DHT		0xC4
+#define JPEG_SOF5		0xC5
+#define JPEG_SOF6		0xC6
+#define JPEG_SOF7		0xC7
+#define JPEG_JPG		0xC8
+#define JPEG_SOF9		0xC9
+#define JPEG_SOF10		0xCA
+#define JPEG_SOF11		0xCB
+#define JPEG_DAC		0xCC
+#define JPEG_SOF13		0xCD
+#define JPEG_SOF14		0xCE
+#define JPEG_SOF15		0xCF
+#define JPEG_RST0		0xD0
+#define JPEG_RST1		0xD1
+#define JPEG_RST2		0xD2
+#define JPEG_RST3		0xD3
+#define JPEG_RST4		0xD4
+#define JPEG_RST5		0xD5
+#define JPEG_RST6		0xD6
+#define JPEG_RST7		0xD7
+#define JPEG_SOI		0xD8
+#define JPEG_EOI		0xD9
+#define JPEG_SOS		0xDA
+#define JPEG_DQT		0xDB
+#define JPEG_DNL		0xDC
+#define JPEG_DRI		0xDD
+#define JPEG_DHP		0xDE
+#define JPEG_EXP		0xDF
+#define JPEG_COMPONENTS_COUNT		256
+#define JPEG_SCAN_COMPONENTS_COUNT	5
+#define JPEG_HUFFMAN_LENGTH_MAX		255
+#define JPEG_HUFFMAN_LENGTH_COUNT	17
+/* Codes of up to this many bits are decoded with a single table lookup */
+#define JPEG_HUFFMAN_LOOKAHEAD_BITS	9
+typedef struct
+{
+	int H, V, Tq;
+	int hs, vs;
+	int linebytes, lines;
+	int valid;
+	unsigned char *raw;
+} JPEG_component;
+
+typedef struct
+{
+	int Pq; /* Precision */
+	int Qk[64];
+#ifdef FLUID_SSE2
+	short natural[64]; /* Qk in natural order */
+#else
+	int scaled[64]; /* Qk in natural order with the input scale factors of jpeg_idct */
+#endif
+	int valid;
+} JPEG_quantization_table;
+
+typedef struct
+{
+	int Tc; /* Table class: 0 = DC, 1 = AC */
+	int L[JPEG_HUFFMAN_LENGTH_COUNT];
+	int hmin[JPEG_HUFFMAN_LENGTH_COUNT], hmax[JPEG_HUFFMAN_LENGTH_COUNT];
+	int V[JPEG_HUFFMAN_LENGTH_COUNT][JPEG_HUFFMAN_LENGTH_MAX];
+	/* Indexed by the next JPEG_HUFFMAN_LOOKAHEAD_BITS bits of input
+	 * lookup: Bits 8-15: Decoded value
+	 *   Bits 0-7: Code length, 0 if the code is longer
+	 * ac_lookup: Bits 8-31: Coefficient, signed
+	 *   Bits 4-7: Run of zero coefficients before it
+	 *   Bits 0-3: Length of the code and the magnitude bits together, 0 if
+	 *   they are longer or the code is EOB or ZRL
+	 */
+	int lookup[1 << JPEG_HUFFMAN_LOOKAHEAD_BITS];
+	int ac_lookup[1 << JPEG_HUFFMAN_LOOKAHEAD_BITS];
+	int valid;
+} JPEG_huffman_table;
+
+typedef struct
+{
+	/* Frame header */
+	int P;
+	int Y, X;
+	int Nf;
+	int hmax, vmax;
+	int hcnt, vcnt;
+	/* Scan header */
+	int Ns;
+	int Cs[JPEG_SCAN_COMPONENTS_COUNT], Td[JPEG_SCAN_COMPONENTS_COUNT], Ta[JPEG_SCAN_COMPONENTS_COUNT];
+	int Ss, Se, Ah, Al;
+	/* Restart interval */
+	int Ri;
+	/* Tables */
+	JPEG_component comp[JPEG_COMPONENTS_COUNT];
+	JPEG_quantization_table qtable[4];
+	JPEG_huffman_table hdc[4], hac[4];
+	/* Final image */
+	unsigned char *image;
+} JPEG_status;
+
+/* JPEG bit reader
+ * Entropy-coded data is read into the big-endian accumulator of BIT_reader,
+ * several bytes per refill. Stuffed 0xFF00 is unstuffed while filling.
+ * Filling stops before a marker, which becomes the end of data, so zero
+ * bytes are fed from there and counted in overrun.
+ */
+static void refill_bits_jpeg(BIT_reader *br)
+{
+	uint64_t x;
+
+	if (br->end - br->data >= 8)
+	{
+		x = load_uint64_little(br->data);
+		/* Without any 0xFF byte, as many bytes as fit are taken at once */
+		if (((~x - 0x0101010101010101ULL) & x & 0x8080808080808080ULL) == 0)
+		{
+			br->buf |= BSWAP64(x) >> br->count;
+			br->data += (63 - br->count) >> 3;
+			br->count |= 56;
+			return;
+		}
+	}
+	while (br->count < 56)
+	{
+		if (br->data < br->end && (br->data[0] != 0xFF || (br->end - br->data >= 2 && br->data[1] == 0x00)))
+		{
+			br->buf |= (uint64_t) br->data[0] << (56 - br->count);
+			br->data += br->data[0] == 0xFF ? 2 : 1;
+		}
+		else
+		{
+			br->end = br->data;
+			br->overrun++;
+		}
+		br->count += 8;
+	}
+}
+
+static INLINE unsigned int peek_bits_jpeg(const BIT_reader *br, int bits)
+{
+	return (unsigned int) (br->buf >> (64 - bits));
+}
+
+static INLINE void skip_bits_jpeg(BIT_reader *br, int bits)
+{
+	br->buf <<= bits;
+	br->count -= bits;
+}
+
+/* Skip the RSTn marker after a restart interval, end is the end of data
+ * Return: 0 if more than padding bits are left or no RSTn marker follows
+ */
+static int jpeg_restart_bits(BIT_reader *br, const unsigned char *end)
+{
+	if (br->count - br->overrun * 8 >= 8 || BITS_OVERRUN(br))
+		return 0;
+	/* Fill bytes may precede the marker */
+	while (end - br->data >= 2 && br->data[0] == 0xFF && br->data[1] == 0xFF)
+		br->data++;
+	if (end - br->data < 2 || br->data[0] != 0xFF || br->data[1] < JPEG_RST0 || br->data[1] > JPEG_RST7)
+		return 0;
+	init_bits(br, br->data + 2, (int) (end - br->data - 2));
+	return 1;
+}
+
+static int jpeg_extract_segment(const unsigned char **data, int *size, unsigned char *seg_type, const unsigned char **seg_data, int *seg_len)
+{
+	if (*size < 2)
+		return 0;
+	EXTRACT_UINT8(*data, *seg_type);
+	(*size)--;
+	if (*seg_type != 0xFF)
+		return 0;
+	while (*size >= 1)
+	{
+		EXTRACT_UINT8(*data, *seg_type);
+		(*size)--;
+		if (*seg_type != 0xFF)
+			break;
+	}
+	if ((*seg_type >= JPEG_RST0 && *seg_type <= JPEG_RST7) || *seg_type == JPEG_SOI || *seg_type == JPEG_EOI) /* Standard-alone marker */
+		return 1;
+	if (*size < 2)
+		return 0;
+	EXTRACT_UINT16_BIG(*data, *seg_len);
+	*size -= 2;
+	*seg_len -= 2;
+	if (*size < *seg_len)
+		return 0;
+	*size -= *seg_len;
+	*seg_data = *data;
+	*data += *seg_len;
+	return 1;
+}
+
+static int jpeg_process_restart_interval(JPEG_status *status, unsigned char stype, const unsigned char *sdata, int slen)
+{
+	if (slen != 2)
+		return 0;
+	EXTRACT_UINT16_BIG(sdata, status->Ri);
+	return 1;
+}
+
+/* Natural (row-major) position of each coefficient in zigzag order */
+static const unsigned char jpeg_natural[64] = {
+	 0,  1,  8, 16,  9,  2,  3, 10,
+	17, 24, 32, 25, 18, 11,  4,  5,
+	12, 19, 26, 33, 40, 48, 41, 34,
+	27, 20, 13,  6,  7, 14, 21, 28,
+	35, 42, 49, 56, 57, 50, 43, 36,
+	29, 22, 15, 23, 30, 37, 44, 51,
+	58, 59, 52, 45, 38, 31, 39, 46,
+	53, 60, 61, 54, 47, 55, 62, 63,
+};
+
+#ifdef FLUID_SSE2
+/*
+ * IDCT of Loeffler, Ligtenberg and Moschytz, as in the islow IDCT of libjpeg
+ * Each pass transforms 8 columns of 16-bit samples at once. Products with the
+ * constants of JPEG_IDCT_CONST_BITS fractional bits are summed in pairs to 32
+ * bits by _mm_madd_epi16, and the column pass keeps JPEG_IDCT_PASS1_BITS
+ * fractional bits in 16 bits for the row pass. The precision meets IEEE 1180.
+ * When only the first 2 or 4 inputs are nonzero, pairs of constants are summed
+ * instead, which gives exactly the same results.
+ */
+#define JPEG_IDCT_CONST_BITS	13
+#define JPEG_IDCT_PASS1_BITS	2
+#define JPEG_IDCT_FIX(x)		((int) ((x) * (1 << JPEG_IDCT_CONST_BITS) + 0.5))
+#define JPEG_IDCT_PAIR(a, b)	_mm_setr_epi16((short) (a), (short) (b), (short) (a), (short) (b), (short) (a), (short) (b), (short) (a), (short) (b))
+#define JPEG_F_1		(1 << JPEG_IDCT_CONST_BITS)
+#define JPEG_F_0_298	JPEG_IDCT_FIX(0.298631336)
+#define JPEG_F_0_390	JPEG_IDCT_FIX(0.390180644)
+#define JPEG_F_0_541	JPEG_IDCT_FIX(0.541196100)
+#define JPEG_F_0_765	JPEG_IDCT_FIX(0.765366865)
+#define JPEG_F_0_899	JPEG_IDCT_FIX(0.899976223)
+#define JPEG_F_1_175	JPEG_IDCT_FIX(1.175875602)
+#define JPEG_F_1_501	JPEG_IDCT_FIX(1.501321110)
+#define JPEG_F_1_847	JPEG_IDCT_FIX(1.847759065)
+#define JPEG_F_1_961	JPEG_IDCT_FIX(1.961570560)
+#define JPEG_F_2_053	JPEG_IDCT_FIX(2.053119869)
+#define JPEG_F_2_562	JPEG_IDCT_FIX(2.562915447)
+#define JPEG_F_3_072	JPEG_IDCT_FIX(3.072711026)
+
+/* Dequantization takes Qk in natural order */
+static void jpeg_prepare_quantization_table(JPEG_quantization_table *qtable)
+{
+	int i;
+
+	for (i = 0; i < 64; i++)
+		qtable->natural[jpeg_natural[i]] = (short) (qtable->Qk[i] < 0x7FFF ? qtable->Qk[i] : 0x7FFF);
+}
+
+/* Transpose 8x8 16-bit samples
+ * Only the first n rows of the result are needed, the others are left as is
+ * for n of 2 or 4.
+ */
+static FORCE_INLINE void jpeg_transpose_sse2(__m128i *r, int n)
+{
+	__m128i a0, a1, a2, a3, a4, a5, a6, a7;
+	__m128i b0, b1, b2, b3, b4, b5, b6, b7;
+
+	if (n < 8)
+	{
+		a0 = _mm_unpacklo_epi16(r[0], r[1]);
+		a2 = _mm_unpacklo_epi16(r[2], r[3]);
+		a4 = _mm_unpacklo_epi16(r[4], r[5]);
+		a6 = _mm_unpacklo_epi16(r[6], r[7]);
+		b0 = _mm_unpacklo_epi32(a0, a2);
+		b4 = _mm_unpacklo_epi32(a4, a6);
+		r[0] = _mm_unpacklo_epi64(b0, b4);
+		r[1] = _mm_unpackhi_epi64(b0, b4);
+		if (n > 2)
+		{
+			b1 = _mm_unpackhi_epi32(a0, a2);
+			b5 = _mm_unpackhi_epi32(a4, a6);
+			r[2] = _mm_unpacklo_epi64(b1, b5);
+			r[3] = _mm_unpackhi_epi64(b1, b5);
+		}
+		return;
+	}
+	a0 = _mm_unpacklo_epi16(r[0], r[1]);
+	a1 = _mm_unpackhi_epi16(r[0], r[1]);
+	a2 = _mm_unpacklo_epi16(r[2], r[3]);
+	a3 = _mm_unpackhi_epi16(r[2], r[3]);
+	a4 = _mm_unpacklo_epi16(r[4], r[5]);
+	a5 = _mm_unpackhi_epi16(r[4], r[5]);
+	a6 = _mm_unpacklo_epi16(r[6], r[7]);
+	a7 = _mm_unpackhi_epi16(r[6], r[7]);
+	b0 = _mm_unpacklo_epi32(a0, a2);
+	b1 = _mm_unpackhi_epi32(a0, a2);
+	b2 = _mm_unpacklo_epi32(a1, a3);
+	b3 = _mm_unpackhi_epi32(a1, a3);
+	b4 = _mm_unpacklo_epi32(a4, a6);
+	b5 = _mm_unpackhi_epi32(a4, a6);
+	b6 = _mm_unpacklo_epi32(a5, a7);
+	b7 = _mm_unpackhi_epi32(a5, a7);
+	r[0] = _mm_unpacklo_epi64(b0, b4);
+	r[1] = _mm_unpackhi_epi64(b0, b4);
+	r[2] = _mm_unpacklo_epi64(b1, b5);
+	r[3] = _mm_unpackhi_epi64(b1, b5);
+	r[4] = _mm_unpacklo_epi64(b2, b6);
+	r[5] = _mm_unpackhi_epi64(b2, b6);
+	r[6] = _mm_unpacklo_epi64(b3, b7);
+	r[7] = _mm_unpackhi_epi64(b3, b7);
+}
+
+static FORCE_INLINE __m128i jpeg_unpack_sse2(__m128i a, __m128i b, int hi)
+{
+	return hi ? _mm_unpackhi_epi16(a, b) : _mm_unpacklo_epi16(a, b);
+}
+
+/* 8-point IDCT of the low or high 4 lanes of r[0], ..., r[7], of which only
+ * the first n are nonzero. Outputs are 32 bits, shifted right by shift with
+ * rounding.
+ */
+static FORCE_INLINE void jpeg_idct_half_sse2(const __m128i *r, int n, int hi, __m128i *out, __m128i round, __m128i shift)
+{
+	__m128i tmp0, tmp1, tmp2, tmp3, tmp10, tmp11, tmp12, tmp13, x, y, z3, z4;
+
+	if (n <= 2)
+	{
+		x = jpeg_unpack_sse2(r[0], r[1], hi);
+		tmp10 = tmp11 = tmp12 = tmp13 = _mm_add_epi32(_mm_madd_epi16(x, JPEG_IDCT_PAIR(JPEG_F_1, 0)), round);
+		tmp0 = _mm_madd_epi16(x, JPEG_IDCT_PAIR(0, JPEG_F_1_175 - JPEG_F_0_899));
+		tmp1 = _mm_madd_epi16(x, JPEG_IDCT_PAIR(0, JPEG_F_1_175 - JPEG_F_0_390));
+		tmp2 = _mm_madd_epi16(x, JPEG_IDCT_PAIR(0, JPEG_F_1_175));
+		tmp3 = _mm_madd_epi16(x, JPEG_IDCT_PAIR(0, JPEG_F_1_175 - JPEG_F_0_390 + JPEG_F_1_501 - JPEG_F_0_899));
+	}
+	else if (n <= 4)
+	{
+		/* Even part */
+		x = jpeg_unpack_sse2(r[0], r[2], hi);
+		tmp10 = _mm_add_epi32(_mm_madd_epi16(x, JPEG_IDCT_PAIR(JPEG_F_1, JPEG_F_0_541 + JPEG_F_0_765)), round);
+		tmp13 = _mm_add_epi32(_mm_madd_epi16(x, JPEG_IDCT_PAIR(JPEG_F_1, -JPEG_F_0_541 - JPEG_F_0_765)), round);
+		tmp11 = _mm_add_epi32(_mm_madd_epi16(x, JPEG_IDCT_PAIR(JPEG_F_1, JPEG_F_0_541)), round);
+		tmp12 = _mm_add_epi32(_mm_madd_epi16(x, JPEG_IDCT_PAIR(JPEG_F_1, -JPEG_F_0_541)), round);
+		/* Odd part */
+		y = jpeg_unpack_sse2(r[3], r[1], hi);
+		tmp0 = _mm_madd_epi16(y, JPEG_IDCT_PAIR(JPEG_F_1_175 - JPEG_F_1_961, JPEG_F_1_175 - JPEG_F_0_899));
+		tmp1 = _mm_madd_epi16(y, JPEG_IDCT_PAIR(JPEG_F_1_175 - JPEG_F_2_562, JPEG_F_1_175 - JPEG_F_0_390));
+		tmp2 = _mm_madd_epi16(y, JPEG_IDCT_PAIR(JPEG_F_1_175 - JPEG_F_1_961 + JPEG_F_3_072 - JPEG_F_2_562, JPEG_F_1_175));
+		tmp3 = _mm_madd_epi16(y, JPEG_IDCT_PAIR(JPEG_F_1_175, JPEG_F_1_175 - JPEG_F_0_390 + JPEG_F_1_501 - JPEG_F_0_899));
+	}
+	else
+	{
+		/* Even part */
+		x = jpeg_unpack_sse2(r[0], r[4], hi);
+		y = jpeg_unpack_sse2(r[2], r[6], hi);
+		tmp0 = _mm_add_epi32(_mm_madd_epi16(x, JPEG_IDCT_PAIR(JPEG_F_1, JPEG_F_1)), round);
+		tmp1 = _mm_add_epi32(_mm_madd_epi16(x, JPEG_IDCT_PAIR(JPEG_F_1, -JPEG_F_1)), round);
+		tmp3 = _mm_madd_epi16(y, JPEG_IDCT_PAIR(JPEG_F_0_541 + JPEG_F_0_765, JPEG_F_0_541));
+		tmp2 = _mm_madd_epi16(y, JPEG_IDCT_PAIR(JPEG_F_0_541, JPEG_F_0_541 - JPEG_F_1_847));
+		tmp10 = _mm_add_epi32(tmp0, tmp3);
+		tmp13 = _mm_sub_epi32(tmp0, tmp3);
+		tmp11 = _mm_add_epi32(tmp1, tmp2);
+		tmp12 = _mm_sub_epi32(tmp1, tmp2);
+		/* Odd part */
+		x = jpeg_unpack_sse2(_mm_add_epi16(r[7], r[3]), _mm_add_epi16(r[5], r[1]), hi);
+		z3 = _mm_madd_epi16(x, JPEG_IDCT_PAIR(JPEG_F_1_175 - JPEG_F_1_961, JPEG_F_1_175));
+		z4 = _mm_madd_epi16(x, JPEG_IDCT_PAIR(JPEG_F_1_175, JPEG_F_1_175 - JPEG_F_0_390));
+		x = jpeg_unpack_sse2(r[7], r[1], hi);
+		y = jpeg_unpack_sse2(r[5], r[3], hi);
+		tmp0 = _mm_add_epi32(_mm_madd_epi16(x, JPEG_IDCT_PAIR(JPEG_F_0_298 - JPEG_F_0_899, -JPEG_F_0_899)), z3);
+		tmp3 = _mm_add_epi32(_mm_madd_epi16(x, JPEG_IDCT_PAIR(-JPEG_F_0_899, JPEG_F_1_501 - JPEG_F_0_899)), z4);
+		tmp1 = _mm_add_epi32(_mm_madd_epi16(y, JPEG_IDCT_PAIR(JPEG_F_2_053 - JPEG_F_2_562, -JPEG_F_2_562)), z4);
+		tmp2 = _mm_add_epi32(_mm_madd_epi16(y, JPEG_IDCT_PAIR(-JPEG_F_2_562, JPEG_F_3_072 - JPEG_F_2_562)), z3);
+	}
+
+	out[0] = _mm_sra_epi32(_mm_add_epi32(tmp10, tmp3), shift);
+	out[7] = _mm_sra_epi32(_mm_sub_epi32(tmp10, tmp3), shift);
+	out[1] = _mm_sra_epi32(_mm_add_epi32(tmp11, tmp2), shift);
+	out[6] = _mm_sra_epi32(_mm_sub_epi32(tmp11, tmp2), shift);
+	out[2] = _mm_sra_epi32(_mm_add_epi32(tmp12, tmp1), shift);
+	out[5] = _mm_sra_epi32(_mm_sub_epi32(tmp12, tmp1), shift);
+	out[3] = _mm_sra_epi32(_mm_add_epi32(tmp13, tmp0), shift);
+	out[4] = _mm_sra_epi32(_mm_sub_epi32(tmp13, tmp0), shift);
+}
+
+/* 8-point IDCT of r[0], ..., r[7], of which only the first n are nonzero,
+ * saturated to 16 bits. Unless wide, lanes 4 to 7 of the inputs must be zero,
+ * and so are their outputs.
+ */
+static FORCE_INLINE void jpeg_idct_1d_sse2(__m128i *r, int n, int wide, int shift)
+{
+	__m128i lo[8], hi[8], round, count;
+	int i;
+
+	round = _mm_set1_epi32(1 << (shift - 1));
+	count = _mm_cvtsi32_si128(shift);
+	jpeg_idct_half_sse2(r, n, 0, lo, round, count);
+	if (!wide)
+		for (i = 0; i < 8; i++)
+			hi[i] = _mm_setzero_si128();
+	else
+		jpeg_idct_half_sse2(r, n, 1, hi, round, count);
+	for (i = 0; i < 8; i++)
+		r[i] = _mm_packs_epi32(lo[i], hi[i]);
+}
+
+/* 2-D IDCT of r with only the top left n x n inputs nonzero */
+static FORCE_INLINE void jpeg_idct_2d_sse2(__m128i *r, int n)
+{
+	/* Columns, then rows of the transposed block */
+	jpeg_idct_1d_sse2(r, n, n == 8, JPEG_IDCT_CONST_BITS - JPEG_IDCT_PASS1_BITS);
+	jpeg_transpose_sse2(r, n);
+	/* 1 / 8 of the 2-D IDCT, all lanes are nonzero now */
+	jpeg_idct_1d_sse2(r, n, 1, JPEG_IDCT_CONST_BITS + JPEG_IDCT_PASS1_BITS + 3);
+	jpeg_transpose_sse2(r, 8);
+}
+
+/* Dequantize and IDCT coefficients in natural order, then store the level
+ * shifted samples to 8 rows of out
+ * Coefficients after the first n in zigzag order must be zero. Blocks with
+ * only a DC coefficient are filled, and blocks with nonzero coefficients in
+ * the top left 2x2 or 4x4 only skip the zero inputs.
+ */
+static void jpeg_idct_block(const short *coef, int n, const JPEG_quantization_table *qtable, unsigned char *out, int stride)
+{
+	__m128i r[8], x, bias;
+	int i, size;
+
+	if (n == 1)
+	{
+		/* As computed by the column and row passes */
+		i = (short) (coef[0] * qtable->natural[0]) * 4;
+		i = i < -32768 ? -32768 : i > 32767 ? 32767 : i;
+		x = _mm_set1_epi8((char) color_clamp(((i + 16) >> 5) + 128));
+		for (i = 0; i < 8; i++)
+			_mm_storel_epi64((__m128i *) (out + stride * i), x);
+		return;
+	}
+	size = n <= 3 ? 2 : n <= 10 ? 4 : 8;
+	for (i = 0; i < size; i++)
+		r[i] = _mm_mullo_epi16(_mm_loadu_si128((const __m128i *) (coef + i * 8)), _mm_loadu_si128((const __m128i *) (qtable->natural + i * 8)));
+	for (; i < 8; i++)
+		r[i] = _mm_setzero_si128();
+	if (size == 2)
+		jpeg_idct_2d_sse2(r, 2);
+	else if (size == 4)
+		jpeg_idct_2d_sse2(r, 4);
+	else
+		jpeg_idct_2d_sse2(r, 8);
+	/* Saturate to [-128, 127], then flipping the sign bit adds 128 */
+	bias = _mm_set1_epi8((char) 0x80);
+	for (i = 0; i < 8; i += 2)
+	{
+		x = _mm_xor_si128(_mm_packs_epi16(r[i], r[i + 1]), bias);
+		_mm_storel_epi64((__m128i *) (out + stride * i), x);
+		_mm_storel_epi64((__m128i *) (out + stride * (i + 1)), _mm_srli_si128(x, 8));
+	}
+}
+#else
+/*
+ * IDCT of Arai, Agui and Nakajima
+ * Each 8-point IDCT takes 5 multiplications once input (u, v) is scaled by
+ * jpeg_aan_scale[u] * jpeg_aan_scale[v], which is folded into the
+ * dequantization table. Dequantized coefficients carry
+ * JPEG_IDCT_SCALE_BITS fractional bits, which the column pass reduces by
+ * JPEG_IDCT_PASS1_SHIFT to keep sums of the row pass in 32 bits. Products
+ * with the constants take 64 bits. The precision meets IEEE 1180.
+ */
+#define JPEG_IDCT_SCALE_BITS	12
+#define JPEG_IDCT_PASS1_SHIFT	4
+#define JPEG_IDCT_CONST_BITS	12
+#define JPEG_IDCT_FIX(x)		((int) ((x) * (1 << JPEG_IDCT_CONST_BITS) + 0.5))
+#define JPEG_IDCT_MUL(a, k)		((int) (((int64_t) (a) * (k) + (1 << (JPEG_IDCT_CONST_BITS - 1))) >> JPEG_IDCT_CONST_BITS))
+
+/* jpeg_aan_scale[k] = cos(k * pi / 16) * sqrt(2), 1 for k = 0 */
+static const double jpeg_aan_scale[8] = {
+	1.0, 1.387039845322148, 1.306562964876377, 1.175875602419359,
+	1.0, 0.785694958387102, 0.541196100146197, 0.275899379282943,
+};
+
+/* Fold the input scale factors of jpeg_idct into a quantization table in
+ * natural order
+ */
+static void jpeg_prepare_quantization_table(JPEG_quantization_table *qtable)
+{
+	int i, n;
+
+	for (i = 0; i < 64; i++)
+	{
+		n = jpeg_natural[i];
+		qtable->scaled[n] = (int) (qtable->Qk[i] * jpeg_aan_scale[n % 8] * jpeg_aan_scale[n / 8] * (1 << JPEG_IDCT_SCALE_BITS) + 0.5);
+	}
+}
+
+/* 8-point IDCT of p[0], p[stride], ..., p[7 * stride] in place, each output
+ * shifted right by shift bits with rounding
+ * Only the first n inputs are read, the others are taken as zero.
+ */
+static INLINE void jpeg_idct_1d(int *p, int stride, int shift, int n)
+{
+	int p0, p1, p2, p3, p4, p5, p6, p7;
+	int tmp0, tmp1, tmp2, tmp3, tmp4, tmp5, tmp6, tmp7;
+	int tmp10, tmp11, tmp12, tmp13;
+	int z5, z10, z11, z12, z13;
+	int round;
+
+	p0 = p[0];
+	p1 = p[stride];
+	p2 = n > 2 ? p[stride * 2] : 0;
+	p3 = n > 2 ? p[stride * 3] : 0;
+	p4 = n > 4 ? p[stride * 4] : 0;
+	p5 = n > 4 ? p[stride * 5] : 0;
+	p6 = n > 4 ? p[stride * 6] : 0;
+	p7 = n > 4 ? p[stride * 7] : 0;
+
+	/* Even part */
+	tmp10 = p0 + p4;
+	tmp11 = p0 - p4;
+	tmp13 = p2 + p6;
+	tmp12 = JPEG_IDCT_MUL(p2 - p6, JPEG_IDCT_FIX(1.414213562)) - tmp13;
+	tmp0 = tmp10 + tmp13;
+	tmp3 = tmp10 - tmp13;
+	tmp1 = tmp11 + tmp12;
+	tmp2 = tmp11 - tmp12;
+
+	/* Odd part */
+	z13 = p5 + p3;
+	z10 = p5 - p3;
+	z11 = p1 + p7;
+	z12 = p1 - p7;
+	tmp7 = z11 + z13;
+	tmp11 = JPEG_IDCT_MUL(z11 - z13, JPEG_IDCT_FIX(1.414213562));
+	z5 = JPEG_IDCT_MUL(z10 + z12, JPEG_IDCT_FIX(1.847759065)); /* 2 * c2 */
+	tmp10 = JPEG_IDCT_MUL(z12, JPEG_IDCT_FIX(1.082392200)) - z5; /* 2 * (c2 - c6) */
+	tmp12 = z5 - JPEG_IDCT_MUL(z10, JPEG_IDCT_FIX(2.613125930)); /* -2 * (c2 + c6) */
+	tmp6 = tmp12 - tmp7;
+	tmp5 = tmp11 - tmp6;
+	tmp4 = tmp10 + tmp5;
+
+	round = shift ? 1 << (shift - 1) : 0;
+	p[0] = (tmp0 + tmp7 + round) >> shift;
+	p[stride * 7] = (tmp0 - tmp7 + round) >> shift;
+	p[stride] = (tmp1 + tmp6 + round) >> shift;
+	p[stride * 6] = (tmp1 - tmp6 + round) >> shift;
+	p[stride * 2] = (tmp2 + tmp5 + round) >> shift;
+	p[stride * 5] = (tmp2 - tmp5 + round) >> shift;
+	p[stride * 4] = (tmp3 + tmp4 + round) >> shift;
+	p[stride * 3] = (tmp3 - tmp4 + round) >> shift;
+}
+
+/* IDCT of a block dequantized with the scaled table, in place
+ * Only the top left n x n inputs are read, the others are taken as zero.
+ */
+static INLINE void jpeg_idct(int *block, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		jpeg_idct_1d(block + i, 8, JPEG_IDCT_PASS1_SHIFT, n);
+	/* 1 / 8 of the 2-D IDCT */
+	for (i = 0; i < 8; i++)
+		jpeg_idct_1d(block + i * 8, 1, JPEG_IDCT_SCALE_BITS - JPEG_IDCT_PASS1_SHIFT + 3, n);
+}
+
+/* Dequantize and IDCT coefficients in natural order, then store the level
+ * shifted samples to 8 rows of out
+ * Coefficients after the first n in zigzag order must be zero. Blocks with
+ * only a DC coefficient are filled, and blocks with nonzero coefficients in
+ * the top left 2x2 or 4x4 only transform those.
+ */
+static void jpeg_idct_block(const short *coef, int n, const JPEG_quantization_table *qtable, unsigned char *out, int stride)
+{
+	int block[64];
+	int i, j, size;
+
+	if (n == 1)
+	{
+		/* As computed by the column and row passes */
+		i = (coef[0] * qtable->scaled[0] + (1 << (JPEG_IDCT_PASS1_SHIFT - 1))) >> JPEG_IDCT_PASS1_SHIFT;
+		i = (i + (1 << (JPEG_IDCT_SCALE_BITS - JPEG_IDCT_PASS1_SHIFT + 2))) >> (JPEG_IDCT_SCALE_BITS - JPEG_IDCT_PASS1_SHIFT + 3);
+		i = color_clamp(i + 128);
+		for (j = 0; j < 8; j++)
+			memset(out + stride * j, i, 8);
+		return;
+	}
+	size = n <= 3 ? 2 : n <= 10 ? 4 : 8;
+	for (i = 0; i < size; i++)
+		for (j = 0; j < size; j++)
+			block[i * 8 + j] = coef[i * 8 + j] * qtable->scaled[i * 8 + j];
+	if (size == 2)
+		jpeg_idct(block, 2);
+	else if (size == 4)
+		jpeg_idct(block, 4);
+	else
+		jpeg_idct(block, 8);
+	for (i = 0; i < 8; i++, out += stride)
+		for (j = 0; j < 8; j++)
+			out[j] = (unsigned char) color_clamp(block[i * 8 + j] + 128);
+}
+#endif
+
+static int jpeg_process_quantization_table(JPEG_status *status, unsigned char stype, const unsigned char *sdata, int slen)
+{
+	int i, j, Pq, Tq;
+	if (slen == 0)
+		return 0;
+	while (slen > 0)
+	{
+		if (slen < 1)
+			return 0;
+		slen--;
+		EXTRACT_UINT8(sdata, j);
+		Pq = HIBYTE(j);
+		if (Pq == 0)
+			Pq = 8;
+		else if (Pq == 1)
+			Pq = 16;
+		else
+			return 0;
+		Tq = LOBYTE(j);
+		status->qtable[Tq].valid = 1;
+		status->qtable[Tq].Pq = Pq;
+		if (slen < Pq / 8 * 64)
+			return 0;
+		slen -= Pq / 8 * 64;
+		if (Pq == 8)
+		{
+			for (i = 0; i < 64; i++)
+				EXTRACT_UINT8(sdata, status->qtable[Tq].Qk[i]);
+		}
+		else
+		{
+			for (i = 0; i < 64; i++)
+				EXTRACT_UINT16_BIG(sdata, status->qtable[Tq].Qk[i]);
+		}
+		jpeg_prepare_quantization_table(&status->qtable[Tq]);
+	}
+	return 1;
+}
+
+/* The EXTEND procedure in JPEG specification */
+static INLINE int jpeg_extend(int raw, int t)
+{
+	int Vt;
+	
+	Vt = 1 << (t - 1);
+	if (raw < Vt)
+		return raw + ((-1) << t) + 1;
+	else
+		return raw;
+}
+
+/* Fill the lookahead tables with codes of up to JPEG_HUFFMAN_LOOKAHEAD_BITS
+ * bits, after hmin and hmax are set
+ */
+static void jpeg_build_huffman_lookup(JPEG_huffman_table *huffman)
+{
+	int i, j, k, l, r, s, code, first, n;
+
+	memset(huffman->lookup, 0, sizeof(huffman->lookup));
+	memset(huffman->ac_lookup, 0, sizeof(huffman->ac_lookup));
+	for (l = 1; l <= JPEG_HUFFMAN_LOOKAHEAD_BITS; l++)
+		for (i = 0; i < huffman->L[l]; i++)
+		{
+			code = huffman->hmin[l] + i;
+			n = 1 << (JPEG_HUFFMAN_LOOKAHEAD_BITS - l);
+			first = code << (JPEG_HUFFMAN_LOOKAHEAD_BITS - l);
+			for (j = 0; j < n; j++)
+				huffman->lookup[first + j] = (huffman->V[l][i] << 8) | l;
+			r = HIBYTE(huffman->V[l][i]);
+			s = LOBYTE(huffman->V[l][i]);
+			if (huffman->Tc == 0 || s == 0 || l + s > JPEG_HUFFMAN_LOOKAHEAD_BITS)
+				continue;
+			/* The magnitude bits follow the code within the lookahead bits */
+			for (j = 0; j < n; j++)
+			{
+				k = j >> (JPEG_HUFFMAN_LOOKAHEAD_BITS - l - s);
+				huffman->ac_lookup[first + j] = jpeg_extend(k, s) * 256 | (r << 4) | (l + s);
+			}
+		}
+}
+
+static int jpeg_process_huffman_table(JPEG_status *status, unsigned char stype, const unsigned char *sdata, int slen)
+{
+	int i, j, mt, Tc, Th;
+	JPEG_huffman_table *huffman;
+	if (slen == 0)
+		return 0;
+	while (slen > 0)
+	{
+		if (slen < 17)
+			return 0;
+		slen -= 17;
+		EXTRACT_UINT8(sdata, j);
+		Tc = HIBYTE(j);
+		Th = LOBYTE(j);
 		if (Tc > 1 || Th > 3)
 			return 0;
 		if (Tc == 0)
@@ -1095,6 +5114,7 @@ static int jpeg_process_huffman_table(JPEG_status *status, unsigned char stype,
 		else
 			huffman = &status->hac[Th];
 		huffman->valid = 1;
+		huffman->Tc = Tc;
 		mt = 0;
 		for (i = 1; i <= 16; i++)
 		{
@@ -1111,297 +5131,944 @@ static int jpeg_process_huffman_table(JPEG_status *status, unsigned char stype,
 		j = 0;
 		for (i = 1; i <= 16; i++)
 		{
-			if (huffman->L[i] == 0)
-				huffman->hmin[i] = huffman->hmax[i] = -1;
+			if (huffman->L[i] == 0)
+				huffman->hmin[i] = huffman->hmax[i] = -1;
+			else
+			{
+				huffman->hmin[i] = j;
+				huffman->hmax[i] = j + huffman->L[i] - 1;
+				if (huffman->hmax[i] >= (1 << i))
+					return 0;
+				j += huffman->L[i];
+			}
+			j <<= 1;
+		}
+		jpeg_build_huffman_lookup(huffman);
+	}
+	return 1;
+}
+
+/* Decode a Huffman code, at least 16 bits must be available
+ * Return: Decoded value, or -1 if the code is invalid
+ */
+static INLINE int jpeg_decode_huffman(BIT_reader *br, const JPEG_huffman_table *huffman)
+{
+	int entry, l, code;
+
+	entry = huffman->lookup[peek_bits_jpeg(br, JPEG_HUFFMAN_LOOKAHEAD_BITS)];
+	if ((entry & 0xFF) != 0)
+	{
+		skip_bits_jpeg(br, entry & 0xFF);
+		return entry >> 8;
+	}
+	for (l = JPEG_HUFFMAN_LOOKAHEAD_BITS + 1; l <= 16; l++)
+	{
+		code = (int) peek_bits_jpeg(br, l);
+		if (code >= huffman->hmin[l] && code <= huffman->hmax[l])
+		{
+			skip_bits_jpeg(br, l);
+			return huffman->V[l][code - huffman->hmin[l]];
+		}
+	}
+	return -1;
+}
+
+/* Receive t magnitude bits of a coefficient and extend them */
+static INLINE int jpeg_receive_extend(BIT_reader *br, int t)
+{
+	int raw;
+
+	if (t == 0)
+		return 0;
+	raw = (int) peek_bits_jpeg(br, t);
+	skip_bits_jpeg(br, t);
+	return jpeg_extend(raw, t);
+}
+
+/* Decode the coefficients of a block in natural order into coef, which must
+ * be zero before
+ * pred is the DC prediction of the component
+ * Return: Number of coefficients up to the last nonzero one in zigzag order,
+ *   or 0 if data is invalid
+ */
+static int jpeg_decode_block(BIT_reader *br, const JPEG_huffman_table *hdc, const JPEG_huffman_table *hac, int *pred, short *coef)
+{
+	int g, t, rs, entry, last;
+
+	/* A code and its magnitude take at most 32 bits */
+	if (br->count < 32)
+		refill_bits_jpeg(br);
+	t = jpeg_decode_huffman(br, hdc);
+	if (t < 0 || t > 16)
+		return 0;
+	*pred += jpeg_receive_extend(br, t);
+	coef[0] = (short) *pred;
+	last = 0;
+	for (g = 1; g <= 63; g++)
+	{
+		if (br->count < 32)
+			refill_bits_jpeg(br);
+		/* Most coefficients are decoded with their magnitude in one lookup */
+		entry = hac->ac_lookup[peek_bits_jpeg(br, JPEG_HUFFMAN_LOOKAHEAD_BITS)];
+		if (entry != 0)
+		{
+			g += (entry >> 4) & 0x0F;
+			if (g > 63)
+				return 0;
+			skip_bits_jpeg(br, entry & 0x0F);
+			coef[jpeg_natural[g]] = (short) (entry >> 8);
+			last = g;
+			continue;
+		}
+		rs = jpeg_decode_huffman(br, hac);
+		if (rs < 0)
+			return 0;
+		if (LOBYTE(rs) == 0)
+		{
+			if (HIBYTE(rs) != 15) /* EOB */
+				break;
+			g += 15; /* ZRL */
+			continue;
+		}
+		g += HIBYTE(rs);
+		if (g > 63)
+			return 0;
+		coef[jpeg_natural[g]] = (short) jpeg_receive_extend(br, LOBYTE(rs));
+		last = g;
+	}
+	return BITS_OVERRUN(br) ? 0 : last + 1;
+}
+
+static int jpeg_process_segment(JPEG_status *status, unsigned char stype, const unsigned char *sdata, int slen)
+{
+	if (stype == JPEG_DRI)
+		return jpeg_process_restart_interval(status, stype, sdata, slen);
+	else if (stype == JPEG_DQT)
+		return jpeg_process_quantization_table(status, stype, sdata, slen);
+	else if (stype == JPEG_DHT)
+		return jpeg_process_huffman_table(status, stype, sdata, slen);
+	else /* Unrecognized segment marker, just return without processing */
+		return 1;
+}
+
+static int jpeg_process_sof(JPEG_status *status, unsigned char stype, const unsigned char *sdata, int slen)
+{
+	int i, j, k;
+	if (slen < 6)
+		return 0;
+	slen -= 6;
+	EXTRACT_UINT8(sdata, status->P);
+	EXTRACT_UINT16_BIG(sdata, status->Y);
+	EXTRACT_UINT16_BIG(sdata, status->X);
+	EXTRACT_UINT8(sdata, status->Nf);
+	if (status->P != 8)
+		return 0;
+	if (status->Y == 0 || status->X == 0)
+		return 0;
+	if (status->Nf != 1 && status->Nf != 3) /* We only accept grayscale or YCbCr */
+		return 0;
+	if (slen != status->Nf * 3)
+		return 0;
+	for (i = 1; i <= status->Nf; i++)
+	{
+		EXTRACT_UINT8(sdata, k);
+		if (k != i) /* No non-standard mapping please */
+			return 0;
+		status->comp[i].valid = 1;
+		EXTRACT_UINT8(sdata, j);
+		status->comp[i].H = HIBYTE(j);
+		status->comp[i].V = LOBYTE(j);
+		if (status->comp[i].H == 0 || status->comp[i].H > 4 || status->comp[i].V == 0 || status->comp[i].V > 4)
+			return 0;
+		EXTRACT_UINT8(sdata, status->comp[i].Tq);
+		status->hmax = max(status->hmax, status->comp[i].H);
+		status->vmax = max(status->vmax, status->comp[i].V);
+	}
+	for (i = 1; i <= status->Nf; i++)
+	{
+		if (status->hmax % status->comp[i].H != 0 || status->vmax % status->comp[i].V != 0) /* 4:3 and 3:2 is Unsupported */
+			return 0;
+		status->comp[i].hs = status->hmax / status->comp[i].H;
+		status->comp[i].vs = status->vmax / status->comp[i].V;
+	}
+	status->vcnt = (status->Y + status->vmax * 8 - 1) / (status->vmax * 8);
+	status->hcnt = (status->X + status->hmax * 8 - 1) / (status->hmax * 8);
+	/* Allocate memory for components */
+	for (i = 1; i <= status->Nf; i++)
+	{
+		status->comp[i].linebytes = status->comp[i].H * status->hcnt * 8;
+		status->comp[i].lines = status->comp[i].V * status->vcnt * 8;
+		status->comp[i].raw = malloc(status->comp[i].linebytes * status->comp[i].lines);
+		if (!status->comp[i].raw)
+			return 0;
+	}
+	return 1;
+}
+
+static int jpeg_process_scan_header(JPEG_status *status, unsigned char stype, const unsigned char *sdata, int slen)
+{
+	int i, j;
+
+	if (slen < 4)
+		return 0;
+	slen -= 4;
+	EXTRACT_UINT8(sdata, status->Ns);
+	if (slen != status->Ns * 2)
+		return 0;
+	for (i = 1; i <= status->Ns; i++)
+	{
+		EXTRACT_UINT8(sdata, status->Cs[i]);
+		if (!status->comp[status->Cs[i]].valid)
+			return 0;
+		EXTRACT_UINT8(sdata, j);
+		status->Td[i] = HIBYTE(j);
+		status->Ta[i] = LOBYTE(j);
+		if (!status->hdc[status->Td[i]].valid || !status->hac[status->Ta[i]].valid)
+			return 0;
+	}
+	EXTRACT_UINT8(sdata, status->Ss);
+	EXTRACT_UINT8(sdata, status->Se);
+	EXTRACT_UINT8(sdata, j);
+	status->Ah = HIBYTE(j);
+	status->Al = LOBYTE(j);
+	/* These shall all be zero for sequential DCT process */
+	if (status->Ss != 0 || status->Se != 63 || status->Ah != 0 || status->Al != 0)
+		return 0;
+	return 1;
+}
+
+/* Decode MCUs m0 to m1 - 1 from br into the samples of the components
+ * pred holds the DC predictors of the scan components, zero at the start of
+ * a restart interval. The RSTn marker after the last MCU is skipped too,
+ * unless it ends the scan.
+ * If coefs is not NULL, the coefficients of the blocks are stored there in
+ * decoding order, 64 per block in natural order, with the counts returned by
+ * jpeg_decode_block in counts, instead of being transformed. coefs shall be
+ * zero on entry.
+ */
+static int jpeg_decode_mcus(JPEG_status *status, BIT_reader *br, const unsigned char *end, int m0, int m1, int *pred, short *coefs, unsigned char *counts)
+{
+	int i, j, k, c, g, n, m, mx, my;
+	short coef[64], *block;
+
+	memset(coef, 0, sizeof(coef));
+	block = coef;
+	i = m0 / status->hcnt;
+	j = m0 % status->hcnt;
+	for (m = m0; m < m1; m++)
+	{
+		/* Decode MCU */
+		for (k = 1; k <= status->Ns; k++)
+		{
+			c = status->Cs[k];
+			for (my = 0; my < status->comp[c].V; my++)
+				for (mx = 0; mx < status->comp[c].H; mx++)
+				{
+					/* Decode 8x8 block */
+					if (coefs)
+						block = coefs;
+					n = jpeg_decode_block(br, &status->hdc[status->Td[k]], &status->hac[status->Ta[k]], &pred[k], block);
+					if (n == 0)
+						return 0;
+					if (coefs)
+					{
+						coefs += 64;
+						*counts++ = (unsigned char) n;
+						continue;
+					}
+					/* Dequantization, IDCT and level shift */
+					jpeg_idct_block(coef, n, &status->qtable[status->comp[c].Tq],
+						status->comp[c].raw + (i * status->comp[c].V + my) * 8 * status->comp[c].linebytes + (j * status->comp[c].H + mx) * 8,
+						status->comp[c].linebytes);
+					/* Clear the coefficients written */
+					for (g = 0; g < n; g++)
+						coef[jpeg_natural[g]] = 0;
+				}
+		}
+		if (++j == status->hcnt)
+		{
+			j = 0;
+			i++;
+		}
+		if (status->Ri != 0 && ((m + 1) % status->Ri == 0) && m + 1 < status->hcnt * status->vcnt) /* Should occur a RST marker */
+		{
+			for (k = 1; k <= status->Ns; k++)
+				pred[k] = 0;
+			if (!jpeg_restart_bits(br, end))
+				return 0;
+		}
+	}
+	return 1;
+}
+
+static int jpeg_extract_scan(JPEG_status *status, const unsigned char **data, int *size)
+{
+	BIT_reader br;
+	const unsigned char *end;
+	int pred[JPEG_SCAN_COMPONENTS_COUNT];
+
+	init_bits(&br, *data, *size);
+	end = *data + *size;
+	memset(pred, 0, sizeof(pred));
+	if (!jpeg_decode_mcus(status, &br, end, 0, status->hcnt * status->vcnt, pred, NULL, NULL))
+		return 0;
+	*data = br.data;
+	*size = (int) (end - br.data);
+	return 1;
+}
+
+/* YCbCr -> RGB conversion
+ * Chroma offsets are scaled by 128 and multiplied by the constants with 13
+ * fractional bits, keeping the high 16 bits of the products, as
+ * _mm_mulhi_epi16 does. Y is scaled by 16 with the rounding bias, so the sums
+ * have 4 fractional bits and fit 16 bits. The portable and SSE2 conversions
+ * give identical results.
+ */
+#define JPEG_YCC_FIX(x)	((int) ((x) * 8192 + 0.5))
+#define JPEG_YCC_CR_R	JPEG_YCC_FIX(1.402)
+#define JPEG_YCC_CB_G	(-JPEG_YCC_FIX(0.34414))
+#define JPEG_YCC_CR_G	(-JPEG_YCC_FIX(0.71414))
+#define JPEG_YCC_CB_B	JPEG_YCC_FIX(1.772)
+
+/* Chroma upsampling of the color conversion rows
+ * JPEG_UPSAMPLE_H1: Cb and Cr have the width of Y
+ * JPEG_UPSAMPLE_H2: Cb and Cr have half the width, each sample is repeated
+ * JPEG_UPSAMPLE_H2_FANCY: Cb and Cr have half the width, and are interpolated
+ *   by a triangle filter from the nearest 2 samples
+ * JPEG_UPSAMPLE_H2V2_FANCY: As JPEG_UPSAMPLE_H2_FANCY from the nearest 2x2
+ *   samples, those of the far row weighted 1/4
+ * JPEG_UPSAMPLE_H1V2_FANCY: Cb and Cr have the width of Y, and are
+ *   interpolated vertically only, with the far row below
+ * JPEG_UPSAMPLE_H1V2_FANCY_UP: As JPEG_UPSAMPLE_H1V2_FANCY with the far row
+ *   above, which rounds down the other half
+ * Rounding of the triangle filters is as in libjpeg.
+ */
+#define JPEG_UPSAMPLE_H1			0
+#define JPEG_UPSAMPLE_H2			1
+#define JPEG_UPSAMPLE_H2_FANCY		2
+#define JPEG_UPSAMPLE_H2V2_FANCY	3
+#define JPEG_UPSAMPLE_H1V2_FANCY	4
+#define JPEG_UPSAMPLE_H1V2_FANCY_UP	5
+#define JPEG_H1V2_BIAS(mode)		((mode) == JPEG_UPSAMPLE_H1V2_FANCY_UP ? 1 : 2)
+
+static INLINE void jpeg_ycc_rgb(int y, int cb, int cr, unsigned char *out)
+{
+	cb = (cb - 128) * 128;
+	cr = (cr - 128) * 128;
+	y = y * 16 + 8;
+	out[0] = (unsigned char) color_clamp((y + ((cr * JPEG_YCC_CR_R) >> 16)) >> 4);
+	out[1] = (unsigned char) color_clamp((y + ((cb * JPEG_YCC_CB_G) >> 16) + ((cr * JPEG_YCC_CR_G) >> 16)) >> 4);
+	out[2] = (unsigned char) color_clamp((y + ((cb * JPEG_YCC_CB_B) >> 16)) >> 4);
+}
+
+/* Upsampled chroma at x of a row with cw samples, from the nearest chroma
+ * row c0 and the far row c1
+ */
+static FORCE_INLINE int jpeg_upsample_chroma(const unsigned char *c0, const unsigned char *c1, int x, int cw, int mode)
+{
+	int i, c, d;
+
+	if (mode == JPEG_UPSAMPLE_H1)
+		return c0[x];
+	if (mode == JPEG_UPSAMPLE_H2)
+		return c0[x >> 1];
+	if (mode == JPEG_UPSAMPLE_H1V2_FANCY || mode == JPEG_UPSAMPLE_H1V2_FANCY_UP)
+		return (c0[x] * 3 + c1[x] + JPEG_H1V2_BIAS(mode)) >> 2;
+	i = x >> 1;
+	c = c0[i] * 3 + c1[i];
+	if (x & 1)
+	{
+		i = i + 1 < cw ? i + 1 : i;
+		d = c0[i] * 3 + c1[i];
+		return (c * 3 + d + (mode == JPEG_UPSAMPLE_H2V2_FANCY ? 7 : 8)) >> 4;
+	}
+	i = i > 0 ? i - 1 : 0;
+	d = c0[i] * 3 + c1[i];
+	return (c * 3 + d + (mode == JPEG_UPSAMPLE_H2V2_FANCY ? 8 : 4)) >> 4;
+}
+
+static FORCE_INLINE void jpeg_convert_pixel(const unsigned char *y, const unsigned char *cb0, const unsigned char *cr0, const unsigned char *cb1, const unsigned char *cr1,
+	int x, int cw, unsigned char *out, int pixel_size, int mode)
+{
+	out += x * pixel_size;
+	jpeg_ycc_rgb(y[x], jpeg_upsample_chroma(cb0, cb1, x, cw, mode), jpeg_upsample_chroma(cr0, cr1, x, cw, mode), out);
+	if (pixel_size == 4)
+		out[3] = 0xFF;
+}
+
+#ifdef FLUID_SSE2
+/* Convert 8 pixels of 16-bit samples */
+static FORCE_INLINE void jpeg_ycc_rgb_sse2(__m128i y, __m128i cb, __m128i cr, __m128i *r, __m128i *g, __m128i *b)
+{
+	const __m128i bias = _mm_set1_epi16(128);
+
+	cb = _mm_slli_epi16(_mm_sub_epi16(cb, bias), 7);
+	cr = _mm_slli_epi16(_mm_sub_epi16(cr, bias), 7);
+	y = _mm_add_epi16(_mm_slli_epi16(y, 4), _mm_set1_epi16(8));
+	*r = _mm_srai_epi16(_mm_add_epi16(y, _mm_mulhi_epi16(cr, _mm_set1_epi16(JPEG_YCC_CR_R))), 4);
+	*g = _mm_srai_epi16(_mm_add_epi16(y, _mm_add_epi16(_mm_mulhi_epi16(cb, _mm_set1_epi16(JPEG_YCC_CB_G)), _mm_mulhi_epi16(cr, _mm_set1_epi16(JPEG_YCC_CR_G)))), 4);
+	*b = _mm_srai_epi16(_mm_add_epi16(y, _mm_mulhi_epi16(cb, _mm_set1_epi16(JPEG_YCC_CB_B))), 4);
+}
+
+/* 3 * c0 + c1 of 8 chroma samples */
+static FORCE_INLINE __m128i jpeg_chroma_sum_sse2(const unsigned char *c0, const unsigned char *c1)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i c;
+
+	c = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) c0), zero);
+	c = _mm_add_epi16(_mm_add_epi16(c, c), c);
+	return _mm_add_epi16(c, _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) c1), zero));
+}
+
+/* Upsampled chroma of 16 pixels from x, as 16-bit samples */
+static FORCE_INLINE void jpeg_upsample_chroma_sse2(const unsigned char *c0, const unsigned char *c1, int x, int mode, __m128i *lo, __m128i *hi)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i c, l, r;
+
+	if (mode == JPEG_UPSAMPLE_H1)
+	{
+		c = _mm_loadu_si128((const __m128i *) (c0 + x));
+		*lo = _mm_unpacklo_epi8(c, zero);
+		*hi = _mm_unpackhi_epi8(c, zero);
+	}
+	else if (mode == JPEG_UPSAMPLE_H2)
+	{
+		c = _mm_loadl_epi64((const __m128i *) (c0 + (x >> 1)));
+		c = _mm_unpacklo_epi8(c, c);
+		*lo = _mm_unpacklo_epi8(c, zero);
+		*hi = _mm_unpackhi_epi8(c, zero);
+	}
+	else if (mode == JPEG_UPSAMPLE_H1V2_FANCY || mode == JPEG_UPSAMPLE_H1V2_FANCY_UP)
+	{
+		c = _mm_loadu_si128((const __m128i *) (c0 + x));
+		r = _mm_loadu_si128((const __m128i *) (c1 + x));
+		l = _mm_unpacklo_epi8(c, zero);
+		*lo = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(_mm_add_epi16(l, l), l), _mm_add_epi16(_mm_unpacklo_epi8(r, zero), _mm_set1_epi16(JPEG_H1V2_BIAS(mode)))), 2);
+		l = _mm_unpackhi_epi8(c, zero);
+		*hi = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(_mm_add_epi16(l, l), l), _mm_add_epi16(_mm_unpackhi_epi8(r, zero), _mm_set1_epi16(JPEG_H1V2_BIAS(mode)))), 2);
+	}
+	else
+	{
+		/* 3 * c0 + c1 of chroma samples x / 2 - 1 to x / 2 + 8 */
+		x >>= 1;
+		l = jpeg_chroma_sum_sse2(c0 + x - 1, c1 + x - 1);
+		c = jpeg_chroma_sum_sse2(c0 + x, c1 + x);
+		r = jpeg_chroma_sum_sse2(c0 + x + 1, c1 + x + 1);
+		/* Even pixels from the left, odd pixels from the right neighbors */
+		c = _mm_add_epi16(_mm_add_epi16(c, c), c);
+		l = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(c, l), _mm_set1_epi16(mode == JPEG_UPSAMPLE_H2V2_FANCY ? 8 : 4)), 4);
+		r = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(c, r), _mm_set1_epi16(mode == JPEG_UPSAMPLE_H2V2_FANCY ? 7 : 8)), 4);
+		*lo = _mm_unpacklo_epi16(l, r);
+		*hi = _mm_unpackhi_epi16(l, r);
+	}
+}
+#endif
+
+/* Convert a row of n pixels to RGBA, or to RGB if pixel_size is 3
+ * cb0 and cr0 are the nearest chroma rows, with cw samples. The far rows cb1
+ * and cr1 are only used by fancy upsampling.
+ */
+static FORCE_INLINE void jpeg_convert_row_mode(const unsigned char *y, const unsigned char *cb0, const unsigned char *cr0, const unsigned char *cb1, const unsigned char *cr1,
+	int n, int cw, unsigned char *out, int pixel_size, int mode)
+{
+	int x = 0;
+#ifdef FLUID_SSE2
+	const __m128i zero = _mm_setzero_si128(), alpha = _mm_set1_epi8((char) 0xFF);
+	__m128i yl, yh, cbl, cbh, crl, crh, r0, g0, b0, r1, g1, b1, rg, ba;
+	unsigned char rgb[3][16];
+	int i, end = n;
+
+	if (mode == JPEG_UPSAMPLE_H2_FANCY || mode == JPEG_UPSAMPLE_H2V2_FANCY)
+	{
+		/* The neighbors of the first and last chroma samples are clamped */
+		for (; x < 2 && x < n; x++)
+			jpeg_convert_pixel(y, cb0, cr0, cb1, cr1, x, cw, out, pixel_size, mode);
+		end = cw * 2 - 2 < n ? cw * 2 - 2 : n;
+	}
+	for (; x + 16 <= end; x += 16)
+	{
+		yl = _mm_loadu_si128((const __m128i *) (y + x));
+		yh = _mm_unpackhi_epi8(yl, zero);
+		yl = _mm_unpacklo_epi8(yl, zero);
+		jpeg_upsample_chroma_sse2(cb0, cb1, x, mode, &cbl, &cbh);
+		jpeg_upsample_chroma_sse2(cr0, cr1, x, mode, &crl, &crh);
+		jpeg_ycc_rgb_sse2(yl, cbl, crl, &r0, &g0, &b0);
+		jpeg_ycc_rgb_sse2(yh, cbh, crh, &r1, &g1, &b1);
+		r0 = _mm_packus_epi16(r0, r1);
+		g0 = _mm_packus_epi16(g0, g1);
+		b0 = _mm_packus_epi16(b0, b1);
+		if (pixel_size == 4)
+		{
+			rg = _mm_unpacklo_epi8(r0, g0);
+			ba = _mm_unpacklo_epi8(b0, alpha);
+			_mm_storeu_si128((__m128i *) (out + x * 4), _mm_unpacklo_epi16(rg, ba));
+			_mm_storeu_si128((__m128i *) (out + x * 4 + 16), _mm_unpackhi_epi16(rg, ba));
+			rg = _mm_unpackhi_epi8(r0, g0);
+			ba = _mm_unpackhi_epi8(b0, alpha);
+			_mm_storeu_si128((__m128i *) (out + x * 4 + 32), _mm_unpacklo_epi16(rg, ba));
+			_mm_storeu_si128((__m128i *) (out + x * 4 + 48), _mm_unpackhi_epi16(rg, ba));
+		}
+		else
+		{
+			_mm_storeu_si128((__m128i *) rgb[0], r0);
+			_mm_storeu_si128((__m128i *) rgb[1], g0);
+			_mm_storeu_si128((__m128i *) rgb[2], b0);
+			for (i = 0; i < 16; i++)
+			{
+				out[(x + i) * 3] = rgb[0][i];
+				out[(x + i) * 3 + 1] = rgb[1][i];
+				out[(x + i) * 3 + 2] = rgb[2][i];
+			}
+		}
+	}
+#endif
+	for (; x < n; x++)
+		jpeg_convert_pixel(y, cb0, cr0, cb1, cr1, x, cw, out, pixel_size, mode);
+}
+
+static void jpeg_convert_row(const unsigned char *y, const unsigned char *cb0, const unsigned char *cr0, const unsigned char *cb1, const unsigned char *cr1,
+	int n, int cw, unsigned char *out, int pixel_size, int mode)
+{
+	if (mode == JPEG_UPSAMPLE_H1)
+		jpeg_convert_row_mode(y, cb0, cr0, cb1, cr1, n, cw, out, pixel_size, JPEG_UPSAMPLE_H1);
+	else if (mode == JPEG_UPSAMPLE_H2)
+		jpeg_convert_row_mode(y, cb0, cr0, cb1, cr1, n, cw, out, pixel_size, JPEG_UPSAMPLE_H2);
+	else if (mode == JPEG_UPSAMPLE_H2_FANCY)
+		jpeg_convert_row_mode(y, cb0, cr0, cb1, cr1, n, cw, out, pixel_size, JPEG_UPSAMPLE_H2_FANCY);
+	else if (mode == JPEG_UPSAMPLE_H2V2_FANCY)
+		jpeg_convert_row_mode(y, cb0, cr0, cb1, cr1, n, cw, out, pixel_size, JPEG_UPSAMPLE_H2V2_FANCY);
+	else if (mode == JPEG_UPSAMPLE_H1V2_FANCY)
+		jpeg_convert_row_mode(y, cb0, cr0, cb1, cr1, n, cw, out, pixel_size, JPEG_UPSAMPLE_H1V2_FANCY);
+	else
+		jpeg_convert_row_mode(y, cb0, cr0, cb1, cr1, n, cw, out, pixel_size, JPEG_UPSAMPLE_H1V2_FANCY_UP);
+}
+
+/* Expand a row of n gray samples to RGBA */
+static void jpeg_gray_row(const unsigned char *y, int n, unsigned char *out)
+{
+	int x = 0;
+#ifdef FLUID_SSE2
+	const __m128i alpha = _mm_set1_epi8((char) 0xFF);
+	__m128i g, gg, ga;
+
+	for (; x + 16 <= n; x += 16)
+	{
+		g = _mm_loadu_si128((const __m128i *) (y + x));
+		gg = _mm_unpacklo_epi8(g, g);
+		ga = _mm_unpacklo_epi8(g, alpha);
+		_mm_storeu_si128((__m128i *) (out + x * 4), _mm_unpacklo_epi16(gg, ga));
+		_mm_storeu_si128((__m128i *) (out + x * 4 + 16), _mm_unpackhi_epi16(gg, ga));
+		gg = _mm_unpackhi_epi8(g, g);
+		ga = _mm_unpackhi_epi8(g, alpha);
+		_mm_storeu_si128((__m128i *) (out + x * 4 + 32), _mm_unpacklo_epi16(gg, ga));
+		_mm_storeu_si128((__m128i *) (out + x * 4 + 48), _mm_unpackhi_epi16(gg, ga));
+	}
+#endif
+	for (; x < n; x++)
+	{
+		out[x * 4] = out[x * 4 + 1] = out[x * 4 + 2] = y[x];
+		out[x * 4 + 3] = 0xFF;
+	}
+}
+
+/* Repeat each of the samples hs times to fill a row of n samples */
+static void jpeg_replicate_row(const unsigned char *src, int hs, int n, unsigned char *dst)
+{
+	int x, k;
+
+	for (x = 0, k = 0; x < n; x++)
+	{
+		dst[x] = *src;
+		if (++k == hs)
+		{
+			k = 0;
+			src++;
+		}
+	}
+}
+
+/* Upsample and convert rows y0 to y1 - 1 of the image
+ * Chroma of Y at full resolution and Cb and Cr sampled alike at 1/2 or 1/1
+ * horizontally and vertically is upsampled while converting, interpolated if
+ * smooth. Other samplings are repeated into temporary rows of the width of
+ * the image first.
+ * Return: 0 if out of memory
+ */
+static int jpeg_convert_rows(const JPEG_status *status, int y0, int y1, int pixel_size, int smooth)
+{
+	const JPEG_component *cy = &status->comp[1], *cb = &status->comp[2], *cr = &status->comp[3];
+	const unsigned char *rows[3];
+	unsigned char *out, *tmp = NULL;
+	int i, k, row0, row1, ch, cw, mode, fused;
+
+	fused = cy->hs == 1 && cy->vs == 1 && cb->hs == cr->hs && cb->vs == cr->vs && cb->hs <= 2 && cb->vs <= 2;
+	if (status->Nf == 3 && !fused)
+	{
+		tmp = malloc(status->X * 3);
+		if (!tmp)
+			return 0;
+	}
+	for (i = y0; i < y1; i++)
+	{
+		out = status->image + i * status->X * pixel_size;
+		if (status->Nf == 1)
+		{
+			if (pixel_size == 1)
+				memcpy(out, cy->raw + cy->linebytes * i, status->X);
+			else
+				jpeg_gray_row(cy->raw + cy->linebytes * i, status->X, out);
+		}
+		else if (fused)
+		{
+			/* Rows of chroma samples within the image, with the nearest first */
+			ch = (status->Y + cb->vs - 1) / cb->vs;
+			cw = (status->X + cb->hs - 1) / cb->hs;
+			row0 = row1 = i / cb->vs;
+			if (smooth && cb->vs == 2)
+				row1 = i & 1 ? (row0 + 1 < ch ? row0 + 1 : row0) : (row0 > 0 ? row0 - 1 : 0);
+			if (!smooth)
+				mode = cb->hs == 1 ? JPEG_UPSAMPLE_H1 : JPEG_UPSAMPLE_H2;
+			else if (cb->hs == 1)
+				mode = cb->vs == 1 ? JPEG_UPSAMPLE_H1 : i & 1 ? JPEG_UPSAMPLE_H1V2_FANCY : JPEG_UPSAMPLE_H1V2_FANCY_UP;
 			else
+				mode = cb->vs == 1 ? JPEG_UPSAMPLE_H2_FANCY : JPEG_UPSAMPLE_H2V2_FANCY;
+			jpeg_convert_row(cy->raw + cy->linebytes * i, cb->raw + cb->linebytes * row0, cr->raw + cr->linebytes * row0,
+				cb->raw + cb->linebytes * row1, cr->raw + cr->linebytes * row1, status->X, cw, out, pixel_size, mode);
+		}
+		else
+		{
+			for (k = 0; k < 3; k++)
 			{
-				huffman->hmin[i] = j;
-				huffman->hmax[i] = j + huffman->L[i] - 1;
-				if (huffman->hmax[i] >= (1 << i))
-					return 0;
-				j += huffman->L[i];
+				rows[k] = status->comp[k + 1].raw + status->comp[k + 1].linebytes * (i / status->comp[k + 1].vs);
+				if (status->comp[k + 1].hs != 1)
+				{
+					jpeg_replicate_row(rows[k], status->comp[k + 1].hs, status->X, tmp + status->X * k);
+					rows[k] = tmp + status->X * k;
+				}
 			}
-			j <<= 1;
+			jpeg_convert_row(rows[0], rows[1], rows[2], rows[1], rows[2], status->X, status->X, out, pixel_size, JPEG_UPSAMPLE_H1);
 		}
 	}
+	if (tmp)
+		free(tmp);
 	return 1;
 }
 
-static int jpeg_extract_huffman_code(JPEG_huffman_table *huffman, const unsigned char **data, int *bit, int *size, unsigned char *code)
+/* Parallel decoding of restart intervals
+ * The entropy-coded data is searched for RSTn markers, which give the start
+ * of every restart interval. The image is cut into bands of MCU rows which
+ * start restart intervals, and each band is decoded, transformed and
+ * converted by one thread. When chroma is smoothed, the rows next to other
+ * bands are converted once all bands are done.
+ */
+#ifndef JPEG_PARALLEL_MIN_SIZE
+#define JPEG_PARALLEL_MIN_SIZE	(1 << 18) /* Pixels to start using threads */
+#endif
+#define JPEG_BANDS_PER_THREAD	4
+
+typedef struct
+{
+	JPEG_status *status;
+	const unsigned char **interval; /* Start of each restart interval */
+	const unsigned char *end;
+	int *band; /* First MCU row of each band, followed by vcnt */
+	int *band_ok;
+	int count;
+	int pixel_size, smooth;
+} JPEG_parallel;
+
+/* Find the start of count restart intervals from data
+ * Return: 0 if another marker or the end of data comes first
+ */
+static int jpeg_find_intervals(const unsigned char *data, const unsigned char *end, const unsigned char **interval, int count)
 {
-	int i, j, k;
+	int n;
 
-	j = 0;
-	for (i = 1; i <= 16; i++)
+	interval[0] = data;
+	for (n = 1; n < count; )
 	{
-		if (!jpeg_extract_bits(data, bit, size, 1, &k))
+		data = memchr(data, 0xFF, end - data);
+		if (!data || end - data < 2)
 			return 0;
-		j = (j << 1) | k;
-		if (j >= huffman->hmin[i] && j <= huffman->hmax[i])
+		if (data[1] >= JPEG_RST0 && data[1] <= JPEG_RST7)
 		{
-			*code = huffman->V[i][j - huffman->hmin[i]];
-			return 1;
+			data += 2;
+			interval[n++] = data;
 		}
+		else if (data[1] == 0x00) /* Stuffed byte */
+			data += 2;
+		else if (data[1] == 0xFF) /* Fill byte */
+			data++;
+		else
+			return 0;
 	}
-	return 0;
+	return 1;
 }
 
-static int jpeg_process_segment(JPEG_status *status, unsigned char stype, const unsigned char *sdata, int slen)
+static void jpeg_process_band(void *context, int index)
 {
-	if (stype == JPEG_DRI)
-		return jpeg_process_restart_interval(status, stype, sdata, slen);
-	else if (stype == JPEG_DQT)
-		return jpeg_process_quantization_table(status, stype, sdata, slen);
-	else if (stype == JPEG_DHT)
-		return jpeg_process_huffman_table(status, stype, sdata, slen);
-	else /* Unrecognized segment marker, just return without processing */
-		return 1;
+	JPEG_parallel *par = (JPEG_parallel *) context;
+	JPEG_status *status = par->status;
+	BIT_reader br;
+	const unsigned char *data;
+	int m0, m1, y0, y1;
+	int pred[JPEG_SCAN_COMPONENTS_COUNT];
+
+	par->band_ok[index] = 0;
+	m0 = par->band[index] * status->hcnt;
+	m1 = par->band[index + 1] * status->hcnt;
+	data = par->interval[m0 / status->Ri];
+	init_bits(&br, data, (int) (par->end - data));
+	memset(pred, 0, sizeof(pred));
+	if (!jpeg_decode_mcus(status, &br, par->end, m0, m1, pred, NULL, NULL))
+		return;
+	y0 = par->band[index] * status->vmax * 8;
+	y1 = par->band[index + 1] * status->vmax * 8;
+	if (y1 > status->Y)
+		y1 = status->Y;
+	if (par->smooth && index > 0)
+		y0++;
+	if (par->smooth && index + 1 < par->count)
+		y1--;
+	par->band_ok[index] = jpeg_convert_rows(status, y0, y1, par->pixel_size, par->smooth);
 }
 
-static int jpeg_process_sof(JPEG_status *status, unsigned char stype, const unsigned char *sdata, int slen)
+/* Decode the scan of data into the image with threads
+ * Return: 0 if failed, so decoding can be retried without threads
+ */
+static int jpeg_decode_parallel(JPEG_status *status, const unsigned char *data, int size, int pixel_size, int smooth, int threads)
 {
-	int i, j, k;
-	if (slen < 6)
-		return 0;
-	slen -= 6;
-	EXTRACT_UINT8(sdata, status->P);
-	EXTRACT_UINT16_BIG(sdata, status->Y);
-	EXTRACT_UINT16_BIG(sdata, status->X);
-	EXTRACT_UINT8(sdata, status->Nf);
-	if (status->P != 8)
-		return 0;
-	if (status->Y == 0 || status->X == 0)
-		return 0;
-	if (status->Nf != 1 && status->Nf != 3) /* We only accept grayscale or YCbCr */
-		return 0;
-	if (slen != status->Nf * 3)
+	JPEG_parallel par;
+	int i, step, rows, intervals, ok;
+
+	if (threads > THREAD_MAX_COUNT)
+		threads = THREAD_MAX_COUNT;
+	/* Bands start at multiples of step MCU rows, which start intervals */
+	for (step = 1; step * status->hcnt % status->Ri != 0; step++)
+		;
+	rows = (status->vcnt + threads * JPEG_BANDS_PER_THREAD - 1) / (threads * JPEG_BANDS_PER_THREAD);
+	rows = (rows + step - 1) / step * step;
+	memset(&par, 0, sizeof(par));
+	par.count = (status->vcnt + rows - 1) / rows;
+	if (par.count < 2)
 		return 0;
-	for (i = 1; i <= status->Nf; i++)
-	{
-		EXTRACT_UINT8(sdata, k);
-		if (k != i) /* No non-standard mapping please */
-			return 0;
-		status->comp[i].valid = 1;
-		EXTRACT_UINT8(sdata, j);
-		status->comp[i].H = HIBYTE(j);
-		status->comp[i].V = LOBYTE(j);
-		if (status->comp[i].H == 0 || status->comp[i].H > 4 || status->comp[i].V == 0 || status->comp[i].V > 4)
-			return 0;
-		EXTRACT_UINT8(sdata, status->comp[i].Tq);
-		status->hmax = max(status->hmax, status->comp[i].H);
-		status->vmax = max(status->vmax, status->comp[i].V);
-	}
-	for (i = 1; i <= status->Nf; i++)
-	{
-		if (status->hmax % status->comp[i].H != 0 || status->vmax % status->comp[i].V != 0) /* 4:3 and 3:2 is Unsupported */
-			return 0;
-		status->comp[i].hs = status->hmax / status->comp[i].H;
-		status->comp[i].vs = status->vmax / status->comp[i].V;
-	}
-	status->vcnt = (status->Y + status->vmax * 8 - 1) / (status->vmax * 8);
-	status->hcnt = (status->X + status->hmax * 8 - 1) / (status->hmax * 8);
-	/* Allocate memory for components */
-	for (i = 1; i <= status->Nf; i++)
-	{
-		status->comp[i].linebytes = status->comp[i].H * status->hcnt * 8;
-		status->comp[i].lines = status->comp[i].V * status->vcnt * 8;
-		status->comp[i].raw = malloc(status->comp[i].linebytes * status->comp[i].lines);
-		if (!status->comp[i].raw)
-			return 0;
-	}
-	return 1;
+	par.status = status;
+	par.end = data + size;
+	par.pixel_size = pixel_size;
+	par.smooth = smooth;
+	intervals = (status->hcnt * status->vcnt + status->Ri - 1) / status->Ri;
+	par.interval = malloc(intervals * sizeof(const unsigned char *));
+	par.band = malloc((par.count + 1) * sizeof(int));
+	par.band_ok = malloc(par.count * sizeof(int));
+	ok = 0;
+	if (!par.interval || !par.band || !par.band_ok)
+		goto FINISH;
+	if (!jpeg_find_intervals(data, par.end, par.interval, intervals))
+		goto FINISH;
+	for (i = 0; i < par.count; i++)
+		par.band[i] = i * rows;
+	par.band[par.count] = status->vcnt;
+	run_tasks(jpeg_process_band, &par, par.count, threads);
+	ok = 1;
+	for (i = 0; i < par.count; i++)
+		ok &= par.band_ok[i];
+	/* Rows between bands */
+	for (i = 1; ok && smooth && i < par.count; i++)
+		ok = jpeg_convert_rows(status, par.band[i] * status->vmax * 8 - 1, par.band[i] * status->vmax * 8 + 1, pixel_size, smooth);
+FINISH:
+	if (par.interval)
+		free((void *) par.interval);
+	if (par.band)
+		free(par.band);
+	if (par.band_ok)
+		free(par.band_ok);
+	return ok;
 }
 
-/* The EXTEND procedure in JPEG specification */
-static INLINE int jpeg_extend(int raw, int t)
+/* Pipelined decoding of scans without restart intervals
+ * Entropy decoding is serial, so one thread decodes the coefficients of each
+ * MCU row into a ring of slots, from which all threads take rows to
+ * dequantize, transform and convert. Slots are handed over through atomic
+ * counters without locks. While the ring is full, the decoding thread takes
+ * rows too, so it never waits for threads which may not run.
+ * When chroma is smoothed vertically, the rows next to another MCU row are
+ * converted by the thread which finishes the later of the two.
+ */
+#define JPEG_PIPELINE_SLOTS_PER_THREAD	2
+
+typedef struct
 {
-	int Vt;
-	
-	Vt = 1 << (t - 1);
-	if (raw < Vt)
-		return raw + ((-1) << t) + 1;
-	else
-		return raw;
-}
+	JPEG_status *status;
+	const unsigned char *data, *end;
+	int slots, blocks; /* Blocks per MCU row */
+	short *coefs; /* Coefficients of the blocks in each slot */
+	unsigned char *counts;
+	int *ready; /* MCU row + 1 decoded into each slot, 0 if free */
+	int *edge; /* MCU rows done next to each MCU row boundary */
+	int claimed; /* MCU rows taken */
+	int failed;
+	int pixel_size, smooth, halo;
+} JPEG_pipeline;
 
-/* TODO: Optimization */
-static const double pi = 3.1415926535897932384626433832795028841971693993751;
-static void jpeg_idct(int *src)
+/* Dequantize and transform MCU row i from the blocks stored by
+ * jpeg_decode_mcus, and clear their coefficients
+ */
+static void jpeg_transform_row(JPEG_status *status, int i, short *coefs, const unsigned char *counts)
 {
-	int S[64];
-	int x, y, u, v;
-	double ans, cu, cv;
+	int j, k, c, g, mx, my;
 
-	memcpy(S, src, 64 * sizeof(int));
-	for (y = 0; y < 8; y++)
-		for (x = 0; x < 8; x++)
+	for (j = 0; j < status->hcnt; j++)
+		for (k = 1; k <= status->Ns; k++)
 		{
-			ans = 0;
-			for (v = 0; v < 8; v++)
-				for (u = 0; u < 8; u++)
+			c = status->Cs[k];
+			for (my = 0; my < status->comp[c].V; my++)
+				for (mx = 0; mx < status->comp[c].H; mx++)
 				{
-					cv = (v == 0) ? 1.0 / sqrt(2) : 1;
-					cu = (u == 0) ? 1.0 / sqrt(2) : 1;
-					ans += cv * cu * S[v * 8 + u] * cos((2 * x + 1) * u * pi / 16) * cos((2 * y + 1) * v * pi / 16);
+					jpeg_idct_block(coefs, *counts, &status->qtable[status->comp[c].Tq],
+						status->comp[c].raw + (i * status->comp[c].V + my) * 8 * status->comp[c].linebytes + (j * status->comp[c].H + mx) * 8,
+						status->comp[c].linebytes);
+					for (g = 0; g < *counts; g++)
+						coefs[jpeg_natural[g]] = 0;
+					coefs += 64;
+					counts++;
 				}
-			src[y * 8 + x] = (int)(ans / 4);
 		}
 }
 
-static const int jpeg_zigzag[8][8] = {
-	{  0,  1,  5,  6, 14, 15, 27, 28 },
-	{  2,  4,  7, 13, 16, 26, 29, 42 },
-	{  3,  8, 12, 17, 25, 30, 41, 43 },
-	{  9, 11, 18, 24, 31, 40, 44, 53 },
-	{ 10, 19, 23, 32, 39, 45, 52, 54 },
-	{ 20, 22, 33, 38, 46, 51, 55, 60 },
-	{ 21, 34, 37, 47, 50, 56, 59, 61 },
-	{ 35, 36, 48, 49, 57, 58, 62, 63 },
-};
-static int jpeg_process_scan_header(JPEG_status *status, unsigned char stype, const unsigned char *sdata, int slen)
+/* Transform and convert the next MCU row if it is decoded
+ * Return: 1 if the row was taken, by this or another thread, 0 if it is not
+ * decoded yet, -1 if all rows are taken or decoding failed
+ */
+static int jpeg_pipeline_step(JPEG_pipeline *pipe)
 {
-	int i, j;
+	JPEG_status *status = pipe->status;
+	int i, s, y0, y1, rows, ok;
 
-	if (slen < 4)
-		return 0;
-	slen -= 4;
-	EXTRACT_UINT8(sdata, status->Ns);
-	if (slen != status->Ns * 2)
-		return 0;
-	for (i = 1; i <= status->Ns; i++)
-	{
-		EXTRACT_UINT8(sdata, status->Cs[i]);
-		if (!status->comp[status->Cs[i]].valid)
-			return 0;
-		EXTRACT_UINT8(sdata, j);
-		status->Td[i] = HIBYTE(j);
-		status->Ta[i] = LOBYTE(j);
-		if (!status->hdc[status->Td[i]].valid || !status->hac[status->Ta[i]].valid)
-			return 0;
-	}
-	EXTRACT_UINT8(sdata, status->Ss);
-	EXTRACT_UINT8(sdata, status->Se);
-	EXTRACT_UINT8(sdata, j);
-	status->Ah = HIBYTE(j);
-	status->Al = LOBYTE(j);
-	/* These shall all be zero for sequential DCT process */
-	if (status->Ss != 0 || status->Se != 63 || status->Ah != 0 || status->Al != 0)
+	i = ATOMIC_LOAD(&pipe->claimed);
+	if (i >= status->vcnt || ATOMIC_LOAD(&pipe->failed))
+		return -1;
+	s = i % pipe->slots;
+	if (ATOMIC_LOAD(&pipe->ready[s]) != i + 1)
 		return 0;
+	if (!ATOMIC_CAS(&pipe->claimed, i, i + 1))
+		return 1;
+	jpeg_transform_row(status, i, pipe->coefs + (size_t) s * pipe->blocks * 64, pipe->counts + s * pipe->blocks);
+	ATOMIC_STORE(&pipe->ready[s], 0);
+	rows = status->vmax * 8;
+	y0 = i * rows;
+	y1 = y0 + rows < status->Y ? y0 + rows : status->Y;
+	if (pipe->halo && i > 0)
+		y0++;
+	if (pipe->halo && i + 1 < status->vcnt)
+		y1--;
+	ok = jpeg_convert_rows(status, y0, y1, pipe->pixel_size, pipe->smooth);
+	/* Rows next to the other MCU rows, once both are transformed */
+	if (pipe->halo && i > 0 && ATOMIC_FETCH_INC(&pipe->edge[i]) == 1)
+		ok &= jpeg_convert_rows(status, i * rows - 1, i * rows + 1, pipe->pixel_size, pipe->smooth);
+	if (pipe->halo && i + 1 < status->vcnt && ATOMIC_FETCH_INC(&pipe->edge[i + 1]) == 1)
+		ok &= jpeg_convert_rows(status, (i + 1) * rows - 1, (i + 1) * rows + 1, pipe->pixel_size, pipe->smooth);
+	if (!ok)
+		ATOMIC_STORE(&pipe->failed, 1);
 	return 1;
 }
 
-static int jpeg_extract_scan(JPEG_status *status, const unsigned char **data, int *size)
+/* Decode the coefficients of all MCU rows into the slots */
+static void jpeg_pipeline_decode(JPEG_pipeline *pipe)
 {
-	int i, j, k, c, g, mx, my, x, y, X, Y;
-	int mcucnt, mcutotal;
-	int bit;
-	unsigned char t, rs, r, s;
-	int raw[64], co[64], tmp;
-	/* Extents of MCU */
-	mcutotal = status->hcnt * status->vcnt;
-	mcucnt = 0;
-	bit = 0;
+	JPEG_status *status = pipe->status;
+	BIT_reader br;
+	int i, s;
+	int pred[JPEG_SCAN_COMPONENTS_COUNT];
 
-	for (k = 1; k <= status->Ns; k++)
-		status->pred[k] = 0;
+	init_bits(&br, pipe->data, (int) (pipe->end - pipe->data));
+	memset(pred, 0, sizeof(pred));
 	for (i = 0; i < status->vcnt; i++)
-		for (j = 0; j < status->hcnt; j++)
+	{
+		/* The slot is free once row i - slots is transformed */
+		s = i % pipe->slots;
+		while (ATOMIC_LOAD(&pipe->ready[s]) != 0)
 		{
-			/* Decode MCU */
-			for (k = 1; k <= status->Ns; k++)
-			{
-				c = status->Cs[k];
-				for (my = 0; my < status->comp[c].V; my++)
-					for (mx = 0; mx < status->comp[c].H; mx++)
-					{
-						/* Decode 8x8 block */
-						/* Read data in */
-						if (!jpeg_extract_huffman_code(&status->hdc[status->Td[k]], data, &bit, size, &t))
-							return 0;
-						if (t > 16)
-							return 0;
-						if (!jpeg_extract_bits(data, &bit, size, t, &tmp))
-							return 0;
-						status->pred[k] += t ? jpeg_extend(tmp, t) : 0;
-						raw[0] = status->pred[k];
-						for (g = 1; g <= 63; g++)
-							raw[g] = 0;
-						for (g = 1;;)
-						{
-							if (!jpeg_extract_huffman_code(&status->hac[status->Ta[k]], data, &bit, size, &rs))
-								return 0;
-							r = HIBYTE(rs);
-							s = LOBYTE(rs);
-							if (s == 0)
-							{
-								if (r != 15)
-									break;
-								g += 16;
-								if (g > 63)
-									return 0;
-							}
-							else
-							{
-								g += r;
-								if (g > 63)
-									return 0;
-								if (!jpeg_extract_bits(data, &bit, size, s, &tmp))
-									return 0;
-								raw[g] = s ? jpeg_extend(tmp, s) : 0;
-								if (g == 63)
-									break;
-								g++;
-							}
-						}
-						/* Dequantization and de-zigzag */
-						for (y = 0; y < 8; y++)
-							for (x = 0; x < 8; x++)
-							{
-								g = jpeg_zigzag[y][x];
-								co[y * 8 + x] = raw[g] * status->qtable[status->comp[c].Tq].Qk[g];
-							}
-						/* IDCT */
-						jpeg_idct(co);
-						/* Write data */
-						for (y = 0; y < 8; y++)
-							for (x = 0; x < 8; x++)
-							{
-								Y = (i * status->comp[c].V + my) * 8 + y;
-								X = (j * status->comp[c].H + mx) * 8 + x;
-								status->comp[c].raw[status->comp[c].linebytes * Y + X] = color_clamp(co[y * 8 + x] + 128);
-							}
-					}
-			}
-			mcucnt++;
-			if (status->Ri != 0 && (mcucnt % status->Ri == 0) && mcucnt < mcutotal) /* Should occur a RST marker */
-			{
-				for (k = 1; k <= status->Ns; k++)
-					status->pred[k] = 0;
-				/* Skip remaining bits in current byte */
-				if (bit > 0)
-					(*data)++, bit = 0, (*size)--;
-				if (*size < 2)
-					return 0;
-				if (**data != 0xFF)
-					return 0;
-				(*data)++, (*size)--;
-				if (**data < JPEG_RST0 || **data > JPEG_RST7)
-					return 0;
-				(*data)++, (*size)--;
-			}
+			if (ATOMIC_LOAD(&pipe->failed))
+				return;
+			if (jpeg_pipeline_step(pipe) == 0)
+				THREAD_YIELD();
 		}
+		if (!jpeg_decode_mcus(status, &br, pipe->end, i * status->hcnt, (i + 1) * status->hcnt, pred,
+			pipe->coefs + (size_t) s * pipe->blocks * 64, pipe->counts + s * pipe->blocks))
+		{
+			ATOMIC_STORE(&pipe->failed, 1);
+			return;
+		}
+		ATOMIC_STORE(&pipe->ready[s], i + 1);
+	}
+}
 
-	return 1;
+static void jpeg_pipeline_task(void *context, int index)
+{
+	JPEG_pipeline *pipe = (JPEG_pipeline *) context;
+	int k;
+
+	if (index == 0)
+		jpeg_pipeline_decode(pipe);
+	while ((k = jpeg_pipeline_step(pipe)) >= 0)
+		if (k == 0)
+			THREAD_YIELD();
+}
+
+/* Decode the scan of data into the image with a pipeline of threads
+ * Return: 0 if failed, so decoding can be retried without threads
+ */
+static int jpeg_decode_pipelined(JPEG_status *status, const unsigned char *data, int size, int pixel_size, int smooth, int threads)
+{
+	JPEG_pipeline pipe;
+	int k, ok;
+
+	if (threads > THREAD_MAX_COUNT)
+		threads = THREAD_MAX_COUNT;
+	memset(&pipe, 0, sizeof(pipe));
+	pipe.status = status;
+	pipe.data = data;
+	pipe.end = data + size;
+	pipe.pixel_size = pixel_size;
+	pipe.smooth = smooth;
+	pipe.halo = smooth && status->vmax > 1;
+	for (k = 1; k <= status->Ns; k++)
+		pipe.blocks += status->comp[status->Cs[k]].H * status->comp[status->Cs[k]].V;
+	pipe.blocks *= status->hcnt;
+	pipe.slots = threads * JPEG_PIPELINE_SLOTS_PER_THREAD;
+	if (pipe.slots > status->vcnt)
+		pipe.slots = status->vcnt;
+	pipe.coefs = calloc((size_t) pipe.slots * pipe.blocks * 64, sizeof(short));
+	pipe.counts = malloc(pipe.slots * pipe.blocks);
+	pipe.ready = calloc(pipe.slots, sizeof(int));
+	pipe.edge = calloc(status->vcnt + 1, sizeof(int));
+	ok = 0;
+	if (!pipe.coefs || !pipe.counts || !pipe.ready || !pipe.edge)
+		goto FINISH;
+	run_tasks(jpeg_pipeline_task, &pipe, threads, threads);
+	ok = !pipe.failed && pipe.claimed == status->vcnt;
+FINISH:
+	if (pipe.coefs)
+		free(pipe.coefs);
+	if (pipe.counts)
+		free(pipe.counts);
+	if (pipe.ready)
+		free(pipe.ready);
+	if (pipe.edge)
+		free(pipe.edge);
+	return ok;
 }
 
-static char *jpeg_decode(const unsigned char *data, int size, int *width, int *height)
+/* Decode to RGBA, or to gray or RGB samples if native */
+static char *jpeg_decode(const unsigned char *data, int size, int *width, int *height, const FLUID_options *options)
 {
 	unsigned char stype;
 	const unsigned char *sdata;
 	int slen;
 	JPEG_status status;
-	int i, j, k;
-	int Y, Cb, Cr;
+	int i, pixel_size, parallel;
 
 	memset(&status, 0, sizeof(JPEG_status));
 
@@ -1430,43 +6097,28 @@ static char *jpeg_decode(const unsigned char *data, int size, int *width, int *h
 	}
 	if (!jpeg_process_scan_header(&status, stype, sdata, slen))
 		goto FINISH;
-	if (!jpeg_extract_scan(&status, &data, &size))
-		goto FINISH;
 
-	status.image = malloc(status.Y * status.X * 4);
+	pixel_size = options->native ? status.Nf : 4;
+	status.image = malloc(status.Y * status.X * pixel_size);
 	if (!status.image)
 		goto FINISH;
+	parallel = options->threads > 1 && (int64_t) status.X * status.Y >= JPEG_PARALLEL_MIN_SIZE;
+	if (parallel && status.Ri != 0)
+		parallel = jpeg_decode_parallel(&status, data, size, pixel_size, options->smooth, options->threads);
+	else if (parallel)
+		parallel = jpeg_decode_pipelined(&status, data, size, pixel_size, options->smooth, options->threads);
+	if (!parallel)
+	{
+		if (!jpeg_extract_scan(&status, &data, &size) || !jpeg_convert_rows(&status, 0, status.Y, pixel_size, options->smooth))
+		{
+			free(status.image);
+			status.image = NULL;
+			goto FINISH;
+		}
+	}
 	*width = status.X;
 	*height = status.Y;
 
-	if (status.Nf == 1)
-	{
-		for (i = 0; i < status.Y; i++)
-			for (j = 0; j < status.X; j++)
-			{
-				k = (i * status.X + j) * 4;
-				status.image[k] = status.image[k + 1] = status.image[k + 2] = status.comp[1].raw[status.comp[1].linebytes * i + j];
-				status.image[k + 3] = 0xFF;
-			}
-	}
-	else /* Nf == 3 */
-	{
-		/* Resample and YCbCr -> RGB */
-		for (i = 0; i < status.Y; i++)
-			for (j = 0; j < status.X; j++)
-			{
-				k = (i * status.X + j) * 4;
-				Y = status.comp[1].raw[(i / status.comp[1].vs) * status.comp[1].linebytes + j / status.comp[1].hs];
-				Cb = status.comp[2].raw[(i / status.comp[2].vs) * status.comp[2].linebytes + j / status.comp[2].hs];
-				Cr = status.comp[3].raw[(i / status.comp[3].vs) * status.comp[3].linebytes + j / status.comp[3].hs];
-
-				status.image[k + 0] = color_clamp((int)(Y + 1.402 * (Cr - 128)));
-				status.image[k + 1] = color_clamp((int)(Y - 0.34414 * (Cb - 128) - 0.71414 * (Cr - 128)));
-				status.image[k + 2] = color_clamp((int)(Y + 1.772 * (Cb - 128)));
-				status.image[k + 3] = 255;
-			}
-	}
-	
 FINISH:
 	for (i = 0; i < JPEG_COMPONENTS_COUNT; i++)
 		if (status.comp[i].raw)
@@ -1474,6 +6126,36 @@ FINISH:
 	return status.image;
 }
 
+/* Read frame header of any SOFn segment, without decoding tables */
+static int jpeg_info(const unsigned char *data, int size, FLUID_info *info)
+{
+	unsigned char stype;
+	const unsigned char *sdata;
+	int slen;
+
+	if (!jpeg_extract_segment(&data, &size, &stype, &sdata, &slen) || stype != JPEG_SOI)
+		return 0;
+	for (;;)
+	{
+		if (!jpeg_extract_segment(&data, &size, &stype, &sdata, &slen) || stype == JPEG_SOS || stype == JPEG_EOI)
+			return 0;
+		if (stype >= JPEG_SOF0 && stype <= JPEG_SOF15 && stype != JPEG_DHT && stype != JPEG_JPG && stype != JPEG_DAC)
+			break;
+	}
+	if (slen < 6)
+		return 0;
+	EXTRACT_UINT8(sdata, info->depth);
+	EXTRACT_UINT16_BIG(sdata, info->height);
+	EXTRACT_UINT16_BIG(sdata, info->width);
+	EXTRACT_UINT8(sdata, info->channels);
+	if (info->height == 0 || info->width == 0 || info->channels == 0) /* Height defined by DNL is unsupported */
+		return 0;
+	info->format = FLUID_FORMAT_JPEG;
+	info->interlaced = stype == JPEG_SOF2 || stype == JPEG_SOF6 || stype == JPEG_SOF10 || stype == JPEG_SOF14;
+	info->layout = info->channels == 1 ? FLUID_LAYOUT_G8 : FLUID_LAYOUT_RGB8;
+	return 1;
+}
+
 /* PSD Decoder */
 #define PSD_BITMAP		0
 #define PSD_GRAYSCALE	1
@@ -1493,27 +6175,47 @@ typedef struct
 	unsigned char *image;
 } PSD_status;
 
-static char *psd_decode(const unsigned char *data, int size, int *width, int *height)
+/* Read file header */
+static int psd_read_header(PSD_status *status, const unsigned char *data, int size)
+{
+	int version;
+
+	if (size < 22)
+		return 0;
+	EXTRACT_UINT16_BIG(data, version);
+	if (version != 1)
+		return 0;
+	data += 6; /* Reserved */
+	EXTRACT_UINT16_BIG(data, status->channels);
+	EXTRACT_UINT32_BIG(data, status->height);
+	EXTRACT_UINT32_BIG(data, status->width);
+	EXTRACT_UINT16_BIG(data, status->depth);
+	EXTRACT_UINT16_BIG(data, status->color_mode);
+	return 1;
+}
+
+/* Layout of RGB samples, 16-bit ones are kept and others are rescaled to
+ * 8-bit
+ */
+static int psd_native_layout(const PSD_status *status)
+{
+	return status->depth == 16 ? FLUID_LAYOUT_RGB16 : FLUID_LAYOUT_RGB8;
+}
+
+/* Decode to RGBA, or to the layout of psd_native_layout if native */
+static char *psd_decode(const unsigned char *data, int size, int *width, int *height, int native)
 {
-	int i, j, k, c, bit, expected_size;
+	int i, j, k, c, expected_size, pixel_size;
+	uint16_t sample;
+	BIT_reader br;
 	PSD_status status;
 
 	memset(&status, 0, sizeof(PSD_status));
 
-	if (size < 16)
-		return 0;
-	
-	/* File header */
-	EXTRACT_UINT16_BIG(data, k); /* Version */
-	if (k != 1)
+	if (!psd_read_header(&status, data, size))
 		return 0;
-	data += 6; /* Reserved */
-	EXTRACT_UINT16_BIG(data, status.channels);
-	EXTRACT_UINT32_BIG(data, status.height);
-	EXTRACT_UINT32_BIG(data, status.width);
-	EXTRACT_UINT16_BIG(data, status.depth);
-	EXTRACT_UINT16_BIG(data, status.color_mode);
-	size -= 16;
+	data += 22;
+	size -= 22;
 
 	*width = status.width;
 	*height = status.height;
@@ -1560,7 +6262,8 @@ static char *psd_decode(const unsigned char *data, int size, int *width, int *he
 	EXTRACT_UINT16_BIG(data, status.compression_method);
 	size -= 2;
 
-	status.image = malloc(status.width * status.height * 4);
+	pixel_size = native ? layout_pixel_size[psd_native_layout(&status)] : 4;
+	status.image = malloc(status.width * status.height * pixel_size);
 	if (!status.image)
 		goto FINISH;
 	if (status.compression_method == 0)
@@ -1575,15 +6278,21 @@ static char *psd_decode(const unsigned char *data, int size, int *width, int *he
 			free(status.image);
 			goto FINISH;
 		}
-		bit = 0;
+		init_bits(&br, data, expected_size);
 		for (c = 0; c < status.channels; c++)
 			for (i = 0; i < status.height; i++)
 				for (j = 0; j < status.width; j++)
 				{
-					k = (i * status.width + j) * 4;
-					status.image[k + c] = sample_rescale(status.depth, extract_bits_big(&data, &bit, &size, status.depth));
+					k = (i * status.width + j) * pixel_size;
+					if (pixel_size == 6)
+					{
+						sample = extract_bits_big(&br, 16);
+						memcpy(status.image + k + c * 2, &sample, 2);
+					}
+					else
+						status.image[k + c] = sample_rescale(status.depth, extract_bits_big(&br, status.depth));
 				}
-		for (i = 0; i < status.height; i++)
+		for (i = 0; native == 0 && i < status.height; i++)
 			for (j = 0; j < status.width; j++)
 			{
 				k = (i * status.width + j) * 4;
@@ -1600,28 +6309,113 @@ FINISH:
 	return status.image;
 }
 
-char *fluid_decode(const char *_data, int size, int *width, int *height)
+/* Read file header only */
+static int psd_info(const unsigned char *data, int size, FLUID_info *info)
 {
-	const unsigned char *data = _data;
+	PSD_status status;
+
+	if (!psd_read_header(&status, data, size) || status.width <= 0 || status.height <= 0)
+		return 0;
+	info->format = FLUID_FORMAT_PSD;
+	info->width = status.width;
+	info->height = status.height;
+	info->channels = status.channels;
+	info->depth = status.depth;
+	info->interlaced = 0;
+	info->layout = psd_native_layout(&status);
+	return 1;
+}
+
+/* Identify image format from signature
+ * Return: FLUID_FORMAT_*, or 0 if unknown
+ */
+static int fluid_detect_format(const unsigned char *data, int size)
+{
+	if (size >= 8 && data[0] == 137 && data[1] == 80 && data[2] == 78 && data[3] == 71 &&
+		data[4] == 13 && data[5] == 10 && data[6] == 26 && data[7] == 10)
+		return FLUID_FORMAT_PNG;
+	if (size >= 1 && data[0] == 0xFF)
+		return FLUID_FORMAT_JPEG;
+	if (size >= 4 && data[0] == '8' && data[1] == 'B' && data[2] == 'P' && data[3] == 'S')
+		return FLUID_FORMAT_PSD;
+	return 0;
+}
+
+char *fluid_decode(const char *data, int size, int *width, int *height)
+{
+	return fluid_decode_ex(data, size, width, height, NULL);
+}
+
+/* Decode an image, or only its region if not NULL */
+static char *fluid_decode_image(const unsigned char *data, int size, int *width, int *height, const FLUID_options *options, const IMAGE_region *region)
+{
+	char *image = NULL, *cropped;
+	int format, pixel_size;
+	FLUID_info info;
+
 	/* Identify image format and call corresponding image decoder */
-	/* Check PNG */
-	if (size >= 8)
-	{
-		if (data[0] == 137 && data[1] == 80 && data[2] == 78 && data[3] == 71 &&
-			data[4] == 13 && data[5] == 10 && data[6] == 26 && data[7] == 10)
-			return png_decode(data + 8, size - 8, width, height);
-	}
-	/* Check JPEG */
-	if (size >= 1)
+	format = fluid_detect_format(data, size);
+	if (format == FLUID_FORMAT_PNG)
+		return png_decode(data + 8, size - 8, width, height, options, region);
+	else if (format == FLUID_FORMAT_JPEG)
+		image = jpeg_decode(data, size, width, height, options);
+	else if (format == FLUID_FORMAT_PSD)
+		image = psd_decode(data + 4, size - 4, width, height, options->native);
+	if (!image || !region)
+		return image;
+	/* Other formats are cropped after decoding */
+	pixel_size = 4;
+	if (options->native && fluid_info((const char *) data, size, &info))
+		pixel_size = layout_pixel_size[info.layout];
+	cropped = NULL;
+	if (region->x1 <= *width && region->y1 <= *height)
+		cropped = (char *) crop_image((unsigned char *) image, *width, pixel_size, region, 0);
+	free(image);
+	return cropped;
+}
+
+char *fluid_decode_ex(const char *data, int size, int *width, int *height, const FLUID_options *options)
+{
+	FLUID_options defaults;
+
+	if (!options)
 	{
-		if (data[0] == 0xFF)
-			return jpeg_decode(data, size, width, height);
+		memset(&defaults, 0, sizeof(defaults));
+		options = &defaults;
 	}
-	/* Check PSD */
-	if (size >= 4)
+	return fluid_decode_image((const unsigned char *) data, size, width, height, options, NULL);
+}
+
+char *fluid_decode_region(const char *data, int size, int x0, int y0, int x1, int y1, int *width, int *height, const FLUID_options *options)
+{
+	FLUID_options defaults;
+	IMAGE_region region;
+
+	if (x0 < 0 || y0 < 0 || x1 <= x0 || y1 <= y0)
+		return NULL;
+	if (!options)
 	{
-		if (data[0] == '8' && data[1] == 'B' && data[2] == 'P' && data[3] == 'S')
-			return psd_decode(data + 4, size - 4, width, height);
+		memset(&defaults, 0, sizeof(defaults));
+		options = &defaults;
 	}
-	return NULL;
+	region.x0 = x0;
+	region.y0 = y0;
+	region.x1 = x1;
+	region.y1 = y1;
+	return fluid_decode_image((const unsigned char *) data, size, width, height, options, &region);
+}
+
+int fluid_info(const char *_data, int size, FLUID_info *info)
+{
+	const unsigned char *data = (const unsigned char *) _data;
+	int format;
+
+	format = fluid_detect_format(data, size);
+	if (format == FLUID_FORMAT_PNG)
+		return png_info(data + 8, size - 8, info);
+	else if (format == FLUID_FORMAT_JPEG)
+		return jpeg_info(data, size, info);
+	else if (format == FLUID_FORMAT_PSD)
+		return psd_info(data + 4, size - 4, info);
+	return 0;
 }
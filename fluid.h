@@ -32,6 +32,203 @@ extern "C" {
  */
 char *fluid_decode(const char *data, int size, int *width, int *height);
 
+/* Pixel layouts of FLUID_info, 16-bit samples are in native byte order */
+#define FLUID_LAYOUT_RGBA8	0
+#define FLUID_LAYOUT_G8		1
+#define FLUID_LAYOUT_GA8	2
+#define FLUID_LAYOUT_RGB8	3
+#define FLUID_LAYOUT_G16	4
+#define FLUID_LAYOUT_GA16	5
+#define FLUID_LAYOUT_RGB16	6
+#define FLUID_LAYOUT_RGBA16	7
+#define FLUID_LAYOUT_INDEX8	8 /* Palette indices, followed by 256 RGBA palette entries */
+
+/* Formats of FLUID_info */
+#define FLUID_FORMAT_PNG	1
+#define FLUID_FORMAT_JPEG	2
+#define FLUID_FORMAT_PSD	3
+
+/*
+ * FLUID_info: Image properties stored in the header
+ * @format: Image format, FLUID_FORMAT_*
+ * @width: Width of the image in pixels
+ * @height: Height of the image in pixels
+ * @channels: Samples per pixel as stored, 1 for palette indices
+ * @depth: Bits per sample
+ * @interlaced: Nonzero for Adam7 interlaced PNG or progressive JPEG
+ * @layout: Native pixel layout decoded with the native option, FLUID_LAYOUT_*
+ */
+typedef struct
+{
+	int format;
+	int width, height;
+	int channels;
+	int depth;
+	int interlaced;
+	int layout;
+} FLUID_info;
+
+/*
+ * fluid_info: Read image properties without decoding
+ * Only the PNG IHDR chunk, the JPEG segments up to SOFn or the PSD file
+ * header are parsed, and nothing is allocated. An image read successfully
+ * may still fail to decode, e.g. a progressive JPEG.
+ * @data: [in] The image data, at least up to the header
+ * @size: [in] Size of the data in bytes
+ * @info: [out] Image properties
+ * Return: 1 if succeeded, 0 if the header is invalid or format unknown
+ */
+int fluid_info(const char *data, int size, FLUID_info *info);
+
+/*
+ * FLUID_progress: Progress callback of interlaced image decoding
+ * Pixels of decoded passes fill the blocks which later passes refine, so the
+ * whole image is a preview from the first pass, which needs about 1/64 of
+ * the data. A pass is shown as soon as the complete IDAT chunks hold its
+ * data, even if the rest of the image is missing and decoding then fails.
+ * @data: [in] progress_data of options
+ * @image: [in] Raw RGBA preview, valid only during the call
+ * @width: [in] Width of the image in pixels
+ * @height: [in] Height of the image in pixels
+ * @pass: [in] Number of passes decoded, 1 to 7
+ */
+typedef void (*FLUID_progress)(void *data, const char *image, int width, int height, int pass);
+
+/*
+ * FLUID_options: Decoding options, zero-initialize for defaults
+ * @threads: Maximum number of threads to decode with, 0 or 1 to decode in
+ *   the calling thread only. Large PNG images are inflated and defiltered
+ *   in parallel. Large JPEG images are decoded in parallel between restart
+ *   markers, or else transformed and converted by other threads while one
+ *   thread decodes.
+ * @verify: Nonzero to fail on corrupted data: PNG chunk CRCs and the zlib
+ *   Adler-32 checksum are checked while decoding.
+ * @progress: If set, interlaced PNG images are decoded progressively, and
+ *   this is called after each of the 7 Adam7 passes.
+ * @progress_data: [in] Passed to progress
+ * @native: Nonzero to output the layout of fluid_info instead of RGBA, with
+ *   samples of 1, 2 or 4 bits widened to 8 bits. PNG transparent color keys
+ *   of gray and truecolor images are not applied, and progress is not used.
+ * @smooth: Nonzero to interpolate subsampled JPEG chroma with a triangle
+ *   filter, as libjpeg does by default, instead of repeating the samples.
+ */
+typedef struct
+{
+	int threads;
+	int verify;
+	FLUID_progress progress;
+	void *progress_data;
+	int native;
+	int smooth;
+} FLUID_options;
+
+/*
+ * fluid_decode_ex: Decode an image with options
+ * @data: [in] The image data
+ * @size: [in] Size of the data in bytes
+ * @width: [out] Width of the image in pixels
+ * @height: [out] Height of the image in pixels
+ * @options: [in] Decoding options, or NULL for defaults
+ * Return: Raw RGBA data, or pixels of the native layout, or NULL if failed
+ */
+char *fluid_decode_ex(const char *data, int size, int *width, int *height, const FLUID_options *options);
+
+/*
+ * fluid_decode_region: Decode a rectangle of an image
+ * Only the rows up to y1 of non-interlaced PNG images are inflated and
+ * defiltered, and only pixels in the rectangle are converted. If y1 is
+ * less than the height, the Adler-32 checksum is not verified. Other
+ * images are decoded whole and cropped.
+ * @data: [in] The image data
+ * @size: [in] Size of the data in bytes
+ * @x0, @y0: [in] Top left pixel of the rectangle
+ * @x1, @y1: [in] Pixel after the bottom right one, at most the image size
+ * @width: [out] Width of the whole image in pixels
+ * @height: [out] Height of the whole image in pixels
+ * @options: [in] Decoding options, or NULL for defaults
+ * Return: Raw data of (x1 - x0) * (y1 - y0) pixels, or NULL if failed
+ */
+char *fluid_decode_region(const char *data, int size, int x0, int y0, int x1, int y1, int *width, int *height, const FLUID_options *options);
+
+/* Animated PNG (APNG) images are decoded frame by frame onto a canvas. */
+typedef struct FLUID_animation FLUID_animation;
+
+/*
+ * fluid_animation_open: Start decoding the frames of a PNG image
+ * Only the rectangle of each frame is decoded, and composited onto the
+ * canvas kept between frames. Buffers for a frame of the canvas size are
+ * allocated here and reused. A PNG image without animation has 1 frame.
+ * @data: [in] The image data, which must be valid until closed
+ * @size: [in] Size of the data in bytes
+ * @width: [out] Width of the canvas in pixels
+ * @height: [out] Height of the canvas in pixels
+ * @frames: [out] Number of frames
+ * @plays: [out] Number of times to play the frames, 0 to loop forever
+ * @options: [in] Decoding options, or NULL for defaults. Only verify is used.
+ * Return: Animation context, or NULL if failed
+ */
+FLUID_animation *fluid_animation_open(const char *data, int size, int *width, int *height, int *frames, int *plays, const FLUID_options *options);
+
+/*
+ * fluid_animation_next: Decode the next frame
+ * After the last frame, the animation starts over from a cleared canvas.
+ * @animation: [in] Animation context
+ * @delay: [out] Time to show the frame in milliseconds
+ * Return: Raw RGBA data of the canvas, valid until the next call or close,
+ *   or NULL if failed
+ */
+const char *fluid_animation_next(FLUID_animation *animation, int *delay);
+
+/*
+ * fluid_animation_close: Free animation context
+ * @animation: [in] Animation context
+ */
+void fluid_animation_close(FLUID_animation *animation);
+
+/* Formats of fluid_inflate_init */
+#define FLUID_INFLATE_RAW	0 /* Raw deflate */
+#define FLUID_INFLATE_ZLIB	1
+#define FLUID_INFLATE_GZIP	2 /* First member of gzip data */
+
+/* Results of fluid_inflate_feed */
+#define FLUID_INFLATE_ERROR	-1
+#define FLUID_INFLATE_MORE	0 /* Needs more input or output space */
+#define FLUID_INFLATE_END	1 /* End of stream, all output is copied */
+
+typedef struct FLUID_inflate FLUID_inflate;
+
+/*
+ * fluid_inflate_init: Start decompressing a deflate stream
+ * @format: [in] Stream format, FLUID_INFLATE_*
+ * Return: Decompression context, or NULL if failed
+ */
+FLUID_inflate *fluid_inflate_init(int format);
+
+/*
+ * fluid_inflate_feed: Decompress a slice of input
+ * Input may be split at any byte. Output is buffered after the 32K window
+ * the stream refers to, so call again with more output space while the
+ * output is filled. zlib and gzip checksums are verified.
+ * @stream: [in] Decompression context
+ * @in: [in] Next input data
+ * @in_size: [in] Size of input data in bytes
+ * @in_used: [out] Bytes of input taken, the rest must be passed again
+ *   Input after the end of stream is never taken.
+ * @out: [out] Output buffer
+ * @out_size: [in] Size of output buffer in bytes
+ * @out_used: [out] Bytes written to output buffer
+ * Return: FLUID_INFLATE_MORE, FLUID_INFLATE_END, or FLUID_INFLATE_ERROR if
+ *   data is invalid
+ */
+int fluid_inflate_feed(FLUID_inflate *stream, const char *in, int in_size, int *in_used, char *out, int out_size, int *out_used);
+
+/*
+ * fluid_inflate_finish: Free decompression context
+ * @stream: [in] Decompression context
+ * Return: 1 if the stream ended and all output is copied, 0 otherwise
+ */
+int fluid_inflate_finish(FLUID_inflate *stream);
+
 #ifdef __cplusplus
 }
 #endif